@@ -0,0 +1,490 @@
+// Benchmarks for the parse/evaluate pipeline. Every stage runs over the same
+// synthetic corpus, and the results come out as one JSON document on stdout
+// so runs can be compared across versions:
+//
+//     calc_bench [--count N] [--seed S] [--min-time SECONDS] [--stream-mb MB]
+//                [--big-digits N] [--alloc-budget A] [--rss-budget-mb MB]
+//
+// With --alloc-budget, the stages that should not allocate once warm make the
+// run exit with status 1 if they average more than A allocations per
+// expression. With --rss-budget-mb, so does the streaming evaluator if the
+// process's peak RSS grows by more than MB megabytes while it runs. ctest
+// runs both checks.
+//
+// The calculator is compiled into this file directly, so internal stages
+// (tokenize, infixToPostfix, ...) can be timed on their own.
+#define CALCULATOR_NO_MAIN
+#include "../calculator.cpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <random>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+// Every allocation in the process goes through here, so a benchmark can count
+// allocations by reading the counters before and after its loop.
+static std::atomic<size_t> allocationCount{0};
+static std::atomic<size_t> allocatedBytes{0};
+
+// All of these are kept out of line: GCC otherwise pairs an inlined malloc()
+// or free() with the builtin operator new or delete and warns about a mismatch.
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void* operator new(size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void operator delete(void* p) noexcept { std::free(p); }
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+const char* const VARIABLE_NAMES[] = {"x", "y", "z", "rate", "total", "alpha", "beta", "count"};
+const char* const FUNCTION_NAMES[] = {"sin", "cos", "sqrt", "abs", "exp", "ln", "log"};
+
+class CorpusGenerator {
+public:
+    explicit CorpusGenerator(uint64_t seed) : rng(seed) {}
+
+    std::string number() {
+        std::string s = std::to_string(uniform(1, 99));
+        if (uniform(0, 2) == 0)
+            s += "." + std::to_string(uniform(0, 99));
+        return s;
+    }
+
+    std::string variable() { return VARIABLE_NAMES[uniform(0, 7)]; }
+    std::string function() { return FUNCTION_NAMES[uniform(0, 6)]; }
+
+    // Division is only ever by a literal, so no expression divides by zero.
+    std::string binary(const std::string& left, const std::string& right) {
+        switch (uniform(0, 4)) {
+            case 0: return left + " + " + right;
+            case 1: return left + " - " + right;
+            case 2: return left + " * " + right;
+            case 3: return left + " / " + number();
+            default: return "(" + left + ") * " + right;
+        }
+    }
+
+    std::string shortArithmetic() {
+        std::string expr = number();
+        for (int i = uniform(1, 3); i > 0; i--)
+            expr = binary(expr, number());
+        return expr;
+    }
+
+    std::string functionHeavy() {
+        std::string expr = function() + "(" + number() + ")";
+        for (int i = uniform(2, 4); i > 0; i--) {
+            std::string call = function() + "(" + binary(number(), variable()) + ")";
+            if (uniform(0, 1))
+                call = function() + "(" + call + ")";
+            expr = binary(expr, call);
+        }
+        return expr;
+    }
+
+    std::string variableHeavy() {
+        std::string expr = variable();
+        for (int i = uniform(4, 8); i > 0; i--)
+            expr = binary(expr, uniform(0, 3) ? variable() : number() + variable());
+        return expr;
+    }
+
+    std::string deeplyNested() {
+        std::string expr = variable();
+        for (int i = uniform(20, 40); i > 0; i--) {
+            if (uniform(0, 3) == 0)
+                expr = function() + "(" + expr + ")";
+            else
+                expr = "(" + binary(expr, uniform(0, 1) ? number() : variable()) + ")";
+        }
+        return expr;
+    }
+
+    std::string veryLong() {
+        std::string expr = number();
+        for (int i = uniform(150, 250); i > 0; i--)
+            expr = binary(expr, uniform(0, 2) ? number() : variable());
+        return expr;
+    }
+
+    // Single linear equations and small systems in the unknowns a..e.
+    std::string linearEquation() {
+        int unknowns = uniform(1, 4);
+        std::string system;
+        for (int row = 0; row < unknowns; row++) {
+            std::string lhs, rhs = number();
+            for (int col = 0; col < unknowns; col++) {
+                std::string term = number() + std::string(1, static_cast<char>('a' + col));
+                lhs = lhs.empty() ? term : lhs + (uniform(0, 1) ? " + " : " - ") + term;
+            }
+            if (uniform(0, 2) == 0)
+                rhs += " - " + number() + "a";
+            system += (row ? "; " : "") + lhs + " = " + rhs;
+        }
+        return system;
+    }
+
+private:
+    int uniform(int lo, int hi) { return std::uniform_int_distribution<int>(lo, hi)(rng); }
+
+    std::mt19937_64 rng;
+};
+
+struct Corpus {
+    const char* name;
+    std::vector<std::string> expressions;
+};
+
+struct Measurement {
+    size_t iterations = 0;
+    double seconds = 0;
+    size_t allocations = 0;
+    size_t bytes = 0;
+};
+
+double minTime = 0.2;
+double allocationBudget = -1;  // none
+long rssBudgetKb = -1;         // none
+std::vector<std::string> overBudget;
+volatile double sink;
+
+// Runs one full pass over the corpus per iteration until minTime has elapsed,
+// after `warmups` passes that fill caches and thread_local buffers.
+template <typename Pass>
+Measurement measure(Pass pass, unsigned warmups = 1) {
+    for (unsigned i = 0; i < warmups; i++)
+        pass();
+
+    using Clock = std::chrono::steady_clock;
+    Measurement m;
+    size_t allocationsBefore = allocationCount.load();
+    size_t bytesBefore = allocatedBytes.load();
+    auto start = Clock::now();
+    do {
+        pass();
+        m.iterations++;
+        m.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (m.seconds < minTime);
+    m.allocations = allocationCount.load() - allocationsBefore;
+    m.bytes = allocatedBytes.load() - bytesBefore;
+    return m;
+}
+
+// Peak resident set size of this process so far, in KiB (0 if unknown).
+long peakRssKb() {
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+class JsonReport {
+public:
+    void add(const char* benchmark, const Corpus& corpus, const Measurement& m) {
+        double exprs = static_cast<double>(m.iterations) * corpus.expressions.size();
+        char line[512];
+        std::snprintf(line, sizeof(line),
+                      "    {\"benchmark\": \"%s\", \"corpus\": \"%s\", \"expressions\": %zu, \"iterations\": %zu, "
+                      "\"ns_per_expr\": %.2f, \"exprs_per_sec\": %.0f, \"allocs_per_expr\": %.3f, "
+                      "\"bytes_per_expr\": %.1f}",
+                      benchmark, corpus.name, corpus.expressions.size(), m.iterations,
+                      m.seconds * 1e9 / exprs, exprs / m.seconds, m.allocations / exprs, m.bytes / exprs);
+        results.push_back(line);
+    }
+
+    void setStreaming(const std::string& json) { streaming = json; }
+    void setBigNumbers(const std::string& json) { bigNumbers = json; }
+
+    void print(uint64_t seed, size_t count) const {
+        std::printf("{\n  \"seed\": %llu,\n  \"count\": %zu,\n  \"min_time\": %g,\n",
+                    static_cast<unsigned long long>(seed), count, minTime);
+        if (!streaming.empty())
+            std::printf("  \"streaming\": %s,\n", streaming.c_str());
+        if (!bigNumbers.empty())
+            std::printf("  \"bignum\": %s,\n", bigNumbers.c_str());
+        std::printf("  \"results\": [\n");
+        for (size_t i = 0; i < results.size(); i++)
+            std::printf("%s%s\n", results[i].c_str(), i + 1 < results.size() ? "," : "");
+        std::printf("  ]\n}\n");
+    }
+
+private:
+    std::vector<std::string> results;
+    std::string streaming;
+    std::string bigNumbers;
+};
+
+// Records a stage that is meant to run without allocating once warm if it
+// went over the allocation budget.
+void checkAllocations(const char* benchmark, const Corpus& corpus, const Measurement& m) {
+    double perExpr = static_cast<double>(m.allocations) / (m.iterations * corpus.expressions.size());
+    if (allocationBudget >= 0 && perExpr > allocationBudget) {
+        char line[256];
+        std::snprintf(line, sizeof(line), "%s on %s: %.3f allocations per expression, budget %g", benchmark,
+                      corpus.name, perExpr, allocationBudget);
+        overBudget.push_back(line);
+    }
+}
+
+void benchmarkPipeline(const Corpus& corpus, JsonReport& report) {
+    auto addSteady = [&](const char* benchmark, const Measurement& m) {
+        report.add(benchmark, corpus, m);
+        checkAllocations(benchmark, corpus, m);
+    };
+
+    std::vector<std::vector<Token>> tokenized(corpus.expressions.size());
+    std::vector<std::vector<Token>> postfix(corpus.expressions.size());
+    for (size_t i = 0; i < corpus.expressions.size(); i++) {
+        tokenize(corpus.expressions[i], tokenized[i]);
+        infixToPostfix(tokenized[i], postfix[i]);
+    }
+
+    std::vector<Token> tokens;
+    addSteady("tokenize", measure([&] {
+        for (const auto& expr : corpus.expressions)
+            tokenize(expr, tokens);
+    }));
+
+    std::vector<Token> queue;
+    addSteady("infixToPostfix", measure([&] {
+        for (const auto& t : tokenized)
+            infixToPostfix(t, queue);
+    }));
+
+    addSteady("evaluatePostfix", measure([&] {
+        double total = 0;
+        for (size_t i = 0; i < postfix.size(); i++)
+            total += evaluatePostfix(postfix[i], corpus.expressions[i]);
+        sink = total;
+    }));
+
+    CompiledExpression program;
+    report.add("compileExpression", corpus, measure([&] {
+        for (const auto& expr : corpus.expressions)
+            compileExpression(expr, program);
+    }));
+
+    std::vector<CompiledExpression> programs(corpus.expressions.size());
+    for (size_t i = 0; i < programs.size(); i++)
+        compileExpression(corpus.expressions[i], programs[i]);
+
+    unsigned savedThreshold = jitThreshold;
+    jitThreshold = ~0u;
+    addSteady("runProgram.interpreter", measure([&] {
+        double total = 0, value = 0;
+        for (const auto& p : programs) {
+            runProgram(p, value);
+            total += value;
+        }
+        sink = total;
+    }));
+    jitThreshold = savedThreshold;
+
+#ifdef CALC_HAVE_JIT
+    for (const auto& p : programs)
+        p.jit = jitCompile(p);
+    addSteady("runProgram.jit", measure([&] {
+        double total = 0, value = 0;
+        for (const auto& p : programs) {
+            runProgram(p, value);
+            total += value;
+        }
+        sink = total;
+    }));
+#endif
+
+    // The whole batch path for one line: cache lookup, evaluation, formatting.
+    // Warming up until the cached programs are compiled to native code keeps
+    // the one-time compilation out of the numbers.
+    std::string out;
+    addSteady("end_to_end", measure([&] {
+        for (const auto& expr : corpus.expressions) {
+            out.clear();
+            evaluateBatchLine(expr, out);
+        }
+    }, jitThreshold + 1));
+}
+
+// Writes a machine-generated expression of about the given size: blocks of
+// 100000 nested parentheses, added together.
+size_t writeHugeExpression(FILE* file, size_t bytes) {
+    const int DEPTH = 100000;
+    const char* const OPS[] = {")*0.5", ")+1", ")-0.25"};
+    std::string block(DEPTH, '(');
+    block += "1.5";
+    for (int i = 0; i < DEPTH; i++)
+        block += OPS[i % 3];
+
+    size_t written = 0;
+    while (written < bytes) {
+        if (written) {
+            fputs(" + ", file);
+            written += 3;
+        }
+        fwrite(block.data(), 1, block.size(), file);
+        written += block.size();
+    }
+    return written;
+}
+
+// Streams a huge expression from a file and records how much memory the
+// process needed at its peak, before and after, to show the evaluator's
+// footprint does not grow with the input. Runs before anything else so the
+// earlier peak is only the process baseline.
+std::string benchmarkStreaming(size_t megabytes) {
+    FILE* file = std::tmpfile();
+    if (!file)
+        return "{\"error\": \"cannot create temporary file\"}";
+    size_t bytes = writeHugeExpression(file, megabytes << 20);
+    fflush(file);
+    rewind(file);
+
+    long rssBefore = peakRssKb();
+    auto start = std::chrono::steady_clock::now();
+    double result = evaluateFile(file);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    long rssAfter = peakRssKb();
+    fclose(file);
+    sink = result;
+    if (rssBudgetKb >= 0 && rssAfter - rssBefore > rssBudgetKb) {
+        char line[256];
+        std::snprintf(line, sizeof(line), "streaming %zu MB: peak RSS grew by %ld KiB, budget %ld KiB", megabytes,
+                      rssAfter - rssBefore, rssBudgetKb);
+        overBudget.push_back(line);
+    }
+
+    char json[320];
+    std::snprintf(json, sizeof(json),
+                  "{\"input_bytes\": %zu, \"seconds\": %.3f, \"ns_per_byte\": %.2f, \"mb_per_sec\": %.1f, "
+                  "\"peak_rss_kb_before\": %ld, \"peak_rss_kb_after\": %ld}",
+                  bytes, seconds, seconds * 1e9 / bytes, bytes / seconds / (1 << 20), rssBefore, rssAfter);
+    return json;
+}
+
+// Times the arbitrary precision kernels once each at the given number of
+// significant digits, in milliseconds.
+std::string benchmarkBigNumbers(size_t digits) {
+    size_t precision = (digits + BIG_DIGITS - 1) / BIG_DIGITS + 2;
+    BigFloat three = bigFromInteger(3), seven = bigFromInteger(7);
+    BigFloat third = bigDiv(bigFromInteger(1), three, precision);
+    BigFloat root = bigSqrt(seven, precision);
+
+    std::string json = "{\"digits\": " + std::to_string(digits);
+    auto time = [&](const char* name, auto&& run) {
+        auto start = std::chrono::steady_clock::now();
+        BigFloat result = run();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        sink = static_cast<double>(result.limbs.size());
+        char field[64];
+        std::snprintf(field, sizeof(field), ", \"%s_ms\": %.2f", name, ms);
+        json += field;
+    };
+    time("multiply", [&] { return bigMul(third, root, precision); });
+    time("divide", [&] { return bigDiv(root, third, precision); });
+    time("sqrt", [&] { return bigSqrt(root, precision); });
+    time("pi", [&] { return bigPi(precision); });
+    time("e", [&] { return bigE(precision); });
+    time("exp", [&] { return bigExp(third, precision); });
+    time("ln", [&] { return bigLn(root, precision); });
+    time("sin", [&] { return applyBigFunction(findBuiltinFunction("sin"), root, precision); });
+    time("power", [&] { return bigPow(three, bigFromInteger(digits * 2), precision); });
+    return json + "}";
+}
+
+void benchmarkSolver(const Corpus& corpus, JsonReport& report) {
+    report.add("solveLinearEquation", corpus, measure([&] {
+        size_t total = 0;
+        for (const auto& equation : corpus.expressions)
+            total += solveLinearEquation(equation).size();
+        sink = static_cast<double>(total);
+    }));
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    size_t count = 500;
+    uint64_t seed = 42;
+    size_t streamMegabytes = 64;
+    size_t bigDigits = 100000;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--count" && i + 1 < argc) {
+            count = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--min-time" && i + 1 < argc) {
+            minTime = std::strtod(argv[++i], nullptr);
+        } else if (arg == "--stream-mb" && i + 1 < argc) {
+            streamMegabytes = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--big-digits" && i + 1 < argc) {
+            bigDigits = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--alloc-budget" && i + 1 < argc) {
+            allocationBudget = std::strtod(argv[++i], nullptr);
+        } else if (arg == "--rss-budget-mb" && i + 1 < argc) {
+            rssBudgetKb = std::strtol(argv[++i], nullptr, 10) * 1024;
+        } else {
+            std::fprintf(stderr, "Usage: calc_bench [--count N] [--seed S] [--min-time SECONDS] [--stream-mb MB] "
+                                 "[--big-digits N] [--alloc-budget A] [--rss-budget-mb MB]\n");
+            return 1;
+        }
+    }
+    if (count == 0)
+        count = 1;
+
+    for (size_t i = 0; i < sizeof(VARIABLE_NAMES) / sizeof(VARIABLE_NAMES[0]); i++)
+        variables.set(VARIABLE_NAMES[i], 1.5 + 0.25 * i);
+
+    JsonReport report;
+    if (streamMegabytes)
+        report.setStreaming(benchmarkStreaming(streamMegabytes));
+    if (bigDigits)
+        report.setBigNumbers(benchmarkBigNumbers(bigDigits));
+
+    CorpusGenerator generator(seed);
+    std::vector<Corpus> corpora = {{"short", {}}, {"functions", {}}, {"variables", {}},
+                                   {"nested", {}}, {"long", {}}};
+    Corpus equations{"linear", {}};
+    for (size_t i = 0; i < count; i++) {
+        corpora[0].expressions.push_back(generator.shortArithmetic());
+        corpora[1].expressions.push_back(generator.functionHeavy());
+        corpora[2].expressions.push_back(generator.variableHeavy());
+        corpora[3].expressions.push_back(generator.deeplyNested());
+        corpora[4].expressions.push_back(generator.veryLong());
+        equations.expressions.push_back(generator.linearEquation());
+    }
+
+    for (const auto& corpus : corpora)
+        benchmarkPipeline(corpus, report);
+    benchmarkSolver(equations, report);
+    report.print(seed, count);
+    for (const auto& line : overBudget)
+        std::fprintf(stderr, "Over budget: %s\n", line.c_str());
+    return overBudget.empty() ? 0 : 1;
+}
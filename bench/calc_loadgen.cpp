@@ -0,0 +1,220 @@
+// Load generator for "calculator --serve". Opens several connections to the
+// server's Unix domain socket, keeps a number of requests in flight on each,
+// and reports throughput and latency percentiles as JSON.
+//
+//   calc_loadgen --socket PATH [--connections N] [--requests N] [--pipeline N]
+//   calc_loadgen --spawn ./calculator [--jobs N] ...
+//
+// With --spawn the server is started on a temporary socket and stopped at
+// the end.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const char* const EXPRESSIONS[] = {
+    "x * 2 + 1",
+    "sqrt(x^2 + y^2)",
+    "sin(x) * cos(y)",
+    "(x + 1) * (x - 1) / (y + 2)",
+    "exp(-x / 10) + ln(y + 1)",
+};
+
+int connectTo(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+        return -1;
+    std::strcpy(address.sun_path, path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool sendAll(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+struct ClientResult {
+    std::vector<double> latencies;  // microseconds, one per answered request
+    size_t errors = 0;
+    bool failed = false;
+};
+
+// One connection: the first two requests set its variables, the rest cycle
+// through EXPRESSIONS, with every 50th request reassigning x. At most
+// `pipeline` requests are outstanding at a time.
+void runClient(const std::string& path, size_t requests, size_t pipeline, int index, ClientResult& result) {
+    int fd = connectTo(path);
+    if (fd < 0) {
+        result.failed = true;
+        return;
+    }
+
+    std::vector<Clock::time_point> sentAt(requests);
+    result.latencies.reserve(requests);
+    size_t nextToSend = 0, answered = 0;
+    std::string out, in;
+    char buffer[1 << 16];
+    while (answered < requests) {
+        out.clear();
+        for (; nextToSend < requests && nextToSend - answered < pipeline; nextToSend++) {
+            std::string expr;
+            if (nextToSend == 0)
+                expr = "x = " + std::to_string(index + 1);
+            else if (nextToSend == 1)
+                expr = "y = 2.5";
+            else if (nextToSend % 50 == 0)
+                expr = "x = " + std::to_string(nextToSend % 97);
+            else
+                expr = EXPRESSIONS[nextToSend % (sizeof(EXPRESSIONS) / sizeof(EXPRESSIONS[0]))];
+            out += "{\"id\": " + std::to_string(nextToSend) + ", \"expr\": \"" + expr + "\"}\n";
+            sentAt[nextToSend] = Clock::now();
+        }
+        if (!out.empty() && !sendAll(fd, out)) {
+            result.failed = true;
+            break;
+        }
+
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n <= 0) {
+            result.failed = true;
+            break;
+        }
+        Clock::time_point now = Clock::now();
+        in.append(buffer, static_cast<size_t>(n));
+        size_t start = 0;
+        for (size_t end; (end = in.find('\n', start)) != std::string::npos; start = end + 1) {
+            size_t id = std::strtoul(in.c_str() + start + 7, nullptr, 10);  // after {"id":
+            if (id < requests)
+                result.latencies.push_back(std::chrono::duration<double, std::micro>(now - sentAt[id]).count());
+            if (in.find("\"error\"", start) < end)
+                result.errors++;
+            answered++;
+        }
+        in.erase(0, start);
+    }
+    close(fd);
+}
+
+double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t i = static_cast<size_t>(p / 100 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    std::string path, spawn;
+    size_t connections = 16, requests = 20000, pipeline = 8;
+    int jobs = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--socket" && i + 1 < argc) {
+            path = argv[++i];
+        } else if (arg == "--spawn" && i + 1 < argc) {
+            spawn = argv[++i];
+        } else if (arg == "--jobs" && i + 1 < argc) {
+            jobs = std::atoi(argv[++i]);
+        } else if (arg == "--connections" && i + 1 < argc) {
+            connections = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--requests" && i + 1 < argc) {
+            requests = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--pipeline" && i + 1 < argc) {
+            pipeline = std::strtoul(argv[++i], nullptr, 10);
+        } else {
+            std::fprintf(stderr, "Usage: calc_loadgen --socket PATH | --spawn CALCULATOR [--jobs N] "
+                                 "[--connections N] [--requests N] [--pipeline N]\n");
+            return 1;
+        }
+    }
+    if ((path.empty() && spawn.empty()) || connections == 0 || requests < 2 || pipeline == 0) {
+        std::fprintf(stderr, "calc_loadgen: need --socket or --spawn, and at least 2 requests\n");
+        return 1;
+    }
+
+    pid_t server = -1;
+    if (!spawn.empty()) {
+        if (path.empty())
+            path = "/tmp/calc_loadgen." + std::to_string(getpid()) + ".sock";
+        std::string jobsText = std::to_string(jobs > 0 ? jobs : static_cast<int>(std::thread::hardware_concurrency()));
+        server = fork();
+        if (server == 0) {
+            execl(spawn.c_str(), spawn.c_str(), "--serve", path.c_str(), "--jobs", jobsText.c_str(),
+                  static_cast<char*>(nullptr));
+            _exit(127);
+        }
+        // Wait for the socket to accept connections.
+        for (int attempt = 0; attempt < 500; attempt++) {
+            int fd = connectTo(path);
+            if (fd >= 0) {
+                close(fd);
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    std::vector<ClientResult> results(connections);
+    std::vector<std::thread> clients;
+    Clock::time_point start = Clock::now();
+    for (size_t c = 0; c < connections; c++)
+        clients.emplace_back(runClient, path, requests, pipeline, static_cast<int>(c), std::ref(results[c]));
+    for (auto& client : clients)
+        client.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, nullptr, 0);
+    }
+
+    std::vector<double> latencies;
+    size_t errors = 0, failed = 0;
+    for (const auto& result : results) {
+        latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+        errors += result.errors;
+        failed += result.failed;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    std::printf("{\n  \"connections\": %zu,\n  \"requests_per_connection\": %zu,\n  \"pipeline\": %zu,\n",
+                connections, requests, pipeline);
+    std::printf("  \"answered\": %zu,\n  \"errors\": %zu,\n  \"failed_connections\": %zu,\n",
+                latencies.size(), errors, failed);
+    std::printf("  \"seconds\": %.3f,\n  \"requests_per_sec\": %.0f,\n", seconds, latencies.size() / seconds);
+    std::printf("  \"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}\n}\n",
+                percentile(latencies, 50), percentile(latencies, 90), percentile(latencies, 99),
+                percentile(latencies, 99.9), latencies.empty() ? 0.0 : latencies.back());
+    return failed ? 1 : 0;
+}
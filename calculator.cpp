@@ -9,6 +9,35 @@
 #include <sstream>
 #include <map>
 #include <stdexcept>
+#include <list>
+#include <cstdio>
+#include <cstring>
+#include <charconv>
+#include <string_view>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <type_traits>
+#include <memory>
+#include <set>
+#include <cstdint>
+#include <cfloat>
+#include <limits>
+#include <new>
+#include <random>
+
+#ifdef CALC_STATS
+#include <chrono>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <x86intrin.h>
+#endif
+#endif
 
 #ifdef _WIN32
 #include <windows.h>
@@ -24,409 +53,8313 @@ void clearScreen() {
     if (!GetConsoleScreenBufferInfo(hStdOut, &csbi)) return;
     cellCount = csbi.dwSize.X * csbi.dwSize.Y;
 
-    if (!FillConsoleOutputCharacter(hStdOut, ' ', cellCount, homeCoords, &count)) return;
-    if (!FillConsoleOutputAttribute(hStdOut, csbi.wAttributes, cellCount, homeCoords, &count)) return;
+    if (!FillConsoleOutputCharacter(hStdOut, ' ', cellCount, homeCoords, &count)) return;
+    if (!FillConsoleOutputAttribute(hStdOut, csbi.wAttributes, cellCount, homeCoords, &count)) return;
+
+    SetConsoleCursorPosition(hStdOut, homeCoords);
+}
+#else
+void clearScreen() {
+    std::cout << "\033[2J\033[1;1H";
+}
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CALC_HAVE_AVX2_KERNELS
+#include <immintrin.h>
+#endif
+
+#if defined(__x86_64__) && defined(__linux__)
+#define CALC_HAVE_JIT
+#include <sys/mman.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CALC_HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#define CALC_HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#endif
+
+enum CalcTokenType : unsigned char { NUMBER, OPERATOR, PARENTHESIS, FUNCTION, VARIABLE, COMMA };
+
+// Tokens are 16 bytes and trivially copyable. A function token carries its
+// index in the table of its FunctionKind and a variable token the position of
+// its name in the source text, so lexing never copies a lexeme.
+struct Token {
+    CalcTokenType type;
+    char op;            // operator or parenthesis, or the NumberKind of a NUMBER or FunctionKind of a FUNCTION
+    unsigned short id;  // function index, variable name length, UNARY_MINUS on '-', or commas seen after '('
+    unsigned int pos;   // offset of the lexeme in the source text
+    double value;
+};
+
+static_assert(sizeof(Token) == 16, "Token should stay 16 bytes");
+static_assert(std::is_trivially_copyable<Token>::value, "Token should be trivially copyable");
+
+const unsigned short UNARY_MINUS = 1;
+const unsigned short ELEMENTWISE = 2;  // id of the '*', '/' or '^' in ".*", "./" or ".^"
+
+// What a NUMBER token stands for, so that arbitrary precision can recompute
+// constants and re-read literals instead of using the double value.
+enum NumberKind : char { NUMBER_LITERAL = 0, NUMBER_PI = 'p', NUMBER_E = 'e', NUMBER_ZERO = '0' };
+
+// Which table a function token indexes: builtinFunctions, binaryFunctions,
+// matrixFunctions, or the user-defined functions of the active environment.
+// A FUNCTION_REDUCE token is a reduction whose id is its ReductionKind;
+// its body and variable stay in the source, at the token's position.
+enum FunctionKind : char { FUNCTION_BUILTIN = 0, FUNCTION_BINARY = 'b', FUNCTION_MATRIX = 'm', FUNCTION_USER = 'u',
+                           FUNCTION_REDUCE = 'r' };
+
+std::string_view tokenText(std::string_view source, const Token& token) {
+    return source.substr(token.pos, token.id);
+}
+
+// Unary minus binds tighter than * and / but looser than ^, so -2^2 is -4
+// and 2*-3 is -6.
+int precedence(const Token& token) {
+    if (token.op == '-' && token.id == UNARY_MINUS)
+        return 3;
+    if (token.op == '+' || token.op == '-')
+        return 1;
+    if (token.op == '*' || token.op == '/')
+        return 2;
+    if (token.op == '^')
+        return 4;
+    return 0;
+}
+
+bool isRightAssociative(char op) {
+    return op == '^';
+}
+
+void trim(std::string& s) {
+    s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](unsigned char ch){ return !std::isspace(ch); }));
+    s.erase(std::find_if(s.rbegin(), s.rend(), [](unsigned char ch){ return !std::isspace(ch); }).base(), s.end());
+}
+
+std::string_view trimView(std::string_view s) {
+    while (!s.empty() && isspace(static_cast<unsigned char>(s.front())))
+        s.remove_prefix(1);
+    while (!s.empty() && isspace(static_cast<unsigned char>(s.back())))
+        s.remove_suffix(1);
+    return s;
+}
+
+struct UserFunction;
+class BindingGraph;
+
+// A dense matrix of doubles, stored by rows in one block aligned to a cache
+// line for the SIMD kernels. Matrices move but are never copied implicitly;
+// evaluation shares them by pointer.
+struct Matrix {
+    size_t rows = 0, cols = 0;
+
+    Matrix() = default;
+    Matrix(size_t rows, size_t cols, bool zeroed = true) : rows(rows), cols(cols) {
+        if (rows && cols > (size_t(1) << 28) / rows)
+            throw std::runtime_error("Matrix is too large!");
+        values.reset(static_cast<double*>(
+            ::operator new[](std::max<size_t>(size(), 1) * sizeof(double), std::align_val_t(64))));
+        if (zeroed)
+            std::fill(values.get(), values.get() + size(), 0.0);
+    }
+
+    size_t size() const { return rows * cols; }
+    double* data() { return values.get(); }
+    const double* data() const { return values.get(); }
+    double* operator[](size_t row) { return values.get() + row * cols; }
+    const double* operator[](size_t row) const { return values.get() + row * cols; }
+
+private:
+    struct AlignedDelete {
+        void operator()(double* p) const { ::operator delete[](p, std::align_val_t(64)); }
+    };
+    std::unique_ptr<double[], AlignedDelete> values;
+};
+
+// Variables are interned into slots: a name is looked up once, when an
+// expression is compiled, and evaluation reads the value straight out of a
+// flat array. Names live in a deque so the string_view keys stay valid.
+//
+// User-defined functions are never replaced in place: redefining a name adds
+// a new function, so code compiled against the old one keeps working, and
+// bumps functionGeneration so compiled-expression caches start over. Changing
+// a binding bumps it too, since sweeps compile bindings in by expansion.
+struct Environment {
+    std::unordered_map<std::string_view, int> slots;
+    std::deque<std::string> names;
+    std::vector<double> values;
+
+    std::vector<std::shared_ptr<const UserFunction>> functions;
+    std::unordered_map<std::string_view, int> functionSlots;
+    std::deque<std::string> functionNames;
+    unsigned functionGeneration = 0;
+
+    // Reactive bindings ("area := w * h"), created on first use.
+    std::shared_ptr<BindingGraph> bindings;
+
+    // Variables that hold matrices. A name is either here or in slots.
+    std::unordered_map<std::string, std::shared_ptr<Matrix>> matrices;
+
+    // Returns the slot of a variable, or -1 if it has never been assigned.
+    int find(std::string_view name) const {
+        auto it = slots.find(name);
+        return it == slots.end() ? -1 : it->second;
+    }
+
+    bool count(std::string_view name) const { return find(name) >= 0; }
+
+    double at(std::string_view name) const {
+        int slot = find(name);
+        if (slot < 0)
+            throw std::runtime_error("Unknown variable: " + std::string(name));
+        return values[slot];
+    }
+
+    int set(std::string_view name, double value) {
+        int slot = find(name);
+        if (slot < 0) {
+            slot = static_cast<int>(names.size());
+            names.emplace_back(name);
+            slots.emplace(names.back(), slot);
+            values.push_back(value);
+        } else {
+            values[slot] = value;
+        }
+        return slot;
+    }
+
+    size_t size() const { return names.size(); }
+
+    // Removes the variable assigned last. Nothing compiled may refer to it.
+    void removeLast() {
+        slots.erase(names.back());
+        names.pop_back();
+        values.pop_back();
+    }
+
+    // Returns the index of the current definition of a function, or -1.
+    int findFunction(std::string_view name) const {
+        if (functionSlots.empty())
+            return -1;
+        auto it = functionSlots.find(name);
+        return it == functionSlots.end() ? -1 : it->second;
+    }
+
+    int addFunction(std::string_view name, std::shared_ptr<const UserFunction> function) {
+        if (functions.size() >= 0xFFFF)
+            throw std::runtime_error("Too many function definitions!");
+        functions.push_back(std::move(function));
+        int index = static_cast<int>(functions.size() - 1);
+        auto it = functionSlots.find(name);
+        if (it == functionSlots.end()) {
+            functionNames.emplace_back(name);
+            functionSlots.emplace(functionNames.back(), index);
+        } else {
+            it->second = index;
+        }
+        functionGeneration++;
+        return index;
+    }
+};
+
+Environment variables;
+
+// The environment evaluation uses on this thread: the global one, or the
+// session a server worker is running.
+thread_local Environment* activeVariables = &variables;
+
+// Makes an environment the active one until the end of the scope.
+class ActiveVariablesScope {
+public:
+    explicit ActiveVariablesScope(Environment& environment) : outer(activeVariables) {
+        activeVariables = &environment;
+    }
+    ~ActiveVariablesScope() { activeVariables = outer; }
+
+private:
+    Environment* outer;
+};
+
+struct BuiltinFunction {
+    const char* name;
+    double (*fn)(double);
+    double (*derivative)(double);
+};
+
+const BuiltinFunction builtinFunctions[] = {
+    {"sin",  [](double x) { return sin(x); },      [](double x) { return cos(x); }},
+    {"cos",  [](double x) { return cos(x); },      [](double x) { return -sin(x); }},
+    {"tan",  [](double x) { return tan(x); },      [](double x) { return 1 / (cos(x) * cos(x)); }},
+    {"log",  [](double x) { return log10(x); },    [](double x) { return 1 / (x * M_LN10); }},
+    {"ln",   [](double x) { return log(x); },      [](double x) { return 1 / x; }},
+    {"sqrt", [](double x) { return sqrt(x); },     [](double x) { return 0.5 / sqrt(x); }},
+    {"abs",  [](double x) { return std::abs(x); }, [](double x) { return x > 0 ? 1.0 : x < 0 ? -1.0 : 0.0; }},
+    {"exp",  [](double x) { return std::exp(x); }, [](double x) { return std::exp(x); }},
+};
+
+const int BUILTIN_FUNCTION_COUNT = sizeof(builtinFunctions) / sizeof(builtinFunctions[0]);
+
+int findBuiltinFunction(std::string_view name) {
+    for (int i = 0; i < BUILTIN_FUNCTION_COUNT; i++) {
+        if (name == builtinFunctions[i].name)
+            return i;
+    }
+    return -1;
+}
+
+// Builtins of two arguments, called as min(a, b). pow(a, b) compiles to the
+// same code as a^b.
+struct BinaryFunction {
+    const char* name;
+    double (*fn)(double, double);
+};
+
+enum BinaryFunctionIndex { BINARY_MIN, BINARY_MAX, BINARY_POW, BINARY_ATAN2 };
+
+const BinaryFunction binaryFunctions[] = {
+    {"min",   [](double x, double y) { return std::fmin(x, y); }},
+    {"max",   [](double x, double y) { return std::fmax(x, y); }},
+    {"pow",   [](double x, double y) { return std::pow(x, y); }},
+    {"atan2", [](double y, double x) { return std::atan2(y, x); }},
+};
+
+const int BINARY_FUNCTION_COUNT = sizeof(binaryFunctions) / sizeof(binaryFunctions[0]);
+
+int findBinaryFunction(std::string_view name) {
+    for (int i = 0; i < BINARY_FUNCTION_COUNT; i++) {
+        if (name == binaryFunctions[i].name)
+            return i;
+    }
+    return -1;
+}
+
+// "sum(expr, k, a, b)" and its kin: expr reduced over k = a, a + 1, ..., b.
+// min and max with two arguments are the binary functions instead.
+// "integrate(expr, x, a, b[, tolerance])" reduces over the whole interval;
+// with a tolerance it is REDUCE_INTEGRAL_TOLERANCE.
+enum ReductionKind { REDUCE_SUM, REDUCE_PROD, REDUCE_MIN, REDUCE_MAX, REDUCE_INTEGRAL, REDUCE_INTEGRAL_TOLERANCE };
+
+const char* const reductionNames[] = {"sum", "prod", "min", "max", "integrate", "integrate"};
+
+const int REDUCTION_COUNT = sizeof(reductionNames) / sizeof(reductionNames[0]);
+
+int findReduction(std::string_view name) {
+    for (int i = 0; i < REDUCTION_COUNT; i++) {
+        if (name == reductionNames[i])
+            return i;
+    }
+    return -1;
+}
+
+bool isIntegral(int kind) { return kind == REDUCE_INTEGRAL || kind == REDUCE_INTEGRAL_TOLERANCE; }
+
+// Arguments of a reduction other than its body and variable: the range, and
+// the tolerance of an integral that has one.
+size_t reductionOperands(int kind) { return kind == REDUCE_INTEGRAL_TOLERANCE ? 3 : 2; }
+
+// Functions of matrices, known only to the lexer of matrix lines.
+struct MatrixFunction {
+    const char* name;
+    size_t arity;
+};
+
+enum MatrixFunctionIndex { MATRIX_DET, MATRIX_INV, MATRIX_SOLVE, MATRIX_TRANSPOSE, MATRIX_EYE, MATRIX_ZEROS,
+                           MATRIX_ONES, MATRIX_RAND };
+
+const MatrixFunction matrixFunctions[] = {
+    {"det", 1}, {"inv", 1}, {"solve", 2}, {"transpose", 1}, {"eye", 1}, {"zeros", 2}, {"ones", 2}, {"rand", 2},
+};
+
+const int MATRIX_FUNCTION_COUNT = sizeof(matrixFunctions) / sizeof(matrixFunctions[0]);
+
+int findMatrixFunction(std::string_view name) {
+    for (int i = 0; i < MATRIX_FUNCTION_COUNT; i++) {
+        if (name == matrixFunctions[i].name)
+            return i;
+    }
+    return -1;
+}
+
+// Hot-path statistics, compiled in with -DCALC_STATS (cmake -DCALC_STATS=ON).
+// Without it the CALC_STAT_* macros expand to nothing. With it, each thread
+// counts into its own ThreadStats, so workers never contend. The per-thread
+// records are summed only when a report is printed.
+//
+// Stage timers measure exclusive time: entering a nested stage stops the
+// clock of the enclosing one, so lexing inside the solver counts as
+// lexing, not solving.
+enum StatStage { STAGE_LEX, STAGE_PARSE, STAGE_COMPILE, STAGE_EVALUATE, STAGE_SOLVE, STAGE_IO, STAGE_COUNT };
+
+#ifdef CALC_STATS
+const char* const STAGE_NAMES[STAGE_COUNT] = {"lex", "parse", "compile", "evaluate", "solve", "io"};
+
+inline uint64_t steadyNanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The TSC costs a few nanoseconds to read, against tens for the steady
+// clock. Reports convert ticks to time using the rate measured since start.
+inline uint64_t statTicks() {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    return __rdtsc();
+#else
+    return steadyNanoseconds();
+#endif
+}
+
+std::atomic<uint64_t> heapAllocations{0};
+std::atomic<uint64_t> heapBytes{0};
+
+struct StatCounters {
+    uint64_t stageTicks[STAGE_COUNT] = {};
+    uint64_t stageCalls[STAGE_COUNT] = {};
+    uint64_t expressions = 0;
+    uint64_t tokens = 0;
+    uint64_t exceptions = 0;
+    uint64_t functionCalls[BUILTIN_FUNCTION_COUNT] = {};
+
+    void add(const StatCounters& other) {
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            stageTicks[i] += other.stageTicks[i];
+            stageCalls[i] += other.stageCalls[i];
+        }
+        expressions += other.expressions;
+        tokens += other.tokens;
+        exceptions += other.exceptions;
+        for (int i = 0; i < BUILTIN_FUNCTION_COUNT; i++)
+            functionCalls[i] += other.functionCalls[i];
+    }
+};
+
+struct StatsRegistry {
+    std::mutex mutex;
+    std::vector<const StatCounters*> live;
+    StatCounters retired;  // threads that have already exited
+    uint64_t startTicks = statTicks();
+    uint64_t startNanoseconds = steadyNanoseconds();
+};
+
+StatsRegistry& statsRegistry() {
+    static StatsRegistry* registry = new StatsRegistry;  // outlives every thread_local
+    return *registry;
+}
+
+// One per thread, registered for as long as the thread runs.
+struct ThreadStats : StatCounters {
+    int stage = -1;
+    uint64_t stageStart = 0;
+
+    ThreadStats() {
+        std::lock_guard<std::mutex> lock(statsRegistry().mutex);
+        statsRegistry().live.push_back(this);
+    }
+
+    ~ThreadStats() {
+        StatsRegistry& registry = statsRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.live.erase(std::find(registry.live.begin(), registry.live.end(), this));
+        registry.retired.add(*this);
+    }
+};
+
+inline ThreadStats& threadStats() {
+    thread_local ThreadStats stats;
+    return stats;
+}
+
+class StageTimer {
+public:
+    explicit StageTimer(StatStage stage) : stats(threadStats()), outer(stats.stage) {
+        uint64_t now = statTicks();
+        if (outer >= 0)
+            stats.stageTicks[outer] += now - stats.stageStart;
+        stats.stage = stage;
+        stats.stageCalls[stage]++;
+        stats.stageStart = now;
+    }
+
+    ~StageTimer() {
+        uint64_t now = statTicks();
+        stats.stageTicks[stats.stage] += now - stats.stageStart;
+        stats.stage = outer;
+        stats.stageStart = now;
+    }
+
+private:
+    ThreadStats& stats;
+    int outer;
+};
+
+#ifndef CALCULATOR_NO_MAIN
+// The program that owns main() owns the global allocator, so heap traffic
+// from every library call is counted too. Both sides are kept out of line:
+// GCC otherwise pairs an inlined malloc() or free() with the builtin operator
+// new or delete and warns about a mismatch.
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void* operator new(size_t size) {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    heapBytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void operator delete(void* p) noexcept { free(p); }
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void operator delete(void* p, size_t) noexcept { free(p); }
+#endif
+
+// Sums every thread's counters. Other threads must be idle, as they are
+// between batch windows and in the REPL.
+std::string statsReport() {
+    StatsRegistry& registry = statsRegistry();
+    StatCounters total;
+    {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        total = registry.retired;
+        for (const StatCounters* stats : registry.live)
+            total.add(*stats);
+    }
+    double elapsedTicks = static_cast<double>(statTicks() - registry.startTicks);
+    double nsPerTick = elapsedTicks > 0 ? (steadyNanoseconds() - registry.startNanoseconds) / elapsedTicks : 1;
+
+    char line[160];
+    std::string out = "Statistics:\n";
+    snprintf(line, sizeof(line), "    %-10s %12s %14s %12s\n", "stage", "calls", "total ms", "ns/call");
+    out += line;
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        double ns = total.stageTicks[i] * nsPerTick;
+        snprintf(line, sizeof(line), "    %-10s %12llu %14.3f %12.1f\n", STAGE_NAMES[i],
+                 static_cast<unsigned long long>(total.stageCalls[i]), ns / 1e6,
+                 total.stageCalls[i] ? ns / total.stageCalls[i] : 0.0);
+        out += line;
+    }
+    snprintf(line, sizeof(line),
+             "    expressions evaluated: %llu\n    tokens lexed: %llu\n    exceptions: %llu\n"
+             "    heap allocations: %llu (%llu bytes)\n",
+             static_cast<unsigned long long>(total.expressions), static_cast<unsigned long long>(total.tokens),
+             static_cast<unsigned long long>(total.exceptions),
+             static_cast<unsigned long long>(heapAllocations.load()),
+             static_cast<unsigned long long>(heapBytes.load()));
+    out += line;
+    out += "    function calls:";
+    bool any = false;
+    for (int i = 0; i < BUILTIN_FUNCTION_COUNT; i++) {
+        if (!total.functionCalls[i])
+            continue;
+        snprintf(line, sizeof(line), " %s=%llu", builtinFunctions[i].name,
+                 static_cast<unsigned long long>(total.functionCalls[i]));
+        out += line;
+        any = true;
+    }
+    out += any ? "\n" : " none\n";
+    return out;
+}
+
+#define CALC_STAT_STAGE(stage) StageTimer calcStageTimer(stage)
+#define CALC_STAT_ADD(counter, n) (threadStats().counter += (n))
+#define CALC_STAT_FUNCTION(index, n) (threadStats().functionCalls[index] += (n))
+#else
+#define CALC_STAT_STAGE(stage) ((void)0)
+#define CALC_STAT_ADD(counter, n) ((void)0)
+#define CALC_STAT_FUNCTION(index, n) ((void)0)
+#endif
+
+// Splits text into tokens and passes each one to emit, including the
+// multiplications implied by adjacency ("2x", "(a)(b)"). Positions are
+// offsets into the text passed to lex(). lex() may be called again with the
+// text that follows, as long as no token is split between the two calls; the
+// lexer remembers the last token, so implicit multiplication and unary minus
+// are detected across the boundary.
+// End of the numeric literal that starts at i. An exponent only counts when
+// digits follow, so "2e" stays 2 times e.
+size_t scanNumber(std::string_view expr, size_t i) {
+    size_t j = i;
+    while (j < expr.size() && (isdigit(static_cast<unsigned char>(expr[j])) || expr[j] == '.'))
+        j++;
+    if (j < expr.size() && (expr[j] == 'e' || expr[j] == 'E')) {
+        size_t k = j + 1;
+        if (k < expr.size() && (expr[k] == '+' || expr[k] == '-'))
+            k++;
+        if (k < expr.size() && isdigit(static_cast<unsigned char>(expr[k]))) {
+            while (k < expr.size() && isdigit(static_cast<unsigned char>(expr[k])))
+                k++;
+            j = k;
+        }
+    }
+    return j;
+}
+
+// Where the call whose name ends at `end` has its parentheses and its first
+// top-level commas. open is npos if no '(' follows the name, close is npos if
+// the call is never closed.
+struct CallShape {
+    size_t open = std::string_view::npos;
+    size_t close = std::string_view::npos;
+    size_t commas = 0;
+    size_t comma[4] = {};
+};
+
+CallShape scanCall(std::string_view text, size_t end) {
+    CallShape call;
+    while (end < text.size() && isspace(static_cast<unsigned char>(text[end])))
+        end++;
+    if (end == text.size() || text[end] != '(')
+        return call;
+    call.open = end;
+    int depth = 0;
+    for (size_t i = end + 1; i < text.size(); i++) {
+        char ch = text[i];
+        if (ch == '(' || ch == '[') {
+            depth++;
+        } else if (ch == ')' || ch == ']') {
+            if (depth-- == 0) {
+                call.close = i;
+                break;
+            }
+        } else if (ch == ',' && depth == 0) {
+            if (call.commas < 4)
+                call.comma[call.commas] = i;
+            call.commas++;
+        }
+    }
+    return call;
+}
+
+// The kind of reduction that the name of `kind` ending at `end` calls, or -1
+// if it is not called as one. min and max with other than four arguments are
+// the binary functions; sum and prod must have four, integrate four or five.
+int matchReductionCall(std::string_view expr, size_t end, int kind, CallShape& call) {
+    call = scanCall(expr, end);
+    if (call.open == std::string_view::npos)
+        return -1;
+    bool closed = call.close != std::string_view::npos;
+    if (closed && call.commas == 3)
+        return kind;
+    if (kind == REDUCE_INTEGRAL) {
+        if (closed && call.commas == 4)
+            return REDUCE_INTEGRAL_TOLERANCE;
+        throw std::runtime_error("Usage: integrate(expression, variable, from, to[, tolerance])");
+    }
+    if (kind == REDUCE_MIN || kind == REDUCE_MAX)
+        return -1;
+    throw std::runtime_error(std::string("Usage: ") + reductionNames[kind] + "(expression, variable, from, to)");
+}
+
+class Lexer {
+public:
+    // Arbitrary precision re-reads literals from the source, so it lexes with
+    // keepOutOfRange and accepts literals a double cannot hold. Only matrix
+    // lines are lexed with matrices, which adds brackets, the elementwise
+    // operators and matrixFunctions.
+    explicit Lexer(bool keepOutOfRange = false, bool matrices = false)
+        : keepOutOfRange(keepOutOfRange), matrices(matrices) {}
+
+    template <typename Emit>
+    void lex(std::string_view expr, Emit&& emit) {
+        CALC_STAT_STAGE(STAGE_LEX);
+        size_t i = 0;
+
+        while (i < expr.size()) {
+            if (isspace(static_cast<unsigned char>(expr[i]))) {
+                i++;
+                continue;
+            }
+
+            Token newToken{NUMBER, NUMBER_LITERAL, 0, static_cast<unsigned int>(i), 0};
+            CallShape call;
+
+            if (matrices && expr[i] == '.' && i + 1 < expr.size() &&
+                (expr[i + 1] == '*' || expr[i + 1] == '/' || expr[i + 1] == '^')) {
+                newToken.type = OPERATOR;
+                newToken.op = expr[i + 1];
+                newToken.id = ELEMENTWISE;
+                i += 2;
+            } else if (isdigit(static_cast<unsigned char>(expr[i])) || expr[i] == '.') {
+                size_t j = scanNumber(expr, i);
+                auto res = std::from_chars(expr.data() + i, expr.data() + j, newToken.value);
+                if (res.ec == std::errc::invalid_argument)
+                    throw std::invalid_argument("Invalid number format");
+                if (res.ec == std::errc::result_out_of_range && !keepOutOfRange)
+                    throw std::out_of_range("Number too large");
+                i = j;
+            } else if (isalpha(static_cast<unsigned char>(expr[i]))) {
+                size_t j = i;
+                while (j < expr.size() && isalpha(static_cast<unsigned char>(expr[j]))) {
+                    j++;
+                }
+                // Digits after a name are a multiplication ("x2"), except in atan2.
+                size_t k = j;
+                while (k < expr.size() && isdigit(static_cast<unsigned char>(expr[k])))
+                    k++;
+                if (k > j && findBinaryFunction(expr.substr(i, k - i)) >= 0)
+                    j = k;
+                std::string_view name = expr.substr(i, j - i);
+                int function = findBuiltinFunction(name);
+                if (function >= 0) {
+                    newToken.type = FUNCTION;
+                    newToken.id = static_cast<unsigned short>(function);
+                } else if ((function = findReduction(name)) >= 0 &&
+                           (function = matchReductionCall(expr, j, function, call)) >= 0) {
+                    newToken.type = FUNCTION;
+                    newToken.op = FUNCTION_REDUCE;
+                    newToken.id = static_cast<unsigned short>(function);
+                } else if ((function = findBinaryFunction(name)) >= 0) {
+                    newToken.type = FUNCTION;
+                    newToken.op = FUNCTION_BINARY;
+                    newToken.id = static_cast<unsigned short>(function);
+                } else if (matrices && (function = findMatrixFunction(name)) >= 0) {
+                    newToken.type = FUNCTION;
+                    newToken.op = FUNCTION_MATRIX;
+                    newToken.id = static_cast<unsigned short>(function);
+                } else if ((function = activeVariables->findFunction(name)) >= 0) {
+                    newToken.type = FUNCTION;
+                    newToken.op = FUNCTION_USER;
+                    newToken.id = static_cast<unsigned short>(function);
+                } else if (name == "pi") {
+                    newToken.op = NUMBER_PI;
+                    newToken.value = M_PI;
+                } else if (name == "e") {
+                    newToken.op = NUMBER_E;
+                    newToken.value = M_E;
+                } else {
+                    if (name.size() > 0xFFFF)
+                        throw std::runtime_error("Variable name too long!");
+                    newToken.type = VARIABLE;
+                    newToken.id = static_cast<unsigned short>(name.size());
+                }
+                i = j;
+            } else {
+                char op = expr[i];
+                if (op == '+' || op == '-' || op == '*' || op == '/' || op == '^') {
+                    newToken.type = OPERATOR;
+                    newToken.op = op;
+                    if (op == '-' && (!haveLast || last.type == OPERATOR || last.type == COMMA
+                        || (last.type == PARENTHESIS && (last.op == '(' || last.op == '[')))) {
+                        // Unary minus is lexed as "0 -" with the minus marked so it binds tightly.
+                        emitToken(Token{NUMBER, NUMBER_ZERO, 0, static_cast<unsigned int>(i), 0}, emit);
+                        newToken.id = UNARY_MINUS;
+                    }
+                    i++;
+                } else if (op == '(' || op == ')' || (matrices && (op == '[' || op == ']'))) {
+                    if (op == ']' && haveLast && last.type == PARENTHESIS && last.op == '[')
+                        throw std::runtime_error("Empty matrix!");
+                    newToken.type = PARENTHESIS;
+                    newToken.op = op;
+                    i++;
+                } else if (op == ',') {
+                    newToken.type = COMMA;
+                    newToken.op = op;
+                    i++;
+                } else {
+                    throw std::runtime_error(std::string("Invalid Character in expression!") + op);
+                }
+            }
+
+            if (haveLast) {
+                const Token& lastToken = last;
+                bool lastIsNumberVarOrCloseParen =
+                    (lastToken.type == NUMBER) ||
+                    (lastToken.type == VARIABLE) ||
+                    (lastToken.type == PARENTHESIS && (lastToken.op == ')' || lastToken.op == ']'));
+
+                bool newIsVarFuncNumberOrOpenParen =
+                    (newToken.type == VARIABLE) ||
+                    (newToken.type == FUNCTION) ||
+                    (newToken.type == NUMBER) ||
+                    (newToken.type == PARENTHESIS && (newToken.op == '(' || newToken.op == '['));
+
+                if (lastIsNumberVarOrCloseParen && newIsVarFuncNumberOrOpenParen) {
+                    emitToken(Token{OPERATOR, '*', 0, newToken.pos, 0}, emit);
+                }
+            }
+
+            emitToken(newToken, emit);
+            if (newToken.type == FUNCTION && newToken.op == FUNCTION_REDUCE) {
+                // The body and the variable are compiled from the source
+                // later; only the range is lexed here.
+                emitToken(Token{PARENTHESIS, '(', 0, static_cast<unsigned int>(call.open), 0}, emit);
+                i = call.comma[1] + 1;
+            }
+        }
+    }
+
+private:
+    template <typename Emit>
+    void emitToken(const Token& token, Emit& emit) {
+        CALC_STAT_ADD(tokens, 1);
+        last = token;
+        haveLast = true;
+        emit(token);
+    }
+
+    Token last{NUMBER, 0, 0, 0, 0};
+    bool haveLast = false;
+    bool keepOutOfRange;
+    bool matrices;
+};
+
+// Appends the tokens of expr to tokens, which the caller may reuse between
+// calls so that lexing does not allocate once the vector has grown.
+void tokenize(std::string_view expr, std::vector<Token>& tokens) {
+    tokens.clear();
+    Lexer lexer;
+    lexer.lex(expr, [&](const Token& token) { tokens.push_back(token); });
+}
+
+std::vector<Token> tokenize(std::string_view expr) {
+    std::vector<Token> tokens;
+    tokenize(expr, tokens);
+    return tokens;
+}
+
+size_t functionArity(const Token& token);
+std::string functionName(const Token& token);
+
+// Shunting-yard, one token at a time: each token of the postfix form is
+// passed to emit as soon as it is known. The operator stack only holds what
+// is still open, so its size follows the nesting depth, not the length of
+// the input. An open parenthesis counts the commas inside it in its id, so a
+// function call can be checked against the function's number of arguments.
+// In matrix lines, a closing bracket is emitted with the count of commas
+// inside it, for the evaluator to build a list of that many plus one items.
+template <typename Emit>
+class ShuntingYard {
+public:
+    ShuntingYard(std::vector<Token>& opStack, Emit emit) : opStack(opStack), emit(emit) {
+        opStack.clear();
+    }
+
+    void push(const Token& token) {
+        if (token.type == NUMBER || token.type == VARIABLE) {
+            emit(token);
+        } else if (token.type == OPERATOR) {
+            // A prefix operator has no left operand, so nothing is reduced before it.
+            if (token.id != UNARY_MINUS) {
+                while (!opStack.empty() && opStack.back().type == OPERATOR &&
+                       (precedence(opStack.back()) > precedence(token) ||
+                       (precedence(opStack.back()) == precedence(token) && !isRightAssociative(token.op)))) {
+                    emit(opStack.back());
+                    opStack.pop_back();
+                }
+            }
+            opStack.push_back(token);
+        } else if (token.type == PARENTHESIS) {
+            if (token.op == '(' || token.op == '[') {
+                opStack.push_back(token);
+            } else if (token.op == ']') {
+                if (!closeArgument() || opStack.back().op != '[')
+                    throw std::runtime_error("Mismatched brackets in expression!");
+                emit(Token{PARENTHESIS, ']', opStack.back().id, token.pos, 0});
+                opStack.pop_back();
+            } else if (token.op == ')') {
+                if (!closeArgument() || opStack.back().op != '(') {
+                    throw std::runtime_error("Mismatched parenthesis in expression!");
+                }
+                size_t arguments = opStack.back().id + 1u;
+                opStack.pop_back();
+
+                if (!opStack.empty() && opStack.back().type == FUNCTION) {
+                    if (functionArity(opStack.back()) != arguments)
+                        throw std::runtime_error("Wrong number of arguments for " + functionName(opStack.back()) + "!");
+                    emit(opStack.back());
+                    opStack.pop_back();
+                } else if (arguments > 1) {
+                    throw std::runtime_error("Unexpected ',' in expression!");
+                }
+            }
+        } else if (token.type == COMMA) {
+            if (!closeArgument() || opStack.back().id == 0xFFFF)
+                throw std::runtime_error("Unexpected ',' in expression!");
+            opStack.back().id++;
+        } else if (token.type == FUNCTION) {
+            opStack.push_back(token);
+        }
+    }
+
+    void finish() {
+        while (!opStack.empty()) {
+            if (opStack.back().type == PARENTHESIS) {
+                if (opStack.back().op == '[')
+                    throw std::runtime_error("Mismatched brackets in expression!");
+                throw std::runtime_error("Mismatched parenthesis in expression!");
+            }
+            emit(opStack.back());
+            opStack.pop_back();
+        }
+    }
+
+private:
+    // Emits the operators of the innermost parenthesis or bracket. Returns
+    // false if none is open; otherwise the '(' or '[' is left on top of the
+    // stack.
+    bool closeArgument() {
+        while (!opStack.empty()) {
+            if (opStack.back().type == PARENTHESIS)
+                return true;
+            emit(opStack.back());
+            opStack.pop_back();
+        }
+        return false;
+    }
+
+    std::vector<Token>& opStack;
+    Emit emit;
+};
+
+void infixToPostfix(const std::vector<Token>& tokens, std::vector<Token>& outputQueue) {
+    CALC_STAT_STAGE(STAGE_PARSE);
+    thread_local std::vector<Token> opStack;
+    outputQueue.clear();
+
+    auto emit = [&](const Token& token) { outputQueue.push_back(token); };
+    ShuntingYard<decltype(emit)> yard(opStack, emit);
+    for (const auto& token : tokens)
+        yard.push(token);
+    yard.finish();
+}
+
+std::vector<Token> infixToPostfix(const std::vector<Token>& tokens) {
+    std::vector<Token> outputQueue;
+    infixToPostfix(tokens, outputQueue);
+    return outputQueue;
+}
+
+void applyFunctionToken(std::vector<double>& valStack, const Token& token, std::string_view source);
+
+// Applies one postfix token to the value stack.
+inline void applyPostfixToken(std::vector<double>& valStack, const Token& token, std::string_view source) {
+    if (token.type == NUMBER) {
+        valStack.push_back(token.value);
+    } else if (token.type == OPERATOR) {
+        if (valStack.size() < 2)
+            throw std::runtime_error("Invalid expression!");
+
+        double right = valStack.back();
+        valStack.pop_back();
+        double left = valStack.back();
+        valStack.pop_back();
+        double result = 0;
+
+        switch (token.op) {
+            case '+':
+                result = left + right;
+                break;
+            case '-':
+                result = left - right;
+                break;
+            case '*':
+                result = left * right;
+                break;
+            case '/':
+                if (right == 0)
+                    throw std::runtime_error("Cannot divide by 0!");
+                result = left / right;
+                break;
+            case '^':
+                result = std::pow(left, right);
+                break;
+            default:
+                throw std::runtime_error("Unknown operator!");
+        }
+        valStack.push_back(result);
+    } else if (token.type == FUNCTION) {
+        if (token.op != FUNCTION_BUILTIN) {
+            applyFunctionToken(valStack, token, source);
+            return;
+        }
+        if (valStack.empty()) throw std::runtime_error("Missing argument for function!");
+        valStack.back() = builtinFunctions[token.id].fn(valStack.back());
+        CALC_STAT_FUNCTION(token.id, 1);
+    } else if (token.type == VARIABLE) {
+        valStack.push_back(activeVariables->at(tokenText(source, token)));
+    }
+}
+
+double evaluatePostfix(const std::vector<Token>& postfix, std::string_view source) {
+    CALC_STAT_STAGE(STAGE_EVALUATE);
+    CALC_STAT_ADD(expressions, 1);
+    thread_local std::vector<double> valStack;
+    valStack.clear();
+
+    for (const auto& token : postfix)
+        applyPostfixToken(valStack, token, source);
+    if (valStack.size() != 1)
+        throw std::runtime_error("Invalid expression!");
+
+    return valStack.back();
+}
+
+// Evaluates one expression fed to it piece by piece. Tokens are lexed,
+// reordered and applied as they arrive; no token list or postfix form is
+// ever built. Memory is bounded by the nesting depth rather than the input
+// length, and nothing recurses, so deep nesting cannot overflow the stack.
+class StreamingEvaluator {
+public:
+    // Pieces must not split a token; see tokenBoundary().
+    void feed(std::string_view piece) {
+        lexer.lex(piece, [&](const Token& token) {
+            if (token.type != VARIABLE) {
+                yard.push(token);
+                return;
+            }
+            // The name is only valid inside this piece, so resolve it now.
+            Token value{NUMBER, 0, 0, token.pos, activeVariables->at(tokenText(piece, token))};
+            yard.push(value);
+        });
+    }
+
+    double finish() {
+        yard.finish();
+        if (values.size() != 1)
+            throw std::runtime_error("Invalid expression!");
+        CALC_STAT_ADD(expressions, 1);
+        return values.back();
+    }
+
+    // Largest stack sizes seen so far, which is what the memory use follows.
+    size_t peakDepth() const { return std::max(values.capacity(), opStack.capacity()); }
+
+private:
+    struct Apply {
+        std::vector<double>* values;
+        void operator()(const Token& token) const { applyPostfixToken(*values, token, {}); }
+    };
+
+    std::vector<double> values;
+    std::vector<Token> opStack;
+    Lexer lexer;
+    ShuntingYard<Apply> yard{opStack, Apply{&values}};
+};
+
+// Length of the longest prefix of text that can be fed on its own, i.e. one
+// that ends right before a character that can never continue a token.
+// Returns 0 when there is no such place.
+size_t tokenBoundary(std::string_view text) {
+    for (size_t i = text.size(); i-- > 1;) {
+        char ch = text[i];
+        if (isspace(static_cast<unsigned char>(ch)) || ch == '(' || ch == ')' || ch == '*' || ch == '/' || ch == '^')
+            return i;
+    }
+    return 0;
+}
+
+// A compiled expression is the postfix form of an expression lowered to a flat
+// program with operators, functions and variables already resolved, so that it
+// can be evaluated many times without going through the lexer and parser again.
+// A function body reads its arguments with OP_ARG; OP_CALL calls a
+// user-defined function with its arguments on top of the stack. OP_REDUCE
+// runs one of the program's reductions the same way. OP_LIST only exists
+// inside the optimizer, to chain the arguments of a call.
+enum OpCode { OP_CONST, OP_VAR, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_POW, OP_FUNC, OP_STORE, OP_LOAD,
+              OP_FUNC2, OP_ARG, OP_CALL, OP_LIST, OP_REDUCE };
+
+struct Instruction {
+    OpCode op;
+    int index;      // function index for OP_FUNC/OP_FUNC2/OP_CALL, variable slot for OP_VAR, argument for
+                    // OP_ARG, temporary for OP_STORE/OP_LOAD, reduction for OP_REDUCE
+    double value;   // constant for OP_CONST
+};
+
+struct JitCode;
+struct Reduction;
+
+struct CompiledExpression {
+    std::vector<Instruction> code;
+    size_t maxDepth = 0;
+    size_t tempCount = 0;
+
+    // The sums, products and integrals the program computes, by OP_REDUCE index.
+    std::vector<std::shared_ptr<const Reduction>> reductions;
+
+    // Native code tier, filled in once the program turns out to be hot.
+    mutable unsigned evalCount = 0;
+    mutable std::shared_ptr<JitCode> jit;
+
+#ifdef CALC_STATS
+    // Builtin calls made by one evaluation, as (function, count) pairs. The
+    // code is straight-line, so every evaluation makes exactly these calls.
+    std::vector<std::pair<int, unsigned>> functionCalls;
+#endif
+};
+
+// A function defined with "f(x, y) = body". The body is compiled once, when
+// it is defined, into a program that reads its arguments with OP_ARG. Names
+// in the body that are not parameters are captured: they become extra
+// arguments after the parameters, which every call site passes from its own
+// variables. Each body therefore depends on its arguments alone, so it can
+// be inlined into a caller or have its results memoized.
+struct UserFunction {
+    std::string name;
+    std::vector<std::string> params;
+    std::vector<std::string> captured;
+    CompiledExpression body;
+
+    // The body's text and postfix form, for arbitrary precision.
+    std::string source;
+    std::vector<Token> postfix;
+
+    bool inlined = false;   // small enough to be copied into callers
+    bool memoized = false;  // results are cached; see callUserFunction()
+    uint64_t serial = 0;    // unique over the life of the process
+
+    size_t argumentCount() const { return params.size() + captured.size(); }
+};
+
+// A sum, product, minimum, maximum or integral inside an expression. Its
+// body is compiled on its own, with the variable it runs over in slot 0 and
+// the names it reads from the enclosing expression in slots 1, 2, ...; the
+// body runs on the column kernels with those slots as its bindings.
+// OP_REDUCE takes the range (and an integral's tolerance), then the values
+// of those names.
+struct Reduction {
+    ReductionKind kind = REDUCE_SUM;
+    std::string name;
+    std::vector<std::string> captured;
+    CompiledExpression body;
+
+    size_t operandCount() const { return reductionOperands(kind); }
+    size_t argumentCount() const { return operandCount() + captured.size(); }
+};
+
+const UserFunction& userFunction(int index) {
+    return *activeVariables->functions[index];
+}
+
+size_t functionArity(const Token& token) {
+    if (token.op == FUNCTION_USER)
+        return userFunction(token.id).params.size();
+    if (token.op == FUNCTION_MATRIX)
+        return matrixFunctions[token.id].arity;
+    if (token.op == FUNCTION_REDUCE)
+        return reductionOperands(token.id);
+    return token.op == FUNCTION_BINARY ? 2 : 1;
+}
+
+std::string functionName(const Token& token) {
+    if (token.op == FUNCTION_USER)
+        return userFunction(token.id).name;
+    if (token.op == FUNCTION_MATRIX)
+        return matrixFunctions[token.id].name;
+    if (token.op == FUNCTION_REDUCE)
+        return reductionNames[token.id];
+    return token.op == FUNCTION_BINARY ? binaryFunctions[token.id].name : builtinFunctions[token.id].name;
+}
+
+// Net change in stack depth caused by one instruction of program.
+int stackEffect(const Instruction& ins, const CompiledExpression& program) {
+    switch (ins.op) {
+        case OP_CONST:
+        case OP_VAR:
+        case OP_ARG:
+        case OP_LOAD:
+            return 1;
+        case OP_FUNC:
+        case OP_STORE:
+        case OP_LIST:
+            return 0;
+        case OP_CALL:
+            return 1 - static_cast<int>(userFunction(ins.index).argumentCount());
+        case OP_REDUCE:
+            return 1 - static_cast<int>(program.reductions[ins.index]->argumentCount());
+        default:
+            return -1;
+    }
+}
+
+#ifdef CALC_STATS
+void countFunctionCalls(CompiledExpression& program) {
+    program.functionCalls.clear();
+    for (const auto& ins : program.code) {
+        if (ins.op != OP_FUNC)
+            continue;
+        auto it = std::find_if(program.functionCalls.begin(), program.functionCalls.end(),
+                               [&](const std::pair<int, unsigned>& entry) { return entry.first == ins.index; });
+        if (it == program.functionCalls.end())
+            program.functionCalls.emplace_back(ins.index, 1);
+        else
+            it->second++;
+    }
+}
+
+void recordEvaluations(const CompiledExpression& program, size_t count) {
+    ThreadStats& stats = threadStats();
+    stats.expressions += count;
+    for (const auto& entry : program.functionCalls)
+        stats.functionCalls[entry.first] += entry.second * count;
+}
+
+#define CALC_STAT_EVALUATIONS(program, count) recordEvaluations(program, count)
+#else
+#define CALC_STAT_EVALUATIONS(program, count) ((void)0)
+#endif
+
+// Maps a variable name to its slot, or -1 if the name is unknown.
+using VariableResolver = std::function<int(std::string_view)>;
+
+std::shared_ptr<const Reduction> compileReduction(std::string_view source, const Token& token);
+
+// Lowers a postfix expression to a program whose names become `variable`
+// instructions (OP_VAR, or OP_ARG in a function body) at the slots `resolve`
+// gives them. The variables a called function captures are passed from the
+// slots `resolveCaptured` gives: in a body, a captured name refers to the
+// caller's variable even where a parameter of the same name hides it.
+void lowerPostfix(const std::vector<Token>& postfix, std::string_view source, CompiledExpression& program,
+                  OpCode variable, const VariableResolver& resolve, const VariableResolver& resolveCaptured) {
+    CALC_STAT_STAGE(STAGE_COMPILE);
+    program.code.clear();
+    program.reductions.clear();
+    program.maxDepth = 0;
+    program.tempCount = 0;
+    program.evalCount = 0;
+    program.jit.reset();
+    size_t depth = 0;
+
+    for (const auto& token : postfix) {
+        Instruction ins{OP_CONST, 0, 0};
+        if (token.type == NUMBER) {
+            ins.value = token.value;
+            depth++;
+        } else if (token.type == VARIABLE) {
+            ins.op = variable;
+            ins.index = resolve(tokenText(source, token));
+            if (ins.index < 0)
+                throw std::runtime_error("Unknown variable: " + std::string(tokenText(source, token)));
+            depth++;
+        } else if (token.type == OPERATOR) {
+            if (depth < 2)
+                throw std::runtime_error("Invalid expression!");
+            switch (token.op) {
+                case '+': ins.op = OP_ADD; break;
+                case '-': ins.op = OP_SUB; break;
+                case '*': ins.op = OP_MUL; break;
+                case '/': ins.op = OP_DIV; break;
+                case '^': ins.op = OP_POW; break;
+                default:
+                    throw std::runtime_error("Unknown operator!");
+            }
+            depth--;
+        } else if (token.type == FUNCTION) {
+            if (depth < functionArity(token))
+                throw std::runtime_error("Missing argument for function!");
+            ins.index = token.id;
+            if (token.op == FUNCTION_BUILTIN) {
+                ins.op = OP_FUNC;
+            } else if (token.op == FUNCTION_BINARY) {
+                ins.op = token.id == BINARY_POW ? OP_POW : OP_FUNC2;
+                depth--;
+            } else if (token.op == FUNCTION_REDUCE) {
+                // The names the body reads from here are passed after the range.
+                std::shared_ptr<const Reduction> reduction = compileReduction(source, token);
+                for (const auto& name : reduction->captured) {
+                    int slot = resolve(name);
+                    if (slot < 0)
+                        throw std::runtime_error("Unknown variable: " + name);
+                    program.code.push_back(Instruction{variable, slot, 0});
+                    program.maxDepth = std::max(program.maxDepth, ++depth);
+                }
+                ins.op = OP_REDUCE;
+                ins.index = static_cast<int>(program.reductions.size());
+                depth -= reduction->argumentCount() - 1;
+                program.reductions.push_back(std::move(reduction));
+            } else {
+                const UserFunction& function = userFunction(token.id);
+                for (const auto& name : function.captured) {
+                    int slot = resolveCaptured(name);
+                    if (slot < 0)
+                        throw std::runtime_error("Unknown variable: " + name);
+                    program.code.push_back(Instruction{variable, slot, 0});
+                    program.maxDepth = std::max(program.maxDepth, ++depth);
+                }
+                ins.op = OP_CALL;
+                depth -= function.argumentCount() - 1;
+            }
+        }
+        program.code.push_back(ins);
+        program.maxDepth = std::max(program.maxDepth, depth);
+    }
+    if (depth != 1)
+        throw std::runtime_error("Invalid expression!");
+#ifdef CALC_STATS
+    countFunctionCalls(program);
+#endif
+}
+
+void compilePostfix(const std::vector<Token>& postfix, std::string_view source, CompiledExpression& program,
+                    const VariableResolver& resolve) {
+    lowerPostfix(postfix, source, program, OP_VAR, resolve, resolve);
+}
+
+void compilePostfix(const std::vector<Token>& postfix, std::string_view source, CompiledExpression& program) {
+    compilePostfix(postfix, source, program, [](std::string_view name) { return activeVariables->find(name); });
+}
+
+double applyOperator(OpCode op, double left, double right) {
+    switch (op) {
+        case OP_ADD: return left + right;
+        case OP_SUB: return left - right;
+        case OP_MUL: return left * right;
+        case OP_DIV: return left / right;
+        case OP_POW: return std::pow(left, right);
+        default: return 0;
+    }
+}
+
+// The optimizer turns a program back into an expression DAG, folding and
+// simplifying each node as it is built and sharing identical subtrees, then
+// emits the DAG as a program again. A shared subtree is computed once, kept
+// in a temporary by OP_STORE and reused with OP_LOAD. Calls to small
+// user-defined functions are inlined by building their bodies' nodes over
+// the argument nodes, so folding and sharing work across the call.
+struct ExprNode {
+    OpCode op;
+    int index;
+    double value;
+    int left;
+    int right;
+};
+
+class ProgramOptimizer {
+public:
+    void optimize(CompiledExpression& program) {
+        nodes.clear();
+        size_t capacity = 64;
+        while (capacity < program.code.size() * 4)
+            capacity *= 2;
+        table.assign(capacity, -1);
+        stack.clear();
+        reductions.clear();
+        push(program, nullptr);
+        program.reductions.swap(reductions);
+        reductions.clear();
+        emit(stack.back(), program);
+    }
+
+private:
+    // Pushes the nodes a program computes. While a function body is being
+    // inlined, args holds the nodes of its arguments.
+    void push(const CompiledExpression& program, const int* args) {
+        std::vector<int> temps(program.tempCount, -1);
+        for (const auto& ins : program.code) {
+            switch (ins.op) {
+                case OP_CONST:
+                case OP_VAR:
+                    stack.push_back(node(ins.op, ins.index, ins.value, -1, -1));
+                    break;
+                case OP_ARG:
+                    stack.push_back(args ? args[ins.index] : node(OP_ARG, ins.index, 0, -1, -1));
+                    break;
+                case OP_STORE:
+                    temps[ins.index] = stack.back();
+                    break;
+                case OP_LOAD:
+                    stack.push_back(temps[ins.index]);
+                    break;
+                case OP_FUNC: {
+                    int arg = stack.back();
+                    if (nodes[arg].op == OP_CONST)
+                        stack.back() = constant(builtinFunctions[ins.index].fn(nodes[arg].value));
+                    else
+                        stack.back() = node(OP_FUNC, ins.index, 0, arg, -1);
+                    break;
+                }
+                case OP_FUNC2: {
+                    int right = stack.back();
+                    stack.pop_back();
+                    int left = stack.back();
+                    if (nodes[left].op == OP_CONST && nodes[right].op == OP_CONST)
+                        stack.back() = constant(binaryFunctions[ins.index].fn(nodes[left].value, nodes[right].value));
+                    else
+                        stack.back() = node(OP_FUNC2, ins.index, 0, left, right);
+                    break;
+                }
+                case OP_CALL:
+                    call(ins.index);
+                    break;
+                case OP_REDUCE: {
+                    // Reductions are renumbered into the table of the program
+                    // being built, as inlined bodies bring their own.
+                    const auto& reduction = program.reductions[ins.index];
+                    auto it = std::find(reductions.begin(), reductions.end(), reduction);
+                    if (it == reductions.end())
+                        it = reductions.insert(reductions.end(), reduction);
+                    chain(OP_REDUCE, static_cast<int>(it - reductions.begin()), reduction->argumentCount());
+                    break;
+                }
+                default: {
+                    int right = stack.back();
+                    stack.pop_back();
+                    stack.back() = binary(ins.op, stack.back(), right);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Replaces the arguments on top of the stack by the call's result. A call
+    // that is not inlined is left as a call node.
+    void call(int index) {
+        const UserFunction& function = userFunction(index);
+        size_t first = stack.size() - function.argumentCount();
+        if (function.inlined) {
+            std::vector<int> args(stack.begin() + first, stack.end());
+            stack.resize(first);
+            push(function.body, args.data());
+            return;
+        }
+        chain(OP_CALL, index, function.argumentCount());
+    }
+
+    // Replaces the top count entries of the stack by a node that keeps them
+    // as a left-leaning chain of OP_LIST nodes, with the last on the right.
+    void chain(OpCode op, int index, size_t count) {
+        size_t first = stack.size() - count;
+        int left = stack[first];
+        for (size_t i = first + 1; i + 1 < stack.size(); i++)
+            left = node(OP_LIST, 0, 0, left, stack[i]);
+        int right = stack.size() - first > 1 ? stack.back() : -1;
+        stack.resize(first);
+        stack.push_back(node(op, index, 0, left, right));
+    }
+
+    bool isConstant(int id, double value) const {
+        return nodes[id].op == OP_CONST && nodes[id].value == value;
+    }
+
+    // Tells 0 from -0, which isConstant() does not: -0 + 0 is 0, not -0.
+    bool isZero(int id, bool negative) const {
+        return isConstant(id, 0) && std::signbit(nodes[id].value) == negative;
+    }
+
+    int constant(double value) { return node(OP_CONST, 0, value, -1, -1); }
+
+    int binary(OpCode op, int left, int right) {
+        const ExprNode& l = nodes[left];
+        const ExprNode& r = nodes[right];
+        // Division by a constant zero is left in place so it still fails at runtime.
+        if (l.op == OP_CONST && r.op == OP_CONST && !(op == OP_DIV && r.value == 0))
+            return constant(applyOperator(op, l.value, r.value));
+
+        switch (op) {
+            // x + -0 and x - 0 are x for every x, but x + 0 is not when x is -0.
+            case OP_ADD:
+                if (isZero(right, true)) return left;
+                if (isZero(left, true)) return right;
+                break;
+            case OP_SUB:
+                if (isZero(right, false)) return left;
+                break;
+            case OP_MUL:
+                if (isConstant(right, 1)) return left;
+                if (isConstant(left, 1)) return right;
+                break;
+            case OP_DIV:
+                if (isConstant(right, 1)) return left;
+                break;
+            case OP_POW:
+                if (isConstant(right, 1)) return left;
+                if (isConstant(right, 2)) return binary(OP_MUL, left, left);
+                if (isConstant(right, 3)) return binary(OP_MUL, binary(OP_MUL, left, left), left);
+                break;
+            default:
+                break;
+        }
+        // Addition and multiplication commute exactly, so operands are put in
+        // a canonical order to let x*y and y*x share one node.
+        if ((op == OP_ADD || op == OP_MUL) && left > right)
+            std::swap(left, right);
+        return node(op, 0, 0, left, right);
+    }
+
+    // Returns the existing node with these fields, or adds a new one.
+    int node(OpCode op, int index, double value, int left, int right) {
+        if (nodes.size() * 2 >= table.size())
+            rehash(table.size() * 2);
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        uint64_t h = bits * 0x9E3779B97F4A7C15ull;
+        h ^= (static_cast<uint64_t>(op) << 56) ^ (static_cast<uint64_t>(index) << 32);
+        h ^= static_cast<uint64_t>(static_cast<uint32_t>(left)) * 0xC2B2AE3D27D4EB4Full;
+        h ^= static_cast<uint64_t>(static_cast<uint32_t>(right)) * 0x165667B19E3779F9ull;
+        size_t mask = table.size() - 1;
+        for (size_t slot = (h ^ (h >> 29)) & mask;; slot = (slot + 1) & mask) {
+            int id = table[slot];
+            if (id < 0) {
+                nodes.push_back(ExprNode{op, index, value, left, right});
+                table[slot] = static_cast<int>(nodes.size() - 1);
+                return table[slot];
+            }
+            const ExprNode& n = nodes[id];
+            if (n.op == op && n.index == index && n.left == left && n.right == right &&
+                memcmp(&n.value, &value, sizeof(value)) == 0)
+                return id;
+        }
+    }
+
+    void rehash(size_t size) {
+        size_t capacity = 64;
+        while (capacity < size)
+            capacity *= 2;
+        std::vector<ExprNode> old;
+        old.swap(nodes);
+        table.assign(capacity, -1);
+        for (const auto& n : old)
+            node(n.op, n.index, n.value, n.left, n.right);
+    }
+
+    void emit(int root, CompiledExpression& program) {
+        // Nodes are created after their operands, so one backward pass over
+        // the reachable ones counts how often each node is used.
+        // An argument chain is no value of its own, so its operands count
+        // every use of the chain.
+        uses.assign(nodes.size(), 0);
+        temp.assign(nodes.size(), -1);
+        uses[root] = 1;
+        for (int id = root; id >= 0; id--) {
+            if (uses[id] == 0)
+                continue;
+            int weight = nodes[id].op == OP_LIST ? uses[id] : 1;
+            if (nodes[id].left >= 0)
+                uses[nodes[id].left] += weight;
+            if (nodes[id].right >= 0)
+                uses[nodes[id].right] += weight;
+        }
+
+        program.code.clear();
+        program.tempCount = 0;
+        work.clear();
+        work.push_back({root, false});
+        while (!work.empty()) {
+            auto [id, operandsDone] = work.back();
+            work.pop_back();
+            const ExprNode& n = nodes[id];
+            if (n.op == OP_CONST || n.op == OP_VAR || n.op == OP_ARG) {
+                program.code.push_back(Instruction{n.op, n.index, n.value});
+            } else if (temp[id] >= 0) {
+                program.code.push_back(Instruction{OP_LOAD, temp[id], 0});
+            } else if (operandsDone) {
+                if (n.op == OP_LIST)
+                    continue;
+                program.code.push_back(Instruction{n.op, n.index, 0});
+                if (uses[id] > 1) {
+                    temp[id] = static_cast<int>(program.tempCount++);
+                    program.code.push_back(Instruction{OP_STORE, temp[id], 0});
+                }
+            } else {
+                work.push_back({id, true});
+                if (n.right >= 0)
+                    work.push_back({n.right, false});
+                work.push_back({n.left, false});
+            }
+        }
+
+        size_t depth = 0;
+        program.maxDepth = 0;
+        for (const auto& ins : program.code) {
+            depth += stackEffect(ins, program);
+            program.maxDepth = std::max(program.maxDepth, depth);
+        }
+    }
+
+    std::vector<ExprNode> nodes;
+    std::vector<int> table;
+    std::vector<int> stack;
+    std::vector<std::shared_ptr<const Reduction>> reductions;
+    std::vector<int> uses;
+    std::vector<int> temp;
+    std::vector<std::pair<int, bool>> work;
+};
+
+void optimizeProgram(CompiledExpression& program) {
+    CALC_STAT_STAGE(STAGE_COMPILE);
+    thread_local ProgramOptimizer optimizer;
+    optimizer.optimize(program);
+#ifdef CALC_STATS
+    countFunctionCalls(program);
+#endif
+}
+
+void compileExpression(std::string_view expr, CompiledExpression& program, const VariableResolver& resolve) {
+    thread_local std::vector<Token> tokens;
+    thread_local std::vector<Token> postfix;
+    tokenize(expr, tokens);
+    infixToPostfix(tokens, postfix);
+    compilePostfix(postfix, expr, program, resolve);
+    optimizeProgram(program);
+}
+
+void compileExpression(std::string_view expr, CompiledExpression& program) {
+    compileExpression(expr, program, [](std::string_view name) { return activeVariables->find(name); });
+}
+
+CompiledExpression compileExpression(std::string_view expr) {
+    CompiledExpression program;
+    compileExpression(expr, program);
+    return program;
+}
+
+bool isReservedName(std::string_view name);
+
+// Rewrites expr so that each binding in it that depends on one of the
+// variables in slots is replaced by its defining expression, recursively.
+// Compiled over those variables, the result then follows them instead of
+// reading the bindings' current values.
+std::string expandBindings(std::string_view expr, const std::vector<int>& slots);
+
+// Compiles the reduction whose call starts at token in source. Every name in
+// the body other than its variable is captured, for the caller to resolve in
+// its own scope and pass by value.
+std::shared_ptr<const Reduction> compileReduction(std::string_view source, const Token& token) {
+    const int MAX_NESTING = 64;
+    thread_local int nesting = 0;
+    struct Nesting {
+        Nesting() {
+            if (nesting == MAX_NESTING)
+                throw std::runtime_error("Sums and products are nested too deeply!");
+            nesting++;
+        }
+        ~Nesting() { nesting--; }
+    } guard;
+
+    std::string_view function = reductionNames[token.id];
+    CallShape call;
+    if (token.pos > source.size() || source.substr(token.pos, function.size()) != function ||
+        matchReductionCall(source, token.pos + function.size(), findReduction(function), call) != token.id)
+        throw std::runtime_error("Invalid expression!");
+
+    auto reduction = std::make_shared<Reduction>();
+    reduction->kind = static_cast<ReductionKind>(token.id);
+    reduction->name = std::string(trimView(source.substr(call.comma[0] + 1, call.comma[1] - call.comma[0] - 1)));
+    const std::string& name = reduction->name;
+    if (name.empty() || !std::all_of(name.begin(), name.end(), ::isalpha) || isReservedName(name))
+        throw std::runtime_error("Invalid variable name!");
+
+    std::vector<std::string>& captured = reduction->captured;
+    auto resolve = [&](std::string_view v) {
+        if (v == name)
+            return 0;
+        auto it = std::find(captured.begin(), captured.end(), v);
+        if (it == captured.end())
+            it = captured.insert(captured.end(), std::string(v));
+        return static_cast<int>(1 + (it - captured.begin()));
+    };
+    // The caller's compile buffers are still in use, so the body gets its own.
+    std::string body = expandBindings(source.substr(call.open + 1, call.comma[0] - call.open - 1),
+                                      {activeVariables->find(name)});
+    std::vector<Token> tokens, postfix;
+    tokenize(body, tokens);
+    infixToPostfix(tokens, postfix);
+    lowerPostfix(postfix, body, reduction->body, OP_VAR, resolve, resolve);
+    optimizeProgram(reduction->body);
+    return reduction;
+}
+
+// Evaluation reports errors through a status code instead of throwing, so the
+// batch loop can report them inline without unwinding for every bad line.
+enum EvalStatus { EVAL_OK, EVAL_DIVIDE_BY_ZERO, EVAL_INFINITE_RANGE, EVAL_RANGE_TOO_LARGE, EVAL_EMPTY_RANGE,
+                  EVAL_BAD_TOLERANCE, EVAL_INTEGRAND_NOT_FINITE, EVAL_INFINITE_RESULT };
+
+EvalStatus callUserFunction(const UserFunction& function, const double* args, double& result);
+EvalStatus runReduction(const Reduction& reduction, const double* args, double& result);
+
+// Counts the integers from, from + 1, ... up to to. Only sums and products
+// have a value over an empty range.
+EvalStatus reductionCount(ReductionKind kind, double from, double to, uint64_t& count) {
+    if (!std::isfinite(from) || !std::isfinite(to))
+        return EVAL_INFINITE_RANGE;
+    if (to - from >= 0x1p53)
+        return EVAL_RANGE_TOO_LARGE;
+    count = to < from ? 0 : static_cast<uint64_t>(std::floor(to - from)) + 1;
+    if (count == 0 && (kind == REDUCE_MIN || kind == REDUCE_MAX))
+        return EVAL_EMPTY_RANGE;
+    return EVAL_OK;
+}
+
+// Native code tier. A program that has been evaluated jitThreshold times is
+// translated to x86-64 machine code that keeps the evaluation stack in its
+// own stack frame and calls the same libm functions as the interpreter, so
+// results are bit-for-bit identical. Other platforms keep interpreting.
+#ifdef CALC_HAVE_JIT
+struct JitCode {
+    typedef int (*Entry)(const double* vars, double* result, const double* args);
+
+    void* memory = nullptr;
+    size_t size = 0;
+    Entry entry = nullptr;
+
+    ~JitCode() {
+        if (memory)
+            munmap(memory, size);
+    }
+};
+
+class JitAssembler {
+public:
+    enum Reg { RSP = 4, RBX = 3, R12 = 12, R13 = 13, R14 = 14 };
+
+    std::vector<unsigned char> code;
+
+    void bytes(std::initializer_list<unsigned char> list) { code.insert(code.end(), list); }
+
+    void imm32(uint32_t value) {
+        for (int i = 0; i < 4; i++)
+            code.push_back(static_cast<unsigned char>(value >> (8 * i)));
+    }
+
+    void imm64(uint64_t value) {
+        for (int i = 0; i < 8; i++)
+            code.push_back(static_cast<unsigned char>(value >> (8 * i)));
+    }
+
+    // Scalar double instruction "op xmm, [base + disp]" (or the store form),
+    // always encoded with a 32-bit displacement.
+    void sse(unsigned char opcode, int xmm, Reg base, int32_t disp) {
+        code.push_back(0xF2);
+        if (base >= 8)
+            code.push_back(0x41);
+        code.push_back(0x0F);
+        code.push_back(opcode);
+        code.push_back(static_cast<unsigned char>(0x80 | (xmm << 3) | (base & 7)));
+        if ((base & 7) == 4)
+            code.push_back(0x24);
+        imm32(static_cast<uint32_t>(disp));
+    }
+
+    void load(int xmm, Reg base, int32_t disp) { sse(0x10, xmm, base, disp); }
+    void store(int xmm, Reg base, int32_t disp) { sse(0x11, xmm, base, disp); }
+
+    void callAbsolute(const void* fn) {
+        bytes({0x48, 0xB8});
+        imm64(reinterpret_cast<uint64_t>(fn));
+        bytes({0xFF, 0xD0});
+    }
+
+    // Emits a jcc/jmp with a 32-bit offset and returns where to patch it.
+    size_t jump(std::initializer_list<unsigned char> opcode) {
+        bytes(opcode);
+        imm32(0);
+        return code.size() - 4;
+    }
+
+    void patch(size_t at, size_t target) {
+        uint32_t rel = static_cast<uint32_t>(target - (at + 4));
+        memcpy(&code[at], &rel, 4);
+    }
+};
+
+double jitPow(double left, double right) {
+    return std::pow(left, right);
+}
+
+// Called from native code with the arguments in the caller's stack slots;
+// the result replaces the first argument.
+int jitCall(const UserFunction* function, double* args) {
+    return callUserFunction(*function, args, args[0]);
+}
+
+int jitReduce(const Reduction* reduction, double* args) {
+    return runReduction(*reduction, args, args[0]);
+}
+
+unsigned jitThreshold = 100;
+
+std::shared_ptr<JitCode> jitCompile(const CompiledExpression& program) {
+    CALC_STAT_STAGE(STAGE_COMPILE);
+    const size_t MAX_FRAME_SLOTS = 1 << 16;
+    size_t slots = program.maxDepth + program.tempCount;
+    if (slots > MAX_FRAME_SLOTS)
+        return nullptr;
+
+    std::vector<double> constants;
+    JitAssembler a;
+    // Four pushes and the return address leave rsp 8 bytes off alignment.
+    uint32_t frame = static_cast<uint32_t>(((slots * 8 + 15) & ~size_t(15)) + 8);
+    auto slot = [](size_t i) { return static_cast<int32_t>(i * 8); };
+    auto temp = [&](int t) { return static_cast<int32_t>((program.maxDepth + t) * 8); };
+
+    // Prologue: rbx = vars, r13 = result, r14 = args, r12 = constants (patched below).
+    a.bytes({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56}); // push rbx; push r12; push r13; push r14
+    a.bytes({0x48, 0x89, 0xFB});                   // mov rbx, rdi
+    a.bytes({0x49, 0x89, 0xF5});                   // mov r13, rsi
+    a.bytes({0x49, 0x89, 0xD6});                   // mov r14, rdx
+    a.bytes({0x49, 0xBC});                         // mov r12, imm64
+    size_t constantsAddress = a.code.size();
+    a.imm64(0);
+    a.bytes({0x48, 0x81, 0xEC});                   // sub rsp, frame
+    a.imm32(frame);
+
+    std::vector<size_t> errorJumps;
+    std::vector<size_t> callErrorJumps;
+    size_t depth = 0;
+    for (const auto& ins : program.code) {
+        switch (ins.op) {
+            case OP_CONST:
+                a.load(0, JitAssembler::R12, slot(constants.size()));
+                constants.push_back(ins.value);
+                a.store(0, JitAssembler::RSP, slot(depth++));
+                break;
+            case OP_VAR:
+                a.load(0, JitAssembler::RBX, slot(ins.index));
+                a.store(0, JitAssembler::RSP, slot(depth++));
+                break;
+            case OP_ARG:
+                a.load(0, JitAssembler::R14, slot(ins.index));
+                a.store(0, JitAssembler::RSP, slot(depth++));
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV: {
+                static const unsigned char opcodes[] = {0x58, 0x5C, 0x59, 0x5E};
+                if (ins.op == OP_DIV) {
+                    a.load(1, JitAssembler::RSP, slot(depth - 1));
+                    a.bytes({0x66, 0x0F, 0x57, 0xD2});     // xorpd xmm2, xmm2
+                    a.bytes({0x66, 0x0F, 0x2E, 0xCA});     // ucomisd xmm1, xmm2
+                    a.bytes({0x7A, 0x06});                 // jp +6 (NaN is not zero)
+                    errorJumps.push_back(a.jump({0x0F, 0x84}));  // je error
+                }
+                a.load(0, JitAssembler::RSP, slot(depth - 2));
+                a.sse(opcodes[ins.op - OP_ADD], 0, JitAssembler::RSP, slot(depth - 1));
+                a.store(0, JitAssembler::RSP, slot(depth - 2));
+                depth--;
+                break;
+            }
+            case OP_POW:
+                a.load(0, JitAssembler::RSP, slot(depth - 2));
+                a.load(1, JitAssembler::RSP, slot(depth - 1));
+                a.callAbsolute(reinterpret_cast<const void*>(&jitPow));
+                a.store(0, JitAssembler::RSP, slot(depth - 2));
+                depth--;
+                break;
+            case OP_FUNC:
+                a.load(0, JitAssembler::RSP, slot(depth - 1));
+                a.callAbsolute(reinterpret_cast<const void*>(builtinFunctions[ins.index].fn));
+                a.store(0, JitAssembler::RSP, slot(depth - 1));
+                break;
+            case OP_FUNC2:
+                a.load(0, JitAssembler::RSP, slot(depth - 2));
+                a.load(1, JitAssembler::RSP, slot(depth - 1));
+                a.callAbsolute(reinterpret_cast<const void*>(binaryFunctions[ins.index].fn));
+                a.store(0, JitAssembler::RSP, slot(depth - 2));
+                depth--;
+                break;
+            case OP_CALL: {
+                const UserFunction& function = userFunction(ins.index);
+                depth -= function.argumentCount() - 1;
+                a.bytes({0x48, 0xBF});                         // mov rdi, imm64
+                a.imm64(reinterpret_cast<uint64_t>(&function));
+                a.bytes({0x48, 0x8D, 0xB4, 0x24});             // lea rsi, [rsp + disp32]
+                a.imm32(static_cast<uint32_t>(slot(depth - 1)));
+                a.callAbsolute(reinterpret_cast<const void*>(&jitCall));
+                a.bytes({0x85, 0xC0});                         // test eax, eax
+                callErrorJumps.push_back(a.jump({0x0F, 0x85}));  // jne epilogue
+                break;
+            }
+            case OP_REDUCE: {
+                const Reduction* reduction = program.reductions[ins.index].get();
+                depth -= reduction->argumentCount() - 1;
+                a.bytes({0x48, 0xBF});                         // mov rdi, imm64
+                a.imm64(reinterpret_cast<uint64_t>(reduction));
+                a.bytes({0x48, 0x8D, 0xB4, 0x24});             // lea rsi, [rsp + disp32]
+                a.imm32(static_cast<uint32_t>(slot(depth - 1)));
+                a.callAbsolute(reinterpret_cast<const void*>(&jitReduce));
+                a.bytes({0x85, 0xC0});                         // test eax, eax
+                callErrorJumps.push_back(a.jump({0x0F, 0x85}));  // jne epilogue
+                break;
+            }
+            case OP_STORE:
+                a.load(0, JitAssembler::RSP, slot(depth - 1));
+                a.store(0, JitAssembler::RSP, temp(ins.index));
+                break;
+            case OP_LOAD:
+                a.load(0, JitAssembler::RSP, temp(ins.index));
+                a.store(0, JitAssembler::RSP, slot(depth++));
+                break;
+            case OP_LIST:
+                break;
+        }
+    }
+
+    // *result = top; return EVAL_OK
+    a.load(0, JitAssembler::RSP, slot(0));
+    a.store(0, JitAssembler::R13, 0);
+    a.bytes({0x31, 0xC0});                         // xor eax, eax
+    size_t epilogue = a.code.size();
+    a.bytes({0x48, 0x81, 0xC4});                   // add rsp, frame
+    a.imm32(frame);
+    a.bytes({0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3}); // pop r14; pop r13; pop r12; pop rbx; ret
+
+    size_t errorLabel = a.code.size();
+    a.bytes({0xB8});                               // mov eax, EVAL_DIVIDE_BY_ZERO
+    a.imm32(EVAL_DIVIDE_BY_ZERO);
+    a.patch(a.jump({0xE9}), epilogue);             // jmp epilogue
+    for (size_t at : errorJumps)
+        a.patch(at, errorLabel);
+    // A failed call already left its status in eax.
+    for (size_t at : callErrorJumps)
+        a.patch(at, epilogue);
+
+    while (a.code.size() % 8)
+        a.code.push_back(0xCC);
+    size_t constantsOffset = a.code.size();
+    size_t size = constantsOffset + constants.size() * sizeof(double);
+
+    auto jit = std::make_shared<JitCode>();
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return nullptr;
+    jit->memory = memory;
+    jit->size = size;
+
+    uint64_t address = reinterpret_cast<uint64_t>(memory) + constantsOffset;
+    memcpy(&a.code[constantsAddress], &address, 8);
+    memcpy(memory, a.code.data(), a.code.size());
+    if (!constants.empty())
+        memcpy(static_cast<char*>(memory) + constantsOffset, constants.data(), constants.size() * sizeof(double));
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+        return nullptr;
+    jit->entry = reinterpret_cast<JitCode::Entry>(memory);
+    return jit;
+}
+#endif
+
+// The interpreter loop, shared by whole programs and function bodies. stack
+// and temps must have room for the program's maxDepth and tempCount values.
+inline EvalStatus interpretProgram(const CompiledExpression& program, const double* vars, const double* args,
+                                   double* stack, double* temps, double& result) {
+    double* top = stack - 1;
+    for (const auto& ins : program.code) {
+        switch (ins.op) {
+            case OP_CONST:
+                *++top = ins.value;
+                break;
+            case OP_VAR:
+                *++top = vars[ins.index];
+                break;
+            case OP_ARG:
+                *++top = args[ins.index];
+                break;
+            case OP_ADD:
+                top[-1] = top[-1] + top[0];
+                top--;
+                break;
+            case OP_SUB:
+                top[-1] = top[-1] - top[0];
+                top--;
+                break;
+            case OP_MUL:
+                top[-1] = top[-1] * top[0];
+                top--;
+                break;
+            case OP_DIV:
+                if (top[0] == 0)
+                    return EVAL_DIVIDE_BY_ZERO;
+                top[-1] = top[-1] / top[0];
+                top--;
+                break;
+            case OP_POW:
+                top[-1] = std::pow(top[-1], top[0]);
+                top--;
+                break;
+            case OP_FUNC:
+                *top = builtinFunctions[ins.index].fn(*top);
+                break;
+            case OP_FUNC2:
+                top[-1] = binaryFunctions[ins.index].fn(top[-1], top[0]);
+                top--;
+                break;
+            case OP_CALL: {
+                const UserFunction& function = userFunction(ins.index);
+                top -= function.argumentCount() - 1;
+                EvalStatus status = callUserFunction(function, top, *top);
+                if (status != EVAL_OK)
+                    return status;
+                break;
+            }
+            case OP_REDUCE: {
+                const Reduction& reduction = *program.reductions[ins.index];
+                top -= reduction.argumentCount() - 1;
+                EvalStatus status = runReduction(reduction, top, *top);
+                if (status != EVAL_OK)
+                    return status;
+                break;
+            }
+            case OP_STORE:
+                temps[ins.index] = *top;
+                break;
+            case OP_LOAD:
+                *++top = temps[ins.index];
+                break;
+            case OP_LIST:
+                break;
+        }
+    }
+    result = *top;
+    return EVAL_OK;
+}
+
+EvalStatus runProgram(const CompiledExpression& program, double& result) {
+    CALC_STAT_STAGE(STAGE_EVALUATE);
+    CALC_STAT_EVALUATIONS(program, 1);
+#ifdef CALC_HAVE_JIT
+    if (program.jit)
+        return static_cast<EvalStatus>(program.jit->entry(activeVariables->values.data(), &result, nullptr));
+    if (++program.evalCount == jitThreshold)
+        program.jit = jitCompile(program);
+#endif
+
+    thread_local std::vector<double> stack;
+    if (stack.size() < program.maxDepth)
+        stack.resize(program.maxDepth);
+
+    thread_local std::vector<double> temps;
+    if (temps.size() < program.tempCount)
+        temps.resize(program.tempCount);
+
+    return interpretProgram(program, activeVariables->values.data(), nullptr, stack.data(), temps.data(), result);
+}
+
+// Results of a memoized function, bounded to BUCKETS entries. Each bucket
+// holds one argument list and its result; a new result simply replaces
+// whatever hashed to the same bucket. Arguments are compared bit for bit.
+class MemoTable {
+public:
+    static const size_t BUCKETS = 4096;
+
+    explicit MemoTable(size_t width) : width(width), keys(BUCKETS * width), results(BUCKETS), filled(BUCKETS) {}
+
+    size_t bucket(const double* args) const {
+        uint64_t h = 0;
+        for (size_t i = 0; i < width; i++) {
+            uint64_t bits;
+            memcpy(&bits, &args[i], sizeof(bits));
+            h = (h ^ bits) * 0x9E3779B97F4A7C15ull;
+        }
+        return (h ^ (h >> 32)) & (BUCKETS - 1);
+    }
+
+    bool find(size_t b, const double* args, double& result) const {
+        if (!filled[b] || memcmp(&keys[b * width], args, width * sizeof(double)) != 0)
+            return false;
+        result = results[b];
+        return true;
+    }
+
+    // Takes the bucket for these arguments before the call, since the result
+    // may overwrite them; fill() completes the entry once the call succeeds.
+    void claim(size_t b, const double* args) {
+        filled[b] = 0;
+        memcpy(&keys[b * width], args, width * sizeof(double));
+    }
+
+    void fill(size_t b, double result) {
+        results[b] = result;
+        filled[b] = 1;
+    }
+
+private:
+    size_t width;
+    std::vector<double> keys;
+    std::vector<double> results;
+    std::vector<unsigned char> filled;
+};
+
+// Memo tables are per thread, so batch and server workers never contend;
+// at most MAX_TABLES functions keep a table on each thread at once. A call
+// holds its table until it returns, so one dropped to make room for another
+// function's stays alive under the memoized calls still running on it.
+std::shared_ptr<MemoTable> memoTable(const UserFunction& function) {
+    const size_t MAX_TABLES = 16;
+    thread_local std::unordered_map<uint64_t, std::shared_ptr<MemoTable>> tables;
+    thread_local uint64_t lastSerial = 0;
+    thread_local std::shared_ptr<MemoTable> last;
+    if (last && lastSerial == function.serial)
+        return last;
+    auto it = tables.find(function.serial);
+    if (it == tables.end()) {
+        if (tables.size() >= MAX_TABLES)
+            tables.clear();
+        it = tables.emplace(function.serial, std::make_shared<MemoTable>(function.argumentCount())).first;
+    }
+    last = it->second;
+    lastSerial = function.serial;
+    return last;
+}
+
+// Calls a user-defined function with all its arguments, captured ones
+// included. result may alias args[0]. A body runs in a frame of its own, one
+// per level of calls, so it never disturbs the stack of the program that
+// called it.
+EvalStatus callUserFunction(const UserFunction& function, const double* args, double& result) {
+    std::shared_ptr<MemoTable> memo = function.memoized ? memoTable(function) : nullptr;
+    size_t bucket = 0;
+    if (memo) {
+        bucket = memo->bucket(args);
+        if (memo->find(bucket, args, result))
+            return EVAL_OK;
+        memo->claim(bucket, args);
+    }
+
+    const CompiledExpression& body = function.body;
+    EvalStatus status;
+#ifdef CALC_HAVE_JIT
+    if (body.jit) {
+        status = static_cast<EvalStatus>(body.jit->entry(nullptr, &result, args));
+    } else
+#endif
+    {
+        thread_local std::deque<std::vector<double>> frames;
+        thread_local size_t level = 0;
+        if (frames.size() <= level)
+            frames.emplace_back();
+        std::vector<double>& frame = frames[level];
+        if (frame.size() < body.maxDepth + body.tempCount)
+            frame.resize(body.maxDepth + body.tempCount);
+        level++;
+        status = interpretProgram(body, nullptr, args, frame.data(), frame.data() + body.maxDepth, result);
+        level--;
+    }
+
+    if (memo && status == EVAL_OK)
+        memo->fill(bucket, result);
+    return status;
+}
+
+std::string evalErrorMessage(EvalStatus status) {
+    switch (status) {
+        case EVAL_DIVIDE_BY_ZERO: return "Cannot divide by 0!";
+        case EVAL_INFINITE_RANGE: return "The range must be finite!";
+        case EVAL_RANGE_TOO_LARGE: return "Range is too large!";
+        case EVAL_EMPTY_RANGE: return "The range is empty!";
+        case EVAL_BAD_TOLERANCE: return "The tolerance must be positive!";
+        case EVAL_INTEGRAND_NOT_FINITE: return "The integrand is not finite in the range!";
+        case EVAL_INFINITE_RESULT: return "Result is infinite!";
+        default: return "Invalid expression!";
+    }
+}
+
+double evaluateProgram(const CompiledExpression& program) {
+    double result = 0;
+    EvalStatus status = runProgram(program, result);
+    if (status != EVAL_OK)
+        throw std::runtime_error(evalErrorMessage(status));
+    return result;
+}
+
+// Applies a binary or user-defined function token to the top of a value
+// stack, for the evaluators that work on tokens instead of programs. A user
+// function also gets the current values of the variables it captures. A
+// reduction is compiled from source, which must be the text token was lexed
+// from.
+void applyFunctionToken(std::vector<double>& valStack, const Token& token, std::string_view source) {
+    size_t arity = functionArity(token);
+    if (valStack.size() < arity)
+        throw std::runtime_error("Missing argument for function!");
+    if (token.op == FUNCTION_BUILTIN) {
+        valStack.back() = builtinFunctions[token.id].fn(valStack.back());
+        CALC_STAT_FUNCTION(token.id, 1);
+        return;
+    }
+    if (token.op == FUNCTION_BINARY) {
+        double right = valStack.back();
+        valStack.pop_back();
+        valStack.back() = binaryFunctions[token.id].fn(valStack.back(), right);
+        return;
+    }
+
+    size_t first = valStack.size() - arity;
+    double result = 0;
+    EvalStatus status;
+    if (token.op == FUNCTION_REDUCE) {
+        if (source.empty())
+            throw std::runtime_error(std::string(functionName(token)) + " is not supported here!");
+        std::shared_ptr<const Reduction> reduction = compileReduction(source, token);
+        for (const auto& name : reduction->captured)
+            valStack.push_back(activeVariables->at(name));
+        status = runReduction(*reduction, valStack.data() + first, result);
+    } else {
+        const UserFunction& function = userFunction(token.id);
+        for (const auto& name : function.captured)
+            valStack.push_back(activeVariables->at(name));
+        status = callUserFunction(function, valStack.data() + first, result);
+    }
+    if (status != EVAL_OK)
+        throw std::runtime_error(evalErrorMessage(status));
+    valStack.resize(first + 1);
+    valStack.back() = result;
+}
+
+// Forward-mode automatic differentiation: a value together with its
+// derivative with respect to one chosen variable.
+struct Dual {
+    double value;
+    double derivative;
+
+    Dual(double value = 0, double derivative = 0) : value(value), derivative(derivative) {}
+};
+
+inline Dual operator+(Dual a, Dual b) { return {a.value + b.value, a.derivative + b.derivative}; }
+inline Dual operator-(Dual a, Dual b) { return {a.value - b.value, a.derivative - b.derivative}; }
+inline Dual operator*(Dual a, Dual b) { return {a.value * b.value, a.derivative * b.value + a.value * b.derivative}; }
+inline Dual operator/(Dual a, Dual b) {
+    return {a.value / b.value, (a.derivative * b.value - a.value * b.derivative) / (b.value * b.value)};
+}
+
+inline double valueOf(double x) { return x; }
+inline double valueOf(Dual x) { return x.value; }
+
+inline double applyPow(double a, double b) { return std::pow(a, b); }
+inline Dual applyPow(Dual a, Dual b) {
+    double value = std::pow(a.value, b.value);
+    double derivative = 0;
+    if (a.derivative != 0)
+        derivative += b.value * std::pow(a.value, b.value - 1) * a.derivative;
+    if (b.derivative != 0)
+        derivative += value * std::log(a.value) * b.derivative;
+    return {value, derivative};
+}
+
+inline double applyFunction(int function, double x) { return builtinFunctions[function].fn(x); }
+inline Dual applyFunction(int function, Dual x) {
+    const BuiltinFunction& f = builtinFunctions[function];
+    return {f.fn(x.value), x.derivative == 0 ? 0 : f.derivative(x.value) * x.derivative};
+}
+
+inline double applyBinaryFunction(int function, double x, double y) { return binaryFunctions[function].fn(x, y); }
+inline Dual applyBinaryFunction(int function, Dual x, Dual y) {
+    switch (function) {
+        case BINARY_MIN: return x.value < y.value || std::isnan(y.value) ? x : y;
+        case BINARY_MAX: return x.value > y.value || std::isnan(y.value) ? x : y;
+        case BINARY_POW: return applyPow(x, y);
+        default: {
+            // atan2(x, y) is the angle of the point (y, x).
+            double r2 = x.value * x.value + y.value * y.value;
+            return {std::atan2(x.value, y.value), (y.value * x.derivative - x.value * y.derivative) / r2};
+        }
+    }
+}
+
+template <typename T>
+EvalStatus reduceAs(const Reduction& reduction, const T* args, T& result);
+
+EvalStatus integrateAs(const Reduction& reduction, const Dual* args, Dual& value);
+inline EvalStatus integrateAs(const Reduction& reduction, const double* args, double& value) {
+    return runReduction(reduction, args, value);
+}
+
+// Interprets a program over any number type with the operations above, for
+// evaluators that need more than a plain double (e.g. derivatives). Like
+// callUserFunction(), every level of calls gets a stack of its own.
+template <typename T>
+EvalStatus interpretProgramAs(const CompiledExpression& program, const T* vars, const T* args, T& result) {
+    struct Frame {
+        std::vector<T> stack;
+        std::vector<T> temps;
+    };
+    thread_local std::deque<Frame> frames;
+    thread_local size_t level = 0;
+    if (frames.size() <= level)
+        frames.emplace_back();
+    std::vector<T>& stack = frames[level].stack;
+    std::vector<T>& temps = frames[level].temps;
+    stack.clear();
+    temps.resize(program.tempCount);
+
+    for (const auto& ins : program.code) {
+        switch (ins.op) {
+            case OP_CONST:
+                stack.push_back(T(ins.value));
+                break;
+            case OP_VAR:
+                stack.push_back(vars[ins.index]);
+                break;
+            case OP_ARG:
+                stack.push_back(args[ins.index]);
+                break;
+            case OP_FUNC:
+                stack.back() = applyFunction(ins.index, stack.back());
+                break;
+            case OP_CALL: {
+                const UserFunction& function = userFunction(ins.index);
+                size_t first = stack.size() - function.argumentCount();
+                T value;
+                level++;
+                EvalStatus status = interpretProgramAs(function.body, vars, stack.data() + first, value);
+                level--;
+                if (status != EVAL_OK)
+                    return status;
+                stack.resize(first);
+                stack.push_back(value);
+                break;
+            }
+            case OP_REDUCE: {
+                const Reduction& reduction = *program.reductions[ins.index];
+                size_t first = stack.size() - reduction.argumentCount();
+                T value;
+                level++;
+                EvalStatus status = reduceAs(reduction, stack.data() + first, value);
+                level--;
+                if (status != EVAL_OK)
+                    return status;
+                stack.resize(first);
+                stack.push_back(value);
+                break;
+            }
+            case OP_STORE:
+                temps[ins.index] = stack.back();
+                break;
+            case OP_LOAD:
+                stack.push_back(temps[ins.index]);
+                break;
+            case OP_LIST:
+                break;
+            default: {
+                T right = stack.back();
+                stack.pop_back();
+                T& left = stack.back();
+                switch (ins.op) {
+                    case OP_ADD: left = left + right; break;
+                    case OP_SUB: left = left - right; break;
+                    case OP_MUL: left = left * right; break;
+                    case OP_DIV:
+                        if (valueOf(right) == 0)
+                            return EVAL_DIVIDE_BY_ZERO;
+                        left = left / right;
+                        break;
+                    case OP_POW: left = applyPow(left, right); break;
+                    case OP_FUNC2: left = applyBinaryFunction(ins.index, left, right); break;
+                    default: break;
+                }
+            }
+        }
+    }
+    result = stack.back();
+    return EVAL_OK;
+}
+
+// Evaluates a reduction term by term, in order. The bounds only pick the
+// terms, so their derivatives do not carry over.
+template <typename T>
+EvalStatus reduceAs(const Reduction& reduction, const T* args, T& result) {
+    if (isIntegral(reduction.kind))
+        return integrateAs(reduction, args, result);
+    uint64_t count = 0;
+    EvalStatus status = reductionCount(reduction.kind, valueOf(args[0]), valueOf(args[1]), count);
+    if (status != EVAL_OK)
+        return status;
+    std::vector<T> vars(args + 1, args + reduction.argumentCount());
+    result = T(reduction.kind == REDUCE_PROD ? 1 : 0);
+    for (uint64_t i = 0; i < count; i++) {
+        vars[0] = T(valueOf(args[0]) + static_cast<double>(i));
+        T term;
+        status = interpretProgramAs(reduction.body, vars.data(), static_cast<const T*>(nullptr), term);
+        if (status != EVAL_OK)
+            return status;
+        switch (reduction.kind) {
+            case REDUCE_SUM: result = result + term; break;
+            case REDUCE_PROD: result = result * term; break;
+            case REDUCE_MIN: result = i == 0 ? term : applyBinaryFunction(BINARY_MIN, result, term); break;
+            case REDUCE_MAX: result = i == 0 ? term : applyBinaryFunction(BINARY_MAX, result, term); break;
+            default: break;
+        }
+    }
+    return EVAL_OK;
+}
+
+template <typename T>
+EvalStatus runProgramAs(const CompiledExpression& program, const T* vars, T& result) {
+    CALC_STAT_STAGE(STAGE_EVALUATE);
+    CALC_STAT_EVALUATIONS(program, 1);
+    return interpretProgramAs<T>(program, vars, nullptr, result);
+}
+
+// Value of d(expr)/d(name) at the current variable values.
+double evaluateDerivative(std::string_view expr, std::string_view name) {
+    int slot = activeVariables->find(trimView(name));
+    if (slot < 0)
+        throw std::runtime_error("Unknown variable: " + std::string(trimView(name)));
+    CompiledExpression program;
+    compileExpression(expandBindings(expr, {slot}), program);
+
+    std::vector<Dual> vars(activeVariables->size());
+    for (size_t i = 0; i < vars.size(); i++)
+        vars[i] = Dual{activeVariables->values[i], i == static_cast<size_t>(slot) ? 1.0 : 0.0};
+    Dual result{0, 0};
+    EvalStatus status = runProgramAs(program, vars.data(), result);
+    if (status != EVAL_OK)
+        throw std::runtime_error(evalErrorMessage(status));
+    return result.derivative;
+}
+
+// Recognizes "diff(expr, name)" and splits it at the last top-level comma.
+bool parseDiffCall(std::string_view line, std::string_view& expr, std::string_view& name) {
+    line = trimView(line);
+    if (line.substr(0, 5) != "diff(" || line.back() != ')')
+        return false;
+    std::string_view inner = line.substr(5, line.size() - 6);
+    int depth = 0;
+    size_t comma = std::string_view::npos;
+    for (size_t i = 0; i < inner.size(); i++) {
+        if (inner[i] == '(')
+            depth++;
+        else if (inner[i] == ')')
+            depth--;
+        else if (inner[i] == ',' && depth == 0)
+            comma = i;
+    }
+    if (comma == std::string_view::npos)
+        throw std::runtime_error("Usage: diff(expression, variable)");
+    expr = inner.substr(0, comma);
+    name = inner.substr(comma + 1);
+    return true;
+}
+
+// Splits a line that is one call, "name(a, b, ...)", into the name and its
+// top-level arguments. Returns false for anything else, e.g. "f(x) * 2".
+bool splitCall(std::string_view line, std::string_view& name, std::vector<std::string_view>& args) {
+    line = trimView(line);
+    size_t open = line.find('(');
+    if (open == std::string_view::npos || line.back() != ')')
+        return false;
+    name = trimView(line.substr(0, open));
+    args.clear();
+    int depth = 0;
+    size_t start = open + 1;
+    for (size_t i = start; i < line.size(); i++) {
+        if (line[i] == '(') {
+            depth++;
+        } else if (line[i] == ')' && depth-- == 0) {
+            if (i + 1 != line.size())
+                return false;
+            args.push_back(line.substr(start, i - start));
+        } else if (line[i] == ',' && depth == 0) {
+            args.push_back(line.substr(start, i - start));
+            start = i + 1;
+        }
+    }
+    return true;
+}
+
+// Whether a line is one integrate call, whose error estimate is then shown
+// with its result.
+bool isIntegralLine(std::string_view line) {
+    thread_local std::vector<std::string_view> args;
+    std::string_view head;
+    return trimView(line).substr(0, 9) == "integrate" && splitCall(line, head, args) && head == "integrate";
+}
+
+// What the integrals evaluated for one line reported: the error estimate of
+// the last one to finish, which for a line that is one integral is that
+// integral's, and whether every one of them, at any depth, reached its
+// tolerance. Nested integrals may run on other threads.
+struct IntegralReport {
+    std::atomic<double> error{0};
+    std::atomic<bool> converged{true};
+};
+
+// The report of the line being evaluated on this thread, if any. Work shared
+// out to the pool carries it along with the environment.
+thread_local IntegralReport* integralReport = nullptr;
+
+class IntegralReportScope {
+public:
+    explicit IntegralReportScope(IntegralReport* report) : outer(integralReport) { integralReport = report; }
+    ~IntegralReportScope() { integralReport = outer; }
+
+private:
+    IntegralReport* outer;
+};
+
+void warnUnconverged(const IntegralReport& report) {
+    if (!report.converged)
+        std::cerr << "Warning: an integral did not reach its tolerance." << std::endl;
+}
+
+// Lists a compiled program one instruction per line, for the :explain command.
+std::string explainProgram(const CompiledExpression& program) {
+    static const char* names[] = {"const", "var", "add", "sub", "mul", "div", "pow", "call", "store", "load",
+                                  "call", "arg", "call", "list", "reduce"};
+    std::ostringstream out;
+    for (size_t i = 0; i < program.code.size(); i++) {
+        const Instruction& ins = program.code[i];
+        out << "    " << i << ": " << names[ins.op];
+        if (ins.op == OP_CONST)
+            out << " " << ins.value;
+        else if (ins.op == OP_VAR)
+            out << " " << activeVariables->names[ins.index];
+        else if (ins.op == OP_FUNC)
+            out << " " << builtinFunctions[ins.index].name;
+        else if (ins.op == OP_FUNC2)
+            out << " " << binaryFunctions[ins.index].name;
+        else if (ins.op == OP_CALL)
+            out << " " << userFunction(ins.index).name;
+        else if (ins.op == OP_REDUCE)
+            out << " " << reductionNames[program.reductions[ins.index]->kind] << " over "
+                << program.reductions[ins.index]->name;
+        else if (ins.op == OP_ARG)
+            out << " " << ins.index;
+        else if (ins.op == OP_STORE || ins.op == OP_LOAD)
+            out << " t" << ins.index;
+        out << "\n";
+    }
+    out << "    (" << program.code.size() << " instructions, stack depth " << program.maxDepth
+        << ", " << program.tempCount << " temporaries)";
+    return out.str();
+}
+
+// Whitespace only matters between two characters that would otherwise merge
+// into one number or name ("2 3" is 2*3, "23" is not), so the cache key keeps
+// a single space there and drops it everywhere else.
+void normalizeExpression(std::string_view expr, std::string& key) {
+    key.clear();
+    bool pendingSpace = false;
+    for (char ch : expr) {
+        if (isspace(static_cast<unsigned char>(ch))) {
+            pendingSpace = true;
+            continue;
+        }
+        if (pendingSpace && !key.empty()) {
+            auto joins = [](char c) { return isalnum(static_cast<unsigned char>(c)) || c == '.'; };
+            if (joins(key.back()) && joins(ch))
+                key += ' ';
+        }
+        pendingSpace = false;
+        key += ch;
+    }
+}
+
+// Least-recently-used cache of compiled expressions keyed by normalized text.
+// Defining a function can change what a text compiles to, so the cache is
+// emptied whenever the active environment's functions change.
+class ExpressionCache {
+public:
+    explicit ExpressionCache(size_t capacity = 1024) : capacity(capacity) {}
+
+    // The returned reference stays valid until the next call to get(). A hit
+    // does not allocate.
+    const CompiledExpression& get(std::string_view expr) {
+        if (generation != activeVariables->functionGeneration) {
+            index.clear();
+            entries.clear();
+            generation = activeVariables->functionGeneration;
+        }
+        normalizeExpression(expr, key);
+        auto it = index.find(key);
+        if (it != index.end()) {
+            hitCount++;
+            entries.splice(entries.begin(), entries, it->second);
+            return it->second->second;
+        }
+
+        missCount++;
+        if (entries.size() >= capacity && !entries.empty()) {
+            // Reuse the least recently used entry, and its buffers, for the new program.
+            index.erase(entries.back().first);
+            entries.splice(entries.begin(), entries, std::prev(entries.end()));
+        } else {
+            entries.emplace_front();
+        }
+        Entry& entry = entries.front();
+        try {
+            compileExpression(expr, entry.second);
+        } catch (...) {
+            entries.pop_front();
+            throw;
+        }
+        entry.first = key;
+        index[entry.first] = entries.begin();
+        return entry.second;
+    }
+
+    size_t hits() const { return hitCount; }
+    size_t misses() const { return missCount; }
+    size_t size() const { return entries.size(); }
+
+private:
+    using Entry = std::pair<std::string, CompiledExpression>;
+
+    size_t capacity;
+    size_t hitCount = 0;
+    size_t missCount = 0;
+    unsigned generation = 0;
+    std::string key;
+    std::list<Entry> entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+};
+
+// One cache per thread, so parallel batch workers never share an entry.
+thread_local ExpressionCache expressionCache;
+
+// "f(x, y) = body", or "memo f(x, y) = body" for a function whose results
+// are cached.
+struct FunctionDefinition {
+    std::string_view name;
+    std::vector<std::string_view> params;
+    std::string_view body;
+    bool memoized = false;
+};
+
+bool isReservedName(std::string_view name) {
+    return findBuiltinFunction(name) >= 0 || findBinaryFunction(name) >= 0 || findReduction(name) >= 0 ||
+           findMatrixFunction(name) >= 0 || name == "pi" || name == "e" || name == "diff" || name == "integrate";
+}
+
+// Recognizes a definition by its shape alone: a name that is not a builtin,
+// a parenthesized list of names, then '='. Anything else, such as
+// "sin(x) = 0.5" or "x(x + 1) = 6", is left to be solved as an equation.
+bool parseFunctionDefinition(std::string_view line, FunctionDefinition& definition) {
+    line = trimView(line);
+    size_t eqPos = line.find('=');
+    if (eqPos == std::string_view::npos || line.find(';') != std::string_view::npos)
+        return false;
+    std::string_view head = trimView(line.substr(0, eqPos));
+    definition.memoized = head.substr(0, 5) == "memo " || head.substr(0, 5) == "memo\t";
+    if (definition.memoized)
+        head = trimView(head.substr(5));
+
+    size_t open = head.find('(');
+    if (open == std::string_view::npos || head.back() != ')')
+        return false;
+    definition.name = trimView(head.substr(0, open));
+    if (definition.name.empty() || !std::all_of(definition.name.begin(), definition.name.end(), ::isalpha) ||
+        isReservedName(definition.name))
+        return false;
+
+    definition.params.clear();
+    std::string_view list = head.substr(open + 1, head.size() - open - 2);
+    for (size_t start = 0;;) {
+        size_t comma = std::min(list.find(',', start), list.size());
+        std::string_view param = trimView(list.substr(start, comma - start));
+        if (param.empty() || !std::all_of(param.begin(), param.end(), ::isalpha))
+            return false;
+        definition.params.push_back(param);
+        if (comma == list.size())
+            break;
+        start = comma + 1;
+    }
+    definition.body = trimView(line.substr(eqPos + 1));
+    return true;
+}
+
+// Serials tell apart functions that share a name, across environments too.
+uint64_t nextFunctionSerial() {
+    static std::atomic<uint64_t> serials{0};
+    return ++serials;
+}
+
+// Compiles a definition and makes it the active environment's meaning of its
+// name. Bodies of at most INLINE_LIMIT instructions, once optimized, are
+// inlined into their callers, unless they are memoized. Returns the new
+// function's signature, e.g. "f(x, y)".
+std::string defineFunction(const FunctionDefinition& definition) {
+    const size_t INLINE_LIMIT = 32;
+
+    auto function = std::make_shared<UserFunction>();
+    function->name = definition.name;
+    for (auto param : definition.params) {
+        if (isReservedName(param))
+            throw std::runtime_error("Invalid parameter name: " + std::string(param));
+        if (std::find(function->params.begin(), function->params.end(), param) != function->params.end())
+            throw std::runtime_error("Duplicate parameter: " + std::string(param));
+        function->params.emplace_back(param);
+    }
+    function->source = definition.body;
+    function->memoized = definition.memoized;
+    function->serial = nextFunctionSerial();
+
+    std::vector<Token> tokens;
+    tokenize(function->source, tokens);
+    infixToPostfix(tokens, function->postfix);
+
+    std::vector<std::string>& params = function->params;
+    std::vector<std::string>& captured = function->captured;
+    auto capture = [&](std::string_view name) {
+        auto it = std::find(captured.begin(), captured.end(), name);
+        if (it == captured.end())
+            it = captured.insert(captured.end(), std::string(name));
+        return static_cast<int>(params.size() + (it - captured.begin()));
+    };
+    auto argument = [&](std::string_view name) {
+        auto it = std::find(params.begin(), params.end(), name);
+        return it != params.end() ? static_cast<int>(it - params.begin()) : capture(name);
+    };
+    lowerPostfix(function->postfix, function->source, function->body, OP_ARG, argument, capture);
+    optimizeProgram(function->body);
+    function->inlined = !function->memoized && function->body.code.size() <= INLINE_LIMIT;
+#ifdef CALC_HAVE_JIT
+    if (!function->inlined)
+        function->body.jit = jitCompile(function->body);
+#endif
+
+    std::string signature = function->name + "(";
+    for (size_t i = 0; i < params.size(); i++)
+        signature += (i ? ", " : "") + params[i];
+    signature += ")";
+    std::string_view name = definition.name;
+    activeVariables->addFunction(name, std::move(function));
+    return signature;
+}
+
+// Thrown when an equation cannot be written as a linear combination of its
+// unknowns, e.g. x*y or sin(x).
+struct NonlinearEquation : std::runtime_error {
+    NonlinearEquation() : std::runtime_error("Equation is not linear!") {}
+};
+
+// constant + sum(coeff * unknown), with terms kept sorted by unknown index.
+struct LinearForm {
+    double constant = 0;
+    std::vector<std::pair<int, double>> terms;
+
+    bool isConstant() const { return terms.empty(); }
+};
+
+LinearForm combineLinear(const LinearForm& left, const LinearForm& right, double sign) {
+    LinearForm out;
+    out.constant = left.constant + sign * right.constant;
+    size_t i = 0, j = 0;
+    while (i < left.terms.size() || j < right.terms.size()) {
+        if (j == right.terms.size() || (i < left.terms.size() && left.terms[i].first < right.terms[j].first)) {
+            out.terms.push_back(left.terms[i++]);
+        } else if (i == left.terms.size() || right.terms[j].first < left.terms[i].first) {
+            out.terms.emplace_back(right.terms[j].first, sign * right.terms[j].second);
+            j++;
+        } else {
+            double coeff = left.terms[i].second + sign * right.terms[j].second;
+            if (coeff != 0)
+                out.terms.emplace_back(left.terms[i].first, coeff);
+            i++;
+            j++;
+        }
+    }
+    return out;
+}
+
+void scaleLinear(LinearForm& form, double factor) {
+    form.constant *= factor;
+    for (auto& term : form.terms)
+        term.second *= factor;
+    if (factor == 0)
+        form.terms.clear();
+}
+
+// Names of the unknowns of an equation, numbered in order of first appearance.
+struct UnknownTable {
+    std::vector<std::string> names;
+    std::unordered_map<std::string, int> index;
+
+    int intern(std::string_view name) {
+        auto it = index.find(std::string(name));
+        if (it != index.end())
+            return it->second;
+        names.emplace_back(name);
+        index.emplace(names.back(), static_cast<int>(names.size() - 1));
+        return static_cast<int>(names.size() - 1);
+    }
+
+    size_t size() const { return names.size(); }
+};
+
+// An equation that names one variable is solved for it. One that names more
+// treats those that already have values as constants, and solves for the rest.
+bool isEquationConstant(std::string_view name, size_t nameCount) {
+    return nameCount > 1 && activeVariables->find(name) >= 0;
+}
+
+// Reads the coefficients of every unknown straight off the postfix form of
+// one side, in a single pass. Names in constants read their current values.
+LinearForm extractLinearForm(const std::string& side, UnknownTable& unknowns,
+                             const std::unordered_set<std::string>& constants) {
+    auto postfix = infixToPostfix(tokenize(side));
+    std::vector<LinearForm> stack;
+
+    for (const auto& token : postfix) {
+        if (token.type == NUMBER) {
+            stack.emplace_back();
+            stack.back().constant = token.value;
+        } else if (token.type == VARIABLE) {
+            std::string_view name = tokenText(side, token);
+            stack.emplace_back();
+            if (constants.count(std::string(name)))
+                stack.back().constant = activeVariables->values[activeVariables->find(name)];
+            else
+                stack.back().terms.emplace_back(unknowns.intern(name), 1.0);
+        } else if (token.type == OPERATOR) {
+            if (stack.size() < 2)
+                throw std::runtime_error("Invalid expression!");
+            LinearForm right = std::move(stack.back());
+            stack.pop_back();
+            LinearForm& left = stack.back();
+
+            switch (token.op) {
+                case '+':
+                    left = combineLinear(left, right, 1);
+                    break;
+                case '-':
+                    left = combineLinear(left, right, -1);
+                    break;
+                case '*':
+                    if (left.isConstant()) {
+                        scaleLinear(right, left.constant);
+                        left = std::move(right);
+                    } else if (right.isConstant()) {
+                        scaleLinear(left, right.constant);
+                    } else {
+                        throw NonlinearEquation();
+                    }
+                    break;
+                case '/':
+                    if (!right.isConstant())
+                        throw NonlinearEquation();
+                    if (right.constant == 0)
+                        throw std::runtime_error("Cannot divide by 0!");
+                    scaleLinear(left, 1 / right.constant);
+                    break;
+                case '^':
+                    if (!right.isConstant())
+                        throw NonlinearEquation();
+                    if (left.isConstant())
+                        left.constant = std::pow(left.constant, right.constant);
+                    else if (right.constant != 1)
+                        throw NonlinearEquation();
+                    break;
+                default:
+                    throw std::runtime_error("Unknown operator!");
+            }
+        } else if (token.type == FUNCTION) {
+            // A function of an unknown is not linear, and neither is a user
+            // function or reduction that reads variables of its own.
+            size_t arity = functionArity(token);
+            if (stack.size() < arity)
+                throw std::runtime_error("Missing argument for function!");
+            std::vector<double> args;
+            for (size_t i = stack.size() - arity; i < stack.size(); i++) {
+                if (!stack[i].isConstant())
+                    throw NonlinearEquation();
+                args.push_back(stack[i].constant);
+            }
+            if (token.op == FUNCTION_USER && !userFunction(token.id).captured.empty())
+                throw NonlinearEquation();
+            if (token.op == FUNCTION_REDUCE && !compileReduction(side, token)->captured.empty())
+                throw NonlinearEquation();
+            applyFunctionToken(args, token, side);
+            stack.resize(stack.size() - arity + 1);
+            stack.back().constant = args.back();
+        }
+    }
+    if (stack.size() != 1)
+        throw std::runtime_error("Invalid expression!");
+
+    return std::move(stack.back());
+}
+
+// One row of a linear system: sum(coeff * unknown) = rhs, sorted by unknown.
+struct LinearRow {
+    std::vector<std::pair<int, double>> terms;
+    double rhs = 0;
+};
+
+// Dense LU decomposition with partial pivoting. Returns false if the matrix
+// is singular.
+bool solveDense(const std::vector<LinearRow>& rows, size_t n, std::vector<double>& x) {
+    std::vector<double> a(n * n, 0.0);
+    std::vector<double> b(n);
+    std::vector<size_t> perm(n);
+    for (size_t r = 0; r < n; r++) {
+        for (const auto& term : rows[r].terms)
+            a[r * n + term.first] = term.second;
+        b[r] = rows[r].rhs;
+        perm[r] = r;
+    }
+
+    double scale = 0;
+    for (double v : a)
+        scale = std::max(scale, std::abs(v));
+    const double EPS = 1e-12 * std::max(scale, 1.0);
+
+    for (size_t k = 0; k < n; k++) {
+        size_t pivot = k;
+        for (size_t r = k + 1; r < n; r++) {
+            if (std::abs(a[r * n + k]) > std::abs(a[pivot * n + k]))
+                pivot = r;
+        }
+        if (std::abs(a[pivot * n + k]) < EPS)
+            return false;
+        if (pivot != k) {
+            std::swap_ranges(a.begin() + k * n, a.begin() + (k + 1) * n, a.begin() + pivot * n);
+            std::swap(perm[k], perm[pivot]);
+        }
+        for (size_t r = k + 1; r < n; r++) {
+            double factor = a[r * n + k] / a[k * n + k];
+            a[r * n + k] = factor;
+            for (size_t c = k + 1; c < n; c++)
+                a[r * n + c] -= factor * a[k * n + c];
+        }
+    }
+
+    // Forward substitution with L (unit diagonal), then back substitution with U.
+    std::vector<double> y(n);
+    for (size_t r = 0; r < n; r++) {
+        double sum = b[perm[r]];
+        for (size_t c = 0; c < r; c++)
+            sum -= a[r * n + c] * y[c];
+        y[r] = sum;
+    }
+    x.assign(n, 0);
+    for (size_t r = n; r-- > 0;) {
+        double sum = y[r];
+        for (size_t c = r + 1; c < n; c++)
+            sum -= a[r * n + c] * x[c];
+        x[r] = sum / a[r * n + r];
+    }
+    return true;
+}
+
+// Sparse Gaussian elimination for large generated systems. At each step the
+// column with the fewest remaining entries is eliminated, using the sparsest
+// row whose entry is within a factor of ten of the largest one in that
+// column (threshold partial pivoting). This Markowitz-style choice keeps
+// fill-in low without giving up stability. Returns false if the matrix is
+// singular.
+bool solveSparse(std::vector<LinearRow> rows, size_t n, std::vector<double>& x) {
+    std::vector<std::vector<int>> columnRows(n);
+    std::vector<int> columnCount(n, 0);
+    double scale = 0;
+    for (size_t r = 0; r < rows.size(); r++) {
+        for (const auto& term : rows[r].terms) {
+            columnRows[term.first].push_back(static_cast<int>(r));
+            columnCount[term.first]++;
+            scale = std::max(scale, std::abs(term.second));
+        }
+    }
+    const double EPS = 1e-12 * std::max(scale, 1.0);
+
+    std::set<std::pair<int, int>> byCount;
+    for (size_t c = 0; c < n; c++)
+        byCount.emplace(columnCount[c], static_cast<int>(c));
+    std::vector<char> eliminated(n, 0);
+    auto adjustCount = [&](int c, int delta) {
+        if (eliminated[c])
+            return;
+        byCount.erase({columnCount[c], c});
+        columnCount[c] += delta;
+        byCount.emplace(columnCount[c], c);
+    };
+
+    auto coefficient = [&](int r, int c) {
+        const auto& terms = rows[r].terms;
+        auto it = std::lower_bound(terms.begin(), terms.end(), std::make_pair(c, -HUGE_VAL));
+        return (it != terms.end() && it->first == c) ? it->second : 0.0;
+    };
+
+    std::vector<char> used(rows.size(), 0);
+    std::vector<std::pair<int, int>> pivots;  // (column, row) in elimination order
+    std::vector<std::pair<int, double>> live;
+    std::vector<std::pair<int, double>> merged;
+
+    while (!byCount.empty()) {
+        int c = byCount.begin()->second;
+        byCount.erase(byCount.begin());
+        eliminated[c] = 1;
+
+        // columnRows may hold duplicates and rows that no longer have column c.
+        auto& candidates = columnRows[c];
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+        double largest = 0;
+        live.clear();
+        for (int r : candidates) {
+            if (used[r])
+                continue;
+            double v = coefficient(r, c);
+            if (v != 0) {
+                live.emplace_back(r, v);
+                largest = std::max(largest, std::abs(v));
+            }
+        }
+        if (largest < EPS)
+            return false;
+
+        int pivot = -1;
+        double pivotValue = 0;
+        for (const auto& entry : live) {
+            if (std::abs(entry.second) >= 0.1 * largest &&
+                (pivot < 0 || rows[entry.first].terms.size() < rows[pivot].terms.size())) {
+                pivot = entry.first;
+                pivotValue = entry.second;
+            }
+        }
+        used[pivot] = 1;
+        pivots.emplace_back(c, pivot);
+        for (const auto& term : rows[pivot].terms)
+            adjustCount(term.first, -1);
+
+        const auto& p = rows[pivot].terms;
+        for (const auto& entry : live) {
+            int r = entry.first;
+            if (r == pivot)
+                continue;
+            double factor = entry.second / pivotValue;
+            const auto& t = rows[r].terms;
+            merged.clear();
+            size_t i = 0, j = 0;
+            while (i < t.size() || j < p.size()) {
+                if (j == p.size() || (i < t.size() && t[i].first < p[j].first)) {
+                    merged.push_back(t[i++]);
+                } else if (i == t.size() || p[j].first < t[i].first) {
+                    merged.emplace_back(p[j].first, -factor * p[j].second);
+                    columnRows[p[j].first].push_back(r);
+                    adjustCount(p[j].first, 1);
+                    j++;
+                } else {
+                    double v = t[i].second - factor * p[j].second;
+                    if (t[i].first != c && std::abs(v) > EPS * 1e-4)
+                        merged.emplace_back(t[i].first, v);
+                    else
+                        adjustCount(t[i].first, -1);
+                    i++;
+                    j++;
+                }
+            }
+            rows[r].terms.swap(merged);
+            rows[r].rhs -= factor * rows[pivot].rhs;
+        }
+    }
+
+    // A pivot row only refers to its own column and columns eliminated after it.
+    x.assign(n, 0);
+    for (size_t k = pivots.size(); k-- > 0;) {
+        int c = pivots[k].first;
+        const LinearRow& row = rows[pivots[k].second];
+        double sum = row.rhs;
+        double diagonal = 0;
+        for (const auto& term : row.terms) {
+            if (term.first == c)
+                diagonal = term.second;
+            else
+                sum -= term.second * x[term.first];
+        }
+        x[c] = sum / diagonal;
+    }
+    return true;
+}
+
+// Returns the line to print: the solution, or a note about why there is none.
+// Accepts one equation or a system separated by ';'. Which names are unknowns
+// follows isEquationConstant().
+std::string solveLinearEquation(const std::string& equation) {
+    std::vector<std::pair<std::string, std::string>> sides;
+    std::stringstream parts(equation);
+    std::string part;
+    while (std::getline(parts, part, ';')) {
+        if (trimView(part).empty())
+            continue;
+        size_t eqPos = part.find('=');
+        if (eqPos == std::string::npos) {
+            throw std::runtime_error("No '=' found in equation!");
+        }
+        if (part.find('=', eqPos + 1) != std::string::npos)
+            throw std::runtime_error("More than one '=' in equation!");
+        sides.emplace_back(part.substr(0, eqPos), part.substr(eqPos + 1));
+    }
+    if (sides.empty())
+        throw std::runtime_error("No '=' found in equation!");
+
+    UnknownTable names;
+    for (const auto& equationSides : sides) {
+        for (const std::string* side : {&equationSides.first, &equationSides.second}) {
+            for (const auto& token : tokenize(*side)) {
+                if (token.type == VARIABLE)
+                    names.intern(tokenText(*side, token));
+            }
+        }
+    }
+    std::unordered_set<std::string> constants;
+    for (const auto& name : names.names) {
+        if (isEquationConstant(name, names.size()))
+            constants.insert(name);
+    }
+
+    UnknownTable unknowns;
+    std::vector<LinearForm> forms;
+    for (const auto& equationSides : sides) {
+        LinearForm lhs = extractLinearForm(equationSides.first, unknowns, constants);
+        LinearForm rhs = extractLinearForm(equationSides.second, unknowns, constants);
+        forms.push_back(combineLinear(lhs, rhs, -1));
+    }
+
+    const double EPS = 1e-12;
+    if (forms.size() == 1 && unknowns.size() <= 1) {
+        const LinearForm& form = forms[0];
+        double coeff = form.terms.empty() ? 0 : form.terms[0].second;
+        double constant = form.constant;
+        if (std::abs(coeff) < EPS) {
+            if (std::abs(constant) < EPS)
+                return "Infinite solutions (identity equation).";
+            return "No solution (contradiction).";
+        }
+
+        double x = -constant / coeff;
+        std::ostringstream out;
+        out << unknowns.names[0] << " = " << x;
+        return out.str();
+    }
+
+    if (forms.size() != unknowns.size()) {
+        std::ostringstream out;
+        out << "System has " << forms.size() << " equations in " << unknowns.size()
+            << " unknowns; a unique solution needs one equation per unknown.";
+        throw std::runtime_error(out.str());
+    }
+
+    std::vector<LinearRow> rows(forms.size());
+    for (size_t r = 0; r < forms.size(); r++) {
+        rows[r].terms = std::move(forms[r].terms);
+        rows[r].rhs = -forms[r].constant;
+    }
+
+    const size_t DENSE_LIMIT = 64;
+    std::vector<double> x;
+    bool solved = unknowns.size() <= DENSE_LIMIT
+        ? solveDense(rows, unknowns.size(), x)
+        : solveSparse(std::move(rows), unknowns.size(), x);
+    if (!solved)
+        return "No unique solution (singular system).";
+
+    std::ostringstream out;
+    for (size_t i = 0; i < unknowns.size(); i++)
+        out << (i ? ", " : "") << unknowns.names[i] << " = " << x[i];
+    return out.str();
+}
+
+// Roots of f(x) = lhs - rhs for one unknown, found by sampling the bracket,
+// then refining each sign change with safeguarded Newton steps. Each
+// evaluation yields f and f' together (dual numbers), so Newton needs no
+// extra evaluations for the derivative. A step that would leave the
+// current bracket becomes a bisection step instead.
+//
+// An interval where f changes sign or turns around may hide more than one
+// root, so it is sampled again more finely, SPLITS to a level, MAX_DEPTH
+// levels deep. In the smallest intervals a turn with no sign change is
+// followed to its turning point, which finds a double root or a pair of
+// roots however close together they are. Three or more roots in one of
+// the smallest intervals can still be missed.
+class RootFinder {
+public:
+    // vars holds every name the program reads, unknown among them; the
+    // others are constants.
+    RootFinder(const CompiledExpression& program, std::vector<Dual> vars, int unknown)
+        : program(program), vars(std::move(vars)), unknown(unknown) {}
+
+    std::vector<double> findRoots(double lo, double hi, int intervals) {
+        std::vector<double> roots;
+        double h = (hi - lo) / intervals;
+        Sample s0 = sample(lo);
+        for (int i = 1; i <= intervals; i++) {
+            Sample s1 = sample(i == intervals ? hi : lo + i * h);
+            scan(s0, s1, 0, roots);
+            s0 = s1;
+        }
+        if (s0.ok && s0.f == 0)
+            roots.push_back(s0.x);
+
+        std::sort(roots.begin(), roots.end());
+        std::vector<double> unique;
+        for (double r : roots) {
+            if (unique.empty() || std::abs(r - unique.back()) > 1e-9 * std::max(1.0, std::abs(r)))
+                unique.push_back(r);
+        }
+        return unique;
+    }
+
+private:
+    static const int SPLITS = 4;
+    static const int MAX_DEPTH = 2;
+
+    struct Sample {
+        double x = 0, f = 0, d = 0;
+        bool ok = false;
+    };
+
+    Sample sample(double x) {
+        Sample s;
+        s.x = x;
+        s.ok = evaluate(x, s.f, s.d);
+        return s;
+    }
+
+    // Looks for roots in [a.x, b.x), b.x being the next interval's. Exact
+    // zeros at the samples are recorded where the samples are taken.
+    void scan(const Sample& a, const Sample& b, int depth, std::vector<double>& roots) {
+        if (a.ok && a.f == 0 && depth == 0)
+            roots.push_back(a.x);
+        if (!a.ok || !b.ok)
+            return;
+        bool signChange = a.f != 0 && b.f != 0 && (a.f < 0) != (b.f < 0);
+        bool turns = a.d != 0 && b.d != 0 && (a.d < 0) != (b.d < 0);
+        if (!signChange && !turns)
+            return;
+
+        if (depth < MAX_DEPTH) {
+            Sample prev = a;
+            for (int i = 1; i <= SPLITS; i++) {
+                Sample next = i == SPLITS ? b : sample(a.x + (b.x - a.x) * i / SPLITS);
+                if (next.ok && next.f == 0 && i < SPLITS)
+                    roots.push_back(next.x);
+                scan(prev, next, depth + 1, roots);
+                prev = next;
+            }
+            return;
+        }
+
+        double scale = std::abs(a.f) + std::abs(b.f);
+        if (signChange) {
+            addRoot(refine(a.x, b.x, a.f), scale, roots);
+            return;
+        }
+        // No sign change, but f turns around: it either touches zero there,
+        // a root of even multiplicity, or crosses zero and comes back.
+        Sample turn = sample(criticalPoint(a.x, b.x, a.d));
+        if (!turn.ok)
+            return;
+        if (turn.f != 0 && (turn.f < 0) != (a.f < 0)) {
+            addRoot(refine(a.x, turn.x, a.f), scale, roots);
+            addRoot(refine(turn.x, b.x, turn.f), scale, roots);
+        } else {
+            addRoot(turn.x, scale, roots);
+        }
+    }
+
+    void addRoot(double x, double scale, std::vector<double>& roots) {
+        if (isRoot(x, scale))
+            roots.push_back(x);
+    }
+
+    bool evaluate(double x, double& f, double& d) {
+        vars[unknown] = Dual{x, 1};
+        Dual result;
+        if (runProgramAs(program, vars.data(), result) != EVAL_OK || !std::isfinite(result.value))
+            return false;
+        f = result.value;
+        d = result.derivative;
+        return true;
+    }
+
+    bool isRoot(double x, double scale) {
+        double f = 0, d = 0;
+        return evaluate(x, f, d) && std::abs(f) <= 1e-9 * (1 + scale);
+    }
+
+    double refine(double a, double b, double fa) {
+        double x = 0.5 * (a + b);
+        for (int i = 0; i < 100; i++) {
+            double fx = 0, dx = 0;
+            if (!evaluate(x, fx, dx) || fx == 0)
+                return x;
+            if ((fx < 0) == (fa < 0))
+                a = x;
+            else
+                b = x;
+            double next = dx != 0 ? x - fx / dx : 0.5 * (a + b);
+            if (!(next > std::min(a, b) && next < std::max(a, b)))
+                next = 0.5 * (a + b);
+            if (std::abs(next - x) <= 4 * DBL_EPSILON * std::max(1.0, std::abs(x)))
+                return next;
+            x = next;
+        }
+        return x;
+    }
+
+    // Bisects on the sign of f' to find where f turns around.
+    double criticalPoint(double a, double b, double da) {
+        for (int i = 0; i < 200 && std::abs(b - a) > 4 * DBL_EPSILON * std::max(1.0, std::abs(a)); i++) {
+            double m = 0.5 * (a + b);
+            double fm = 0, dm = 0;
+            if (!evaluate(m, fm, dm))
+                break;
+            if (dm == 0)
+                return m;
+            if ((dm < 0) == (da < 0))
+                a = m;
+            else
+                b = m;
+        }
+        return 0.5 * (a + b);
+    }
+
+    const CompiledExpression& program;
+    std::vector<Dual> vars;
+    int unknown;
+};
+
+// Solves for the one unknown, in the sense of isEquationConstant().
+std::string solveNonlinearEquation(const std::string& lhs, const std::string& rhs, double lo, double hi) {
+    UnknownTable unknowns;
+    CompiledExpression program;
+    compileExpression("(" + lhs + ")-(" + rhs + ")", program,
+                      [&](std::string_view name) { return unknowns.intern(name); });
+
+    std::vector<Dual> vars(unknowns.size());
+    int unknown = -1;
+    for (size_t i = 0; i < unknowns.size(); i++) {
+        if (isEquationConstant(unknowns.names[i], unknowns.size())) {
+            vars[i] = Dual{activeVariables->values[activeVariables->find(unknowns.names[i])], 0};
+        } else if (unknown < 0) {
+            unknown = static_cast<int>(i);
+        } else {
+            unknown = -1;
+            break;
+        }
+    }
+    if (unknown < 0)
+        throw std::runtime_error("Nonlinear equations can only be solved for one unknown!");
+
+    const int INTERVALS = 2000;
+    RootFinder finder(program, std::move(vars), unknown);
+    std::vector<double> roots = finder.findRoots(lo, hi, INTERVALS);
+
+    std::ostringstream out;
+    if (roots.empty()) {
+        out << "No solution found in [" << lo << ", " << hi << "].";
+        return out.str();
+    }
+    for (size_t i = 0; i < roots.size(); i++) {
+        // Sampling and bisection land within rounding of zero, not on it.
+        double root = std::abs(roots[i]) < 1e-12 * (hi - lo) ? 0.0 : roots[i];
+        out << (i ? ", " : "") << unknowns.names[unknown] << " = " << root;
+    }
+    return out.str();
+}
+
+// Where a trailing "in [lo, hi]" starts in an equation, or npos if the line
+// has none.
+size_t intervalSuffix(std::string_view line) {
+    size_t open = line.rfind('[');
+    std::string_view trimmed = trimView(line);
+    if (open == std::string_view::npos || trimmed.empty() || trimmed.back() != ']')
+        return std::string_view::npos;
+    std::string_view before = trimView(line.substr(0, open));
+    if (before.size() > 2 && before.substr(before.size() - 2) == "in" &&
+        isspace(static_cast<unsigned char>(before[before.size() - 3])))
+        return static_cast<size_t>(before.data() - line.data()) + before.size() - 2;
+    return std::string_view::npos;
+}
+
+// Solves an equation or system, optionally followed by "in [lo, hi]", the
+// interval searched when the equation is not linear (default [-100, 100]).
+std::string solveEquation(const std::string& line) {
+    CALC_STAT_STAGE(STAGE_SOLVE);
+    std::string equation = line;
+    double lo = -100, hi = 100;
+
+    size_t suffix = intervalSuffix(equation);
+    if (suffix != std::string::npos) {
+        size_t open = equation.rfind('[');
+        std::string range = equation.substr(open + 1, equation.rfind(']') - open - 1);
+        size_t comma = range.find(',');
+        if (comma == std::string::npos)
+            throw std::runtime_error("Usage: EQUATION in [lo, hi]");
+        lo = evaluateProgram(compileExpression(range.substr(0, comma)));
+        hi = evaluateProgram(compileExpression(range.substr(comma + 1)));
+        if (!(lo < hi))
+            throw std::runtime_error("Empty interval!");
+        equation.resize(suffix);
+    }
+
+    try {
+        return solveLinearEquation(equation);
+    } catch (const NonlinearEquation&) {
+        CALC_STAT_ADD(exceptions, 1);
+        size_t eqPos = equation.find('=');
+        if (equation.find(';') != std::string::npos)
+            throw std::runtime_error("Nonlinear systems are not supported!");
+        return solveNonlinearEquation(equation.substr(0, eqPos), equation.substr(eqPos + 1), lo, hi);
+    }
+}
+
+// Arbitrary precision, for the "precision N" mode. A BigFloat is a decimal
+// floating point number: (-1)^negative * limbs * BIG_BASE^exponent, with the
+// limbs in base 10^9, least significant first. Decimal limbs keep literals
+// exact and make printing a matter of padding each limb to nine digits.
+//
+// Operations take a precision in limbs and round their result to it; a
+// precision of 0 means exact, which integer-only algorithms such as binary
+// splitting use. Multiplication switches from schoolbook to Karatsuba to a
+// three-prime number-theoretic transform as operands grow. Division and
+// square roots are Newton iterations built on multiplication.
+const uint32_t BIG_BASE = 1000000000;
+const int BIG_DIGITS = 9;
+
+using Limbs = std::vector<uint32_t>;
+
+struct BigFloat {
+    bool negative = false;
+    Limbs limbs;            // empty for zero; the most significant limb is never 0
+    int64_t exponent = 0;   // in limbs
+
+    bool isZero() const { return limbs.empty(); }
+    // Position just above the most significant limb.
+    int64_t top() const { return exponent + static_cast<int64_t>(limbs.size()); }
+};
+
+void trimHigh(Limbs& a) {
+    while (!a.empty() && a.back() == 0)
+        a.pop_back();
+}
+
+int compareLimbs(const Limbs& a, const Limbs& b) {
+    if (a.size() != b.size())
+        return a.size() < b.size() ? -1 : 1;
+    for (size_t i = a.size(); i-- > 0;) {
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+// a += b
+void addLimbs(Limbs& a, const Limbs& b) {
+    if (a.size() < b.size())
+        a.resize(b.size(), 0);
+    uint32_t carry = 0;
+    for (size_t i = 0; i < a.size() && (i < b.size() || carry); i++) {
+        uint32_t sum = a[i] + carry + (i < b.size() ? b[i] : 0);
+        carry = sum >= BIG_BASE;
+        a[i] = carry ? sum - BIG_BASE : sum;
+    }
+    if (carry)
+        a.push_back(1);
+}
+
+// a -= b, where a >= b
+void subLimbs(Limbs& a, const Limbs& b) {
+    int64_t borrow = 0;
+    for (size_t i = 0; i < a.size() && (i < b.size() || borrow); i++) {
+        int64_t diff = static_cast<int64_t>(a[i]) - borrow - (i < b.size() ? b[i] : 0);
+        borrow = diff < 0;
+        a[i] = static_cast<uint32_t>(borrow ? diff + BIG_BASE : diff);
+    }
+    trimHigh(a);
+}
+
+// a += b * BIG_BASE^shift
+void addShifted(Limbs& a, const Limbs& b, size_t shift) {
+    if (b.empty())
+        return;
+    if (a.size() < b.size() + shift)
+        a.resize(b.size() + shift, 0);
+    uint32_t carry = 0;
+    for (size_t i = shift; i < a.size() && (i - shift < b.size() || carry); i++) {
+        uint32_t sum = a[i] + carry + (i - shift < b.size() ? b[i - shift] : 0);
+        carry = sum >= BIG_BASE;
+        a[i] = carry ? sum - BIG_BASE : sum;
+    }
+    if (carry)
+        a.push_back(1);
+}
+
+Limbs multiplySchoolbook(const uint32_t* a, size_t n, const uint32_t* b, size_t m) {
+    Limbs out(n + m, 0);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t carry = 0;
+        uint64_t ai = a[i];
+        for (size_t j = 0; j < m; j++) {
+            uint64_t t = out[i + j] + ai * b[j] + carry;
+            out[i + j] = static_cast<uint32_t>(t % BIG_BASE);
+            carry = t / BIG_BASE;
+        }
+        out[i + m] = static_cast<uint32_t>(carry);
+    }
+    trimHigh(out);
+    return out;
+}
+
+template <uint32_t MOD>
+uint32_t powMod(uint64_t base, uint64_t e) {
+    uint64_t result = 1;
+    base %= MOD;
+    for (; e; e >>= 1) {
+        if (e & 1)
+            result = result * base % MOD;
+        base = base * base % MOD;
+    }
+    return static_cast<uint32_t>(result);
+}
+
+// Roots of unity for transforms of up to n points modulo MOD: the entries
+// [h, 2h) hold w^j for the primitive 2h-th root w (or its inverse), each with
+// Shoup's precomputed quotient floor(w^j 2^32 / MOD), which turns a modular
+// product into two 32-bit multiplies and a correction. Built once per thread
+// and grown on demand.
+template <uint32_t MOD, uint32_t ROOT>
+struct NttTwiddles {
+    std::vector<uint32_t> roots[2], quotients[2];
+
+    void reserve(size_t n) {
+        if (roots[0].size() >= n)
+            return;
+        for (int inverse = 0; inverse < 2; inverse++) {
+            roots[inverse].assign(n, 0);
+            quotients[inverse].assign(n, 0);
+            for (size_t half = 1; half < n; half <<= 1) {
+                uint64_t w = powMod<MOD>(ROOT, (MOD - 1) / (2 * half));
+                if (inverse)
+                    w = powMod<MOD>(w, MOD - 2);
+                uint64_t x = 1;
+                for (size_t j = 0; j < half; j++, x = x * w % MOD) {
+                    roots[inverse][half + j] = static_cast<uint32_t>(x);
+                    quotients[inverse][half + j] = static_cast<uint32_t>((x << 32) / MOD);
+                }
+            }
+        }
+    }
+};
+
+// x * w mod MOD, given q = floor(w 2^32 / MOD) and MOD < 2^31.
+template <uint32_t MOD>
+inline uint32_t mulShoup(uint32_t x, uint32_t w, uint32_t q) {
+    uint32_t estimate = static_cast<uint32_t>((static_cast<uint64_t>(x) * q) >> 32);
+    uint32_t r = x * w - estimate * MOD;  // in [0, 2 MOD)
+    return r >= MOD ? r - MOD : r;
+}
+
+// Forward transform, decimation in frequency: natural order in, bit-reversed
+// order out. The inverse below takes bit-reversed input, so pointwise products
+// never need the reordering pass.
+template <uint32_t MOD, uint32_t ROOT>
+void nttForward(std::vector<uint32_t>& a, const NttTwiddles<MOD, ROOT>& t) {
+    size_t n = a.size();
+    for (size_t half = n / 2; half >= 1; half >>= 1) {
+        const uint32_t* w = t.roots[0].data() + half;
+        const uint32_t* q = t.quotients[0].data() + half;
+        for (size_t i = 0; i < n; i += 2 * half) {
+            uint32_t* lo = a.data() + i;
+            uint32_t* hi = lo + half;
+            for (size_t j = 0; j < half; j++) {
+                uint32_t u = lo[j], v = hi[j];
+                lo[j] = u + v >= MOD ? u + v - MOD : u + v;
+                hi[j] = mulShoup<MOD>(u >= v ? u - v : u + MOD - v, w[j], q[j]);
+            }
+        }
+    }
+}
+
+// Inverse transform, decimation in time, including the division by n.
+template <uint32_t MOD, uint32_t ROOT>
+void nttInverse(std::vector<uint32_t>& a, const NttTwiddles<MOD, ROOT>& t) {
+    size_t n = a.size();
+    for (size_t half = 1; half < n; half <<= 1) {
+        const uint32_t* w = t.roots[1].data() + half;
+        const uint32_t* q = t.quotients[1].data() + half;
+        for (size_t i = 0; i < n; i += 2 * half) {
+            uint32_t* lo = a.data() + i;
+            uint32_t* hi = lo + half;
+            for (size_t j = 0; j < half; j++) {
+                uint32_t u = lo[j];
+                uint32_t v = mulShoup<MOD>(hi[j], w[j], q[j]);
+                lo[j] = u + v >= MOD ? u + v - MOD : u + v;
+                hi[j] = u >= v ? u - v : u + MOD - v;
+            }
+        }
+    }
+    uint32_t nInverse = powMod<MOD>(n, MOD - 2);
+    uint32_t q = static_cast<uint32_t>((static_cast<uint64_t>(nInverse) << 32) / MOD);
+    for (auto& x : a)
+        x = mulShoup<MOD>(x, nInverse, q);
+}
+
+// Cyclic convolution of a and b modulo MOD, padded to length n.
+template <uint32_t MOD, uint32_t ROOT>
+std::vector<uint32_t> convolveMod(const Limbs& a, const Limbs& b, size_t n) {
+    thread_local NttTwiddles<MOD, ROOT> twiddles;
+    twiddles.reserve(n);
+    std::vector<uint32_t> fa(n, 0);
+    for (size_t i = 0; i < a.size(); i++)
+        fa[i] = a[i] % MOD;
+    nttForward(fa, twiddles);
+    if (&a == &b) {
+        for (auto& x : fa)
+            x = static_cast<uint32_t>(static_cast<uint64_t>(x) * x % MOD);
+    } else {
+        std::vector<uint32_t> fb(n, 0);
+        for (size_t i = 0; i < b.size(); i++)
+            fb[i] = b[i] % MOD;
+        nttForward(fb, twiddles);
+        for (size_t i = 0; i < n; i++)
+            fa[i] = static_cast<uint32_t>(static_cast<uint64_t>(fa[i]) * fb[i] % MOD);
+    }
+    nttInverse(fa, twiddles);
+    return fa;
+}
+
+// Longest transform: 998244353 - 1 = 119 * 2^23 has no larger power of two.
+const size_t MAX_NTT_LENGTH = size_t(1) << 23;
+
+// The most significant digits `precision` accepts. Two operands of this many
+// digits, plus the guard limbs the functions work with, still fit one
+// transform, so every product at the highest precision is exact.
+const size_t MAX_PRECISION_DIGITS = 32000000;
+static_assert(2 * (MAX_PRECISION_DIGITS / BIG_DIGITS + 256) <= MAX_NTT_LENGTH,
+              "the highest precision must fit in one transform");
+
+// Product through three transforms whose moduli multiply to about 7.9e25.
+// That exceeds every coefficient (at most min(n, m) * 10^18) while
+// min(n, m) < 7.8e7, so the Chinese remainder theorem recovers each
+// coefficient exactly. Longer products than MAX_NTT_LENGTH limbs are
+// rejected.
+Limbs multiplyNtt(const Limbs& a, const Limbs& b) {
+    const uint32_t P1 = 998244353, P2 = 167772161, P3 = 469762049;
+    size_t need = a.size() + b.size();
+    size_t n = 1;
+    while (n < need)
+        n <<= 1;
+    if (n > MAX_NTT_LENGTH)
+        throw std::runtime_error("Numbers too large to multiply!");
+
+    std::vector<uint32_t> r1 = convolveMod<P1, 3>(a, b, n);
+    std::vector<uint32_t> r2 = convolveMod<P2, 3>(a, b, n);
+    std::vector<uint32_t> r3 = convolveMod<P3, 3>(a, b, n);
+
+    const uint64_t inv1 = powMod<P2>(P1, P2 - 2);                          // P1^-1 mod P2
+    const uint64_t inv12 = powMod<P3>(static_cast<uint64_t>(P1) * P2 % P3, P3 - 2);  // (P1 P2)^-1 mod P3
+    // P1 P2 = p12High * BIG_BASE + p12Low, so that the carry stays in 64 bits:
+    // the p12High part of each coefficient belongs to the next limb.
+    const uint64_t p12 = static_cast<uint64_t>(P1) * P2;
+    const uint64_t p12High = p12 / BIG_BASE, p12Low = p12 % BIG_BASE;
+
+    Limbs out(need, 0);
+    uint64_t carry = 0;
+    for (size_t i = 0; i < need; i++) {
+        uint64_t x1 = r1[i];
+        uint64_t k1 = (r2[i] + P2 - x1 % P2) % P2 * inv1 % P2;
+        uint64_t x12 = x1 + k1 * P1;  // value mod P1 P2, < 1.7e17
+        uint64_t k2 = (r3[i] + P3 - x12 % P3) % P3 * inv12 % P3;
+        uint64_t t = x12 + k2 * p12Low + carry;
+        out[i] = static_cast<uint32_t>(t % BIG_BASE);
+        carry = t / BIG_BASE + k2 * p12High;
+    }
+    trimHigh(out);
+    return out;
+}
+
+Limbs multiplyLimbs(const Limbs& a, const Limbs& b);
+
+Limbs sliceLimbs(const Limbs& a, size_t from, size_t to) {
+    to = std::min(to, a.size());
+    if (from >= to)
+        return {};
+    Limbs out(a.begin() + from, a.begin() + to);
+    trimHigh(out);
+    return out;
+}
+
+Limbs multiplyKaratsuba(const Limbs& a, const Limbs& b) {
+    const Limbs& longer = a.size() >= b.size() ? a : b;
+    const Limbs& shorter = a.size() >= b.size() ? b : a;
+    size_t half = (longer.size() + 1) / 2;
+
+    // Very unbalanced operands: multiply the shorter one by pieces of the longer one.
+    if (shorter.size() <= half) {
+        Limbs out;
+        for (size_t from = 0; from < longer.size(); from += shorter.size())
+            addShifted(out, multiplyLimbs(sliceLimbs(longer, from, from + shorter.size()), shorter), from);
+        trimHigh(out);
+        return out;
+    }
+
+    Limbs a0 = sliceLimbs(longer, 0, half), a1 = sliceLimbs(longer, half, longer.size());
+    Limbs b0 = sliceLimbs(shorter, 0, half), b1 = sliceLimbs(shorter, half, shorter.size());
+    Limbs z0 = multiplyLimbs(a0, b0);
+    Limbs z2 = multiplyLimbs(a1, b1);
+    addLimbs(a0, a1);
+    addLimbs(b0, b1);
+    Limbs z1 = multiplyLimbs(a0, b0);
+    subLimbs(z1, z0);
+    subLimbs(z1, z2);
+
+    Limbs out = z0;
+    addShifted(out, z1, half);
+    addShifted(out, z2, 2 * half);
+    trimHigh(out);
+    return out;
+}
+
+Limbs multiplyLimbs(const Limbs& a, const Limbs& b) {
+    const size_t KARATSUBA_THRESHOLD = 48;
+    const size_t NTT_THRESHOLD = 400;
+    if (a.empty() || b.empty())
+        return {};
+    size_t shorter = std::min(a.size(), b.size());
+    if (shorter < KARATSUBA_THRESHOLD)
+        return multiplySchoolbook(a.data(), a.size(), b.data(), b.size());
+    if (shorter >= NTT_THRESHOLD)
+        return multiplyNtt(a, b);
+    return multiplyKaratsuba(a, b);
+}
+
+// Drops leading and trailing zero limbs; zero has no sign.
+void normalize(BigFloat& x) {
+    trimHigh(x.limbs);
+    size_t low = 0;
+    while (low < x.limbs.size() && x.limbs[low] == 0)
+        low++;
+    if (low) {
+        x.limbs.erase(x.limbs.begin(), x.limbs.begin() + low);
+        x.exponent += static_cast<int64_t>(low);
+    }
+    if (x.limbs.empty()) {
+        x.negative = false;
+        x.exponent = 0;
+    }
+}
+
+// Rounds x to at most precision limbs, half up; 0 keeps it exact.
+void roundTo(BigFloat& x, size_t precision) {
+    if (!precision || x.limbs.size() <= precision)
+        return;
+    size_t drop = x.limbs.size() - precision;
+    bool up = x.limbs[drop - 1] >= BIG_BASE / 2;
+    x.limbs.erase(x.limbs.begin(), x.limbs.begin() + drop);
+    x.exponent += static_cast<int64_t>(drop);
+    if (up)
+        addLimbs(x.limbs, Limbs{1});
+    normalize(x);
+}
+
+BigFloat bigFromInteger(uint64_t value, bool negative = false) {
+    BigFloat x;
+    for (; value; value /= BIG_BASE)
+        x.limbs.push_back(static_cast<uint32_t>(value % BIG_BASE));
+    x.negative = negative && !x.limbs.empty();
+    return x;
+}
+
+BigFloat bigAdd(const BigFloat& a, const BigFloat& b, size_t precision, bool subtract = false) {
+    bool bNegative = b.negative != subtract;
+    if (b.isZero()) {
+        BigFloat r = a;
+        roundTo(r, precision);
+        return r;
+    }
+    if (a.isZero()) {
+        BigFloat r = b;
+        r.negative = bNegative;
+        roundTo(r, precision);
+        return r;
+    }
+
+    // Limbs far below the precision of the result cannot affect it.
+    int64_t low = std::min(a.exponent, b.exponent);
+    if (precision)
+        low = std::max(low, std::max(a.top(), b.top()) - static_cast<int64_t>(precision) - 2);
+    auto aligned = [&](const BigFloat& x) {
+        Limbs out;
+        int64_t shift = x.exponent - low;
+        if (shift >= 0) {
+            out.assign(static_cast<size_t>(shift), 0);
+            out.insert(out.end(), x.limbs.begin(), x.limbs.end());
+        } else if (-shift < static_cast<int64_t>(x.limbs.size())) {
+            out.assign(x.limbs.begin() - shift, x.limbs.end());
+        }
+        return out;
+    };
+
+    BigFloat r;
+    r.exponent = low;
+    Limbs x = aligned(a), y = aligned(b);
+    if (a.negative == bNegative) {
+        addLimbs(x, y);
+        r.limbs = std::move(x);
+        r.negative = a.negative;
+    } else if (compareLimbs(x, y) >= 0) {
+        subLimbs(x, y);
+        r.limbs = std::move(x);
+        r.negative = a.negative;
+    } else {
+        subLimbs(y, x);
+        r.limbs = std::move(y);
+        r.negative = bNegative;
+    }
+    normalize(r);
+    roundTo(r, precision);
+    return r;
+}
+
+BigFloat bigSub(const BigFloat& a, const BigFloat& b, size_t precision) {
+    return bigAdd(a, b, precision, true);
+}
+
+BigFloat bigMul(const BigFloat& a, const BigFloat& b, size_t precision) {
+    BigFloat r;
+    if (a.isZero() || b.isZero())
+        return r;
+    r.limbs = &a == &b ? multiplyLimbs(a.limbs, a.limbs) : multiplyLimbs(a.limbs, b.limbs);
+    r.exponent = a.exponent + b.exponent;
+    r.negative = a.negative != b.negative;
+    normalize(r);
+    roundTo(r, precision);
+    return r;
+}
+
+BigFloat bigMulSmall(const BigFloat& a, uint32_t m) {
+    BigFloat r = a;
+    uint64_t carry = 0;
+    for (auto& limb : r.limbs) {
+        uint64_t t = static_cast<uint64_t>(limb) * m + carry;
+        limb = static_cast<uint32_t>(t % BIG_BASE);
+        carry = t / BIG_BASE;
+    }
+    for (; carry; carry /= BIG_BASE)
+        r.limbs.push_back(static_cast<uint32_t>(carry % BIG_BASE));
+    normalize(r);
+    return r;
+}
+
+// a / d to precision limbs (which must be nonzero).
+BigFloat bigDivSmall(const BigFloat& a, uint32_t d, size_t precision) {
+    BigFloat r;
+    if (a.isZero())
+        return r;
+    size_t extra = a.limbs.size() < precision + 1 ? precision + 1 - a.limbs.size() : 0;
+    r.limbs.assign(a.limbs.size() + extra, 0);
+    r.exponent = a.exponent - static_cast<int64_t>(extra);
+    r.negative = a.negative;
+    uint64_t remainder = 0;
+    for (size_t i = a.limbs.size() + extra; i-- > 0;) {
+        uint64_t cur = remainder * BIG_BASE + (i >= extra ? a.limbs[i - extra] : 0);
+        r.limbs[i] = static_cast<uint32_t>(cur / d);
+        remainder = cur % d;
+    }
+    normalize(r);
+    roundTo(r, precision);
+    return r;
+}
+
+// x ~= mantissa * BIG_BASE^exponent, from the top limbs.
+double bigApproximate(const BigFloat& x, int64_t& exponent) {
+    double mantissa = 0;
+    size_t n = std::min<size_t>(3, x.limbs.size());
+    for (size_t i = 0; i < n; i++)
+        mantissa = mantissa * BIG_BASE + x.limbs[x.limbs.size() - 1 - i];
+    exponent = x.top() - static_cast<int64_t>(n);
+    return x.negative ? -mantissa : mantissa;
+}
+
+BigFloat bigFromDouble(double value);
+
+// Precisions for a Newton iteration that doubles its accuracy each step,
+// from a double-precision start up to the target.
+std::vector<size_t> newtonPrecisions(size_t precision) {
+    std::vector<size_t> steps;
+    for (size_t p = precision + 1; p > 2; p = p / 2 + 1)
+        steps.push_back(p);
+    std::reverse(steps.begin(), steps.end());
+    if (steps.empty())
+        steps.push_back(precision + 1);
+    return steps;
+}
+
+BigFloat bigReciprocal(const BigFloat& x, size_t precision) {
+    if (x.isZero())
+        throw std::runtime_error("Cannot divide by 0!");
+    int64_t exponent = 0;
+    double mantissa = bigApproximate(x, exponent);
+    BigFloat y = bigFromDouble(1 / mantissa);
+    y.exponent -= exponent;
+
+    const BigFloat one = bigFromInteger(1);
+    for (size_t p : newtonPrecisions(precision)) {
+        BigFloat xp = x;
+        roundTo(xp, p);
+        // y += y * (1 - x y)
+        BigFloat error = bigSub(one, bigMul(xp, y, p), p);
+        y = bigAdd(y, bigMul(y, error, p), p);
+    }
+    roundTo(y, precision);
+    return y;
+}
+
+BigFloat bigDiv(const BigFloat& a, const BigFloat& b, size_t precision) {
+    return bigMul(a, bigReciprocal(b, precision + 1), precision);
+}
+
+BigFloat bigSqrt(const BigFloat& x, size_t precision) {
+    if (x.negative)
+        throw std::runtime_error("Square root of a negative number!");
+    if (x.isZero())
+        return x;
+
+    // Start 1/sqrt(x) from doubles, with an even limb exponent so it halves exactly.
+    int64_t exponent = 0;
+    double mantissa = bigApproximate(x, exponent);
+    if (exponent % 2 != 0) {
+        mantissa *= BIG_BASE;
+        exponent--;
+    }
+    BigFloat y = bigFromDouble(1 / std::sqrt(mantissa));
+    y.exponent -= exponent / 2;
+
+    // y += y * (1 - x y^2) / 2
+    const BigFloat one = bigFromInteger(1);
+    for (size_t p : newtonPrecisions(precision)) {
+        BigFloat xp = x;
+        roundTo(xp, p);
+        BigFloat error = bigSub(one, bigMul(xp, bigMul(y, y, p), p), p);
+        y = bigAdd(y, bigDivSmall(bigMul(y, error, p), 2, p), p);
+    }
+    BigFloat root = bigMul(x, y, precision + 1);
+    roundTo(root, precision);
+    return root;
+}
+
+BigFloat bigFromDouble(double value) {
+    if (!std::isfinite(value))
+        throw std::runtime_error("Result is not a finite number!");
+    BigFloat x;
+    if (value == 0)
+        return x;
+    int binaryExponent = 0;
+    double fraction = std::frexp(std::abs(value), &binaryExponent);
+    uint64_t mantissa = static_cast<uint64_t>(std::ldexp(fraction, 53));
+    binaryExponent -= 53;
+    x = bigFromInteger(mantissa);
+    // value = mantissa * 2^e exactly; for e < 0 that is mantissa * 5^-e * 10^e.
+    for (int e = binaryExponent; e > 0; e -= std::min(e, 29))
+        x = bigMulSmall(x, 1u << std::min(e, 29));
+    if (binaryExponent < 0) {
+        int decimals = -binaryExponent;
+        for (int e = decimals; e > 0; e -= std::min(e, 13))
+            x = bigMulSmall(x, static_cast<uint32_t>(std::pow(5, std::min(e, 13))));
+        // Divide by 10^decimals: shift whole limbs, then scale by the remaining power of ten.
+        int64_t limbShift = (decimals + BIG_DIGITS - 1) / BIG_DIGITS;
+        x = bigMulSmall(x, static_cast<uint32_t>(std::pow(10, limbShift * BIG_DIGITS - decimals)));
+        x.exponent -= limbShift;
+    }
+    x.negative = value < 0;
+    normalize(x);
+    return x;
+}
+
+// Parses a decimal literal ("12", "1.5", ".5", "2e-3") exactly.
+BigFloat bigFromDecimal(std::string_view text) {
+    std::string digits;
+    int64_t decimalExponent = 0;
+    size_t i = 0;
+    bool seenPoint = false;
+    for (; i < text.size(); i++) {
+        if (isdigit(static_cast<unsigned char>(text[i]))) {
+            digits += text[i];
+            if (seenPoint)
+                decimalExponent--;
+        } else if (text[i] == '.' && !seenPoint) {
+            seenPoint = true;
+        } else {
+            break;
+        }
+    }
+    if (i < text.size() && (text[i] == 'e' || text[i] == 'E')) {
+        int64_t value = 0;
+        auto res = std::from_chars(text.data() + i + 1 + (text[i + 1] == '+'), text.data() + text.size(), value);
+        if (res.ec != std::errc())
+            throw std::out_of_range("Number too large");
+        decimalExponent += value;
+    }
+
+    // Pad so the decimal exponent becomes a whole number of limbs.
+    int64_t limbExponent = decimalExponent >= 0 ? decimalExponent / BIG_DIGITS
+                                                : -((-decimalExponent + BIG_DIGITS - 1) / BIG_DIGITS);
+    digits.append(static_cast<size_t>(decimalExponent - limbExponent * BIG_DIGITS), '0');
+
+    BigFloat x;
+    x.exponent = limbExponent;
+    for (size_t end = digits.size(); end > 0;) {
+        size_t begin = end >= static_cast<size_t>(BIG_DIGITS) ? end - BIG_DIGITS : 0;
+        uint32_t limb = 0;
+        for (size_t k = begin; k < end; k++)
+            limb = limb * 10 + static_cast<uint32_t>(digits[k] - '0');
+        x.limbs.push_back(limb);
+        end = begin;
+    }
+    normalize(x);
+    return x;
+}
+
+// Formats x with up to `digits` significant digits, like %g: plain notation
+// unless the decimal exponent is below -4 or at least `digits`.
+std::string bigToString(const BigFloat& x, size_t digits) {
+    if (x.isZero())
+        return "0";
+
+    std::string mantissa = std::to_string(x.limbs.back());
+    char limb[16];
+    for (size_t i = x.limbs.size() - 1; i-- > 0;) {
+        snprintf(limb, sizeof(limb), "%09u", x.limbs[i]);
+        mantissa += limb;
+    }
+    // value = 0.mantissa * 10^decimalExponent, i.e. d.ddd * 10^(decimalExponent - 1)
+    int64_t decimalExponent = static_cast<int64_t>(mantissa.size()) + x.exponent * BIG_DIGITS;
+
+    if (mantissa.size() > digits) {
+        bool up = mantissa[digits] >= '5';
+        mantissa.resize(digits);
+        for (size_t i = digits; up && i-- > 0;) {
+            if (mantissa[i] == '9') {
+                mantissa[i] = '0';
+            } else {
+                mantissa[i]++;
+                up = false;
+            }
+        }
+        if (up) {
+            mantissa.insert(mantissa.begin(), '1');
+            mantissa.pop_back();
+            decimalExponent++;
+        }
+    }
+    while (mantissa.size() > 1 && mantissa.back() == '0')
+        mantissa.pop_back();
+
+    std::string out = x.negative ? "-" : "";
+    int64_t scientific = decimalExponent - 1;
+    if (scientific < -4 || scientific >= static_cast<int64_t>(digits)) {
+        out += mantissa[0];
+        if (mantissa.size() > 1)
+            out += "." + mantissa.substr(1);
+        out += scientific < 0 ? "e-" : "e+";
+        std::string power = std::to_string(std::abs(scientific));
+        if (power.size() < 2)
+            out += '0';
+        out += power;
+    } else if (decimalExponent <= 0) {
+        out += "0." + std::string(static_cast<size_t>(-decimalExponent), '0') + mantissa;
+    } else if (static_cast<size_t>(decimalExponent) >= mantissa.size()) {
+        out += mantissa + std::string(static_cast<size_t>(decimalExponent) - mantissa.size(), '0');
+    } else {
+        out += mantissa.substr(0, static_cast<size_t>(decimalExponent)) + "." +
+               mantissa.substr(static_cast<size_t>(decimalExponent));
+    }
+    return out;
+}
+
+double bigToDouble(const BigFloat& x) {
+    return std::strtod(bigToString(x, 17).c_str(), nullptr);
+}
+
+// True when x has no fractional limbs.
+bool bigIsInteger(const BigFloat& x) {
+    return x.exponent >= 0;
+}
+
+// Constants at the highest precision asked for so far; lower precisions are
+// rounded from it.
+struct BigConstant {
+    BigFloat value;
+    size_t precision = 0;
+};
+
+// Chudnovsky series by binary splitting over terms [a, b): exact P, Q, T.
+void chudnovskySplit(uint64_t a, uint64_t b, BigFloat& P, BigFloat& Q, BigFloat& T) {
+    if (b - a == 1) {
+        if (a == 0) {
+            P = Q = bigFromInteger(1);
+        } else {
+            P = bigMulSmall(bigFromInteger((6 * a - 5) * (2 * a - 1)), static_cast<uint32_t>(6 * a - 1));
+            Q = bigMul(bigMulSmall(bigFromInteger(a * a), static_cast<uint32_t>(a)),
+                       bigFromInteger(10939058860032000ULL), 0);  // 640320^3 / 24
+        }
+        T = bigMul(P, bigFromInteger(13591409 + 545140134 * a), 0);
+        T.negative = (a & 1) && !T.isZero();
+        return;
+    }
+    uint64_t m = (a + b) / 2;
+    BigFloat P2, Q2, T2;
+    chudnovskySplit(a, m, P, Q, T);
+    chudnovskySplit(m, b, P2, Q2, T2);
+    T = bigAdd(bigMul(Q2, T, 0), bigMul(P, T2, 0), 0);
+    P = bigMul(P, P2, 0);
+    Q = bigMul(Q, Q2, 0);
+}
+
+BigFloat bigPi(size_t precision) {
+    thread_local BigConstant cache;
+    if (cache.precision < precision) {
+        // Each term adds about 14.18 digits.
+        uint64_t terms = static_cast<uint64_t>(precision * BIG_DIGITS / 14.18) + 2;
+        BigFloat P, Q, T;
+        chudnovskySplit(0, terms, P, Q, T);
+        size_t p = precision + 1;
+        roundTo(Q, p);
+        roundTo(T, p);
+        BigFloat numerator = bigMul(bigMulSmall(Q, 426880), bigSqrt(bigFromInteger(10005), p), p);
+        cache.value = bigDiv(numerator, T, p);
+        cache.precision = precision;
+    }
+    BigFloat pi = cache.value;
+    roundTo(pi, precision);
+    return pi;
+}
+
+// Binary splitting of the series sum_j prod_{i=1..j} y / q(i) over terms
+// [a, b): P = y^(b-a), Q = prod q(i) and T = Q * (partial sum). Products are
+// exact while short, and rounded to precision limbs once they grow past it;
+// every term is positive or alternates with shrinking size, so rounding them
+// relative to their own size only costs the last limb. P of the last range is
+// never used, so it is skipped down the right edge (needP false).
+void ratioSeriesSplit(const BigFloat& y, uint64_t (*q)(uint64_t), uint64_t a, uint64_t b,
+                      size_t precision, bool needP, BigFloat& P, BigFloat& Q, BigFloat& T) {
+    if (b - a == 1) {
+        if (a == 0) {
+            P = Q = T = bigFromInteger(1);
+        } else {
+            P = T = y;
+            Q = bigFromInteger(q(a));
+        }
+        return;
+    }
+    uint64_t m = (a + b) / 2;
+    BigFloat P2, Q2, T2;
+    ratioSeriesSplit(y, q, a, m, precision, true, P, Q, T);
+    ratioSeriesSplit(y, q, m, b, precision, needP, P2, Q2, T2);
+    T = bigAdd(bigMul(T, Q2, precision), bigMul(P, T2, precision), precision);
+    P = needP ? bigMul(P, P2, precision) : BigFloat();
+    Q = bigMul(Q, Q2, precision);
+}
+
+// Sum of the series to precision limbs, taking terms until they fall below it.
+BigFloat ratioSeries(const BigFloat& y, uint64_t (*q)(uint64_t), size_t precision) {
+    if (y.isZero())
+        return bigFromInteger(1);
+    int64_t exponent = 0;
+    double logY = std::log10(std::abs(bigApproximate(y, exponent))) + exponent * BIG_DIGITS;
+    double target = -(precision + 1.0) * BIG_DIGITS;
+    uint64_t terms = 1;
+    for (double logTerm = 0; logTerm > target; terms++)
+        logTerm += logY - std::log10(static_cast<double>(q(terms)));
+
+    BigFloat P, Q, T;
+    ratioSeriesSplit(y, q, 0, terms, precision + 2, false, P, Q, T);
+    return bigDiv(T, Q, precision);
+}
+
+uint64_t factorialStep(uint64_t j) { return j; }
+uint64_t cosineStep(uint64_t j) { return (2 * j - 1) * (2 * j); }
+uint64_t sineStep(uint64_t j) { return (2 * j) * (2 * j + 1); }
+
+BigFloat bigE(size_t precision) {
+    thread_local BigConstant cache;
+    if (cache.precision < precision) {
+        cache.value = ratioSeries(bigFromInteger(1), factorialStep, precision);
+        cache.precision = precision;
+    }
+    BigFloat e = cache.value;
+    roundTo(e, precision);
+    return e;
+}
+
+// Limbs needed to absorb n bits of lost accuracy.
+size_t guardLimbs(double bits) {
+    return static_cast<size_t>(bits * 0.30103 / BIG_DIGITS) + 1;
+}
+
+// Splits |x| < 1 into pieces of 1, 2, 4, ... limbs, most significant first,
+// dropping limbs below precision. A piece of n limbs is below BIG_BASE^(1-n),
+// so its series needs few terms while its terms stay short: the "bit-burst"
+// evaluation of exp and sin/cos, with every series summed by binary splitting.
+std::vector<BigFloat> splitFraction(const BigFloat& x, size_t precision) {
+    std::vector<BigFloat> pieces;
+    for (size_t i = x.limbs.size(); i-- > 0;) {
+        int64_t depth = -(x.exponent + static_cast<int64_t>(i));  // limb i is worth BIG_BASE^-depth
+        if (depth > static_cast<int64_t>(precision) + 1)
+            break;
+        size_t piece = 0;
+        while ((int64_t(2) << piece) <= depth)
+            piece++;
+        if (pieces.size() <= piece)
+            pieces.resize(piece + 1);
+        // Limbs arrive most significant first; each piece is reversed below.
+        pieces[piece].limbs.push_back(x.limbs[i]);
+        pieces[piece].exponent = -depth;
+        pieces[piece].negative = x.negative;
+    }
+    for (auto& p : pieces) {
+        std::reverse(p.limbs.begin(), p.limbs.end());
+        normalize(p);
+    }
+    return pieces;
+}
+
+BigFloat bigPow(const BigFloat& base, const BigFloat& power, size_t precision);
+
+BigFloat bigExp(const BigFloat& x, size_t precision) {
+    if (x.isZero())
+        return bigFromInteger(1);
+    if (x.top() > 1)
+        throw std::runtime_error("Number too large");
+
+    // exp(x) = e^n * exp(f), n the integer part of x: e^n by squaring, exp(f)
+    // as a product over the pieces of f.
+    BigFloat whole = x, fraction;
+    if (x.exponent < 0) {
+        size_t cut = std::min(static_cast<size_t>(-x.exponent), x.limbs.size());
+        whole.limbs.erase(whole.limbs.begin(), whole.limbs.begin() + cut);
+        whole.exponent = 0;
+        normalize(whole);
+        fraction = bigSub(x, whole, 0);
+    }
+    size_t p = precision + 1 + guardLimbs(std::log2(std::abs(bigToDouble(whole)) + 1) + 8);
+
+    BigFloat result = whole.isZero() ? bigFromInteger(1) : bigPow(bigE(p), whole, p);
+    for (const auto& piece : splitFraction(fraction, p)) {
+        if (!piece.isZero())
+            result = bigMul(result, ratioSeries(piece, factorialStep, p), p);
+    }
+    roundTo(result, precision);
+    return result;
+}
+
+// sin and cos of |z| < 1 by angle addition over the pieces of z.
+void bigSinCosSmall(const BigFloat& z, size_t precision, BigFloat& s, BigFloat& c) {
+    s = BigFloat();
+    c = bigFromInteger(1);
+    for (const auto& piece : splitFraction(z, precision)) {
+        if (piece.isZero())
+            continue;
+        BigFloat y = bigMul(piece, piece, 0);
+        y.negative = true;
+        BigFloat ps = bigMul(piece, ratioSeries(y, sineStep, precision), precision);
+        BigFloat pc = ratioSeries(y, cosineStep, precision);
+        BigFloat nextS = bigAdd(bigMul(s, pc, precision), bigMul(c, ps, precision), precision);
+        c = bigSub(bigMul(c, pc, precision), bigMul(s, ps, precision), precision);
+        s = std::move(nextS);
+    }
+}
+
+// sin(x) and cos(x), from x = k pi/2 + z with |z| <= pi/4 and the quadrant k.
+// Guard limbs cover the integer part of x, and a small z, so that results near
+// a zero keep their relative precision.
+void bigSinCos(const BigFloat& x, size_t precision, BigFloat& s, BigFloat& c) {
+    size_t p = precision + 1 + guardLimbs(std::max<int64_t>(0, x.top()) * BIG_DIGITS * 3.33);
+    BigFloat halfPi = bigDivSmall(bigPi(p), 2, p);
+
+    BigFloat k = bigAdd(bigDiv(x, halfPi, p), bigDivSmall(bigFromInteger(1, x.negative), 2, p), p);
+    if (k.exponent < 0) {
+        size_t cut = std::min(static_cast<size_t>(-k.exponent), k.limbs.size());
+        k.limbs.erase(k.limbs.begin(), k.limbs.begin() + cut);
+        k.exponent = 0;
+        normalize(k);
+    }
+    uint32_t quadrant = k.isZero() || k.exponent > 0 ? 0 : k.limbs[0] % 4;
+    if (k.negative)
+        quadrant = (4 - quadrant) % 4;
+
+    BigFloat z = bigSub(x, bigMul(k, halfPi, 0), p);
+    if (z.top() < 0) {
+        p += static_cast<size_t>(-z.top());
+        halfPi = bigDivSmall(bigPi(p), 2, p);
+        z = bigSub(x, bigMul(k, halfPi, 0), p);
+    }
+
+    BigFloat sz, cz;
+    bigSinCosSmall(z, p, sz, cz);
+    switch (quadrant) {
+        case 0: s = sz; c = cz; break;
+        case 1: s = cz; c = sz; c.negative = !c.negative; break;
+        case 2: s = sz; s.negative = !s.negative; c = cz; c.negative = !c.negative; break;
+        default: s = cz; s.negative = !s.negative; c = sz; break;
+    }
+    normalize(s);
+    normalize(c);
+    roundTo(s, precision);
+    roundTo(c, precision);
+}
+
+BigFloat bigLn(const BigFloat& x, size_t precision) {
+    if (x.negative || x.isZero())
+        throw std::runtime_error("Logarithm of a non-positive number!");
+
+    // Newton on exp(y) = x, in its cubically converging form
+    // y += 2 (x - exp(y)) / (x + exp(y)), starting from doubles.
+    int64_t exponent = 0;
+    double mantissa = bigApproximate(x, exponent);
+    BigFloat y = bigFromDouble(std::log(mantissa) + exponent * std::log(double(BIG_BASE)));
+    size_t guard = guardLimbs(std::log2(std::abs(bigToDouble(y)) + 1));
+    for (size_t p : newtonPrecisions(precision + guard)) {
+        BigFloat xp = x;
+        roundTo(xp, p);
+        BigFloat ey = bigExp(y, p);
+        BigFloat correction = bigDiv(bigMulSmall(bigSub(xp, ey, p), 2), bigAdd(xp, ey, p), p);
+        y = bigAdd(y, correction, p);
+    }
+    roundTo(y, precision);
+    return y;
+}
+
+BigFloat bigLn10(size_t precision) {
+    thread_local BigConstant cache;
+    if (cache.precision < precision) {
+        cache.value = bigLn(bigFromInteger(10), precision);
+        cache.precision = precision;
+    }
+    BigFloat ln10 = cache.value;
+    roundTo(ln10, precision);
+    return ln10;
+}
+
+
+BigFloat bigPow(const BigFloat& base, const BigFloat& power, size_t precision) {
+    if (bigIsInteger(power) && power.top() <= 2) {
+        // Whole powers by repeated squaring, so integer results stay exact.
+        uint64_t n = 0;
+        for (size_t i = power.limbs.size(); i-- > 0;)
+            n = n * BIG_BASE + power.limbs[i];
+        for (int64_t i = 0; i < power.exponent; i++)
+            n *= BIG_BASE;
+        size_t p = precision + 1 + guardLimbs(std::log2(double(n) + 1));
+        BigFloat result = bigFromInteger(1), square = base;
+        for (; n; n >>= 1) {
+            if (n & 1)
+                result = bigMul(result, square, p);
+            if (n > 1)
+                square = bigMul(square, square, p);
+        }
+        if (power.negative)
+            result = bigReciprocal(result, p);
+        roundTo(result, precision);
+        return result;
+    }
+    if (base.isZero()) {
+        if (power.negative)
+            throw std::runtime_error("Cannot divide by 0!");
+        return base;
+    }
+    if (base.negative)
+        throw std::runtime_error("Result is not a real number!");
+    size_t p = precision + 2;
+    return bigExp(bigMul(power, bigLn(base, p), p), precision);
+}
+
+// Newton on g(t) = x sin t - y cos t, which is r sin(t - atan2(y, x)):
+// t -= g(t) / g'(t) with g'(t) = x cos t + y sin t, starting from doubles.
+// Guard limbs keep the relative precision of an angle close to zero.
+BigFloat bigAtan2(const BigFloat& y, const BigFloat& x, size_t precision) {
+    if (y.isZero())
+        return x.negative ? bigPi(precision) : BigFloat{};
+    int64_t ey = 0, ex = 0;
+    double my = bigApproximate(y, ey);
+    double mx = x.isZero() ? 0 : bigApproximate(x, ex);
+    double shift = static_cast<double>(std::clamp<int64_t>(x.isZero() ? 0 : ey - ex, -30, 30));
+    double start = std::atan2(my * std::pow(double(BIG_BASE), shift), mx);
+
+    size_t guard = guardLimbs(std::max(0.0, -std::log2(std::abs(start))));
+    BigFloat t = bigFromDouble(start);
+    for (size_t p : newtonPrecisions(precision + guard)) {
+        BigFloat s, c;
+        bigSinCos(t, p, s, c);
+        BigFloat g = bigSub(bigMul(x, s, p), bigMul(y, c, p), p);
+        BigFloat slope = bigAdd(bigMul(x, c, p), bigMul(y, s, p), p);
+        t = bigSub(t, bigDiv(g, slope, p), p);
+    }
+    roundTo(t, precision);
+    return t;
+}
+
+BigFloat applyBigBinaryFunction(int function, const BigFloat& x, const BigFloat& y, size_t precision) {
+    switch (function) {
+        case BINARY_MIN: return bigSub(x, y, precision).negative ? x : y;
+        case BINARY_MAX: return bigSub(x, y, precision).negative ? y : x;
+        case BINARY_POW: return bigPow(x, y, precision);
+        default: return bigAtan2(x, y, precision);
+    }
+}
+
+BigFloat applyBigFunction(int function, const BigFloat& x, size_t precision) {
+    std::string_view name = builtinFunctions[function].name;
+    if (name == "sin" || name == "cos" || name == "tan") {
+        BigFloat s, c;
+        bigSinCos(x, precision + 1, s, c);
+        if (name == "sin")
+            return s;
+        if (name == "cos")
+            return c;
+        if (c.isZero())
+            throw std::runtime_error("Cannot divide by 0!");
+        return bigDiv(s, c, precision);
+    }
+    if (name == "log") {
+        size_t p = precision + 1;
+        return bigDiv(bigLn(x, p), bigLn10(p), precision);
+    }
+    if (name == "ln")
+        return bigLn(x, precision);
+    if (name == "sqrt")
+        return bigSqrt(x, precision);
+    if (name == "abs") {
+        BigFloat r = x;
+        r.negative = false;
+        return r;
+    }
+    if (name == "exp")
+        return bigExp(x, precision);
+    throw std::runtime_error("Unknown function!");
+}
+
+// Variables assigned while a precision is set keep their full value here;
+// other variables are converted exactly from their double value.
+std::unordered_map<std::string, BigFloat> bigVariables;
+
+// Evaluates a postfix expression with `digits` significant digits (plus
+// guard limbs). Literals are re-read from the source text, so they are exact
+// however long they are. A user function's body is evaluated from its own
+// postfix form, with `function` and `args` binding its parameters; its
+// other names are read from the variables as usual.
+BigFloat evaluateBigPostfix(const std::vector<Token>& postfix, std::string_view source, size_t digits,
+                            const UserFunction* function = nullptr, const BigFloat* args = nullptr) {
+    CALC_STAT_STAGE(STAGE_EVALUATE);
+    CALC_STAT_ADD(expressions, 1);
+    size_t precision = (digits + BIG_DIGITS - 1) / BIG_DIGITS + 2;
+    std::vector<BigFloat> stack;
+
+    for (const auto& token : postfix) {
+        if (token.type == NUMBER) {
+            switch (token.op) {
+                case NUMBER_PI: stack.push_back(bigPi(precision)); break;
+                case NUMBER_E: stack.push_back(bigE(precision)); break;
+                case NUMBER_ZERO: stack.emplace_back(); break;
+                default:
+                    stack.push_back(bigFromDecimal(source.substr(token.pos, scanNumber(source, token.pos) - token.pos)));
+                    break;
+            }
+        } else if (token.type == VARIABLE) {
+            std::string_view name = tokenText(source, token);
+            if (function) {
+                auto param = std::find(function->params.begin(), function->params.end(), name);
+                if (param != function->params.end()) {
+                    stack.push_back(args[param - function->params.begin()]);
+                    continue;
+                }
+            }
+            auto it = bigVariables.find(std::string(name));
+            stack.push_back(it != bigVariables.end() ? it->second : bigFromDouble(activeVariables->at(name)));
+        } else if (token.type == FUNCTION) {
+            size_t arity = functionArity(token);
+            if (stack.size() < arity)
+                throw std::runtime_error("Missing argument for function!");
+            if (token.op == FUNCTION_BUILTIN) {
+                stack.back() = applyBigFunction(token.id, stack.back(), precision);
+            } else if (token.op == FUNCTION_BINARY) {
+                BigFloat right = std::move(stack.back());
+                stack.pop_back();
+                stack.back() = applyBigBinaryFunction(token.id, stack.back(), right, precision);
+            } else if (token.op == FUNCTION_REDUCE) {
+                // Reductions are summed in double precision.
+                std::shared_ptr<const Reduction> reduction = compileReduction(source, token);
+                std::vector<double> values;
+                for (size_t i = stack.size() - arity; i < stack.size(); i++)
+                    values.push_back(bigToDouble(stack[i]));
+                for (const auto& name : reduction->captured) {
+                    if (function) {
+                        auto param = std::find(function->params.begin(), function->params.end(), name);
+                        if (param != function->params.end()) {
+                            values.push_back(bigToDouble(args[param - function->params.begin()]));
+                            continue;
+                        }
+                    }
+                    auto it = bigVariables.find(name);
+                    values.push_back(it != bigVariables.end() ? bigToDouble(it->second) : activeVariables->at(name));
+                }
+                double result = 0;
+                EvalStatus status = runReduction(*reduction, values.data(), result);
+                if (status != EVAL_OK)
+                    throw std::runtime_error(evalErrorMessage(status));
+                stack.resize(stack.size() - arity);
+                stack.push_back(bigFromDouble(result));
+            } else {
+                const UserFunction& callee = userFunction(token.id);
+                size_t first = stack.size() - arity;
+                BigFloat value = evaluateBigPostfix(callee.postfix, callee.source, digits, &callee, &stack[first]);
+                stack.resize(first);
+                stack.push_back(std::move(value));
+            }
+        } else if (token.type == OPERATOR) {
+            if (stack.size() < 2)
+                throw std::runtime_error("Invalid expression!");
+            BigFloat right = std::move(stack.back());
+            stack.pop_back();
+            BigFloat& left = stack.back();
+            switch (token.op) {
+                case '+': left = bigAdd(left, right, precision); break;
+                case '-': left = bigSub(left, right, precision); break;
+                case '*': left = bigMul(left, right, precision); break;
+                case '/':
+                    if (right.isZero())
+                        throw std::runtime_error("Cannot divide by 0!");
+                    left = bigDiv(left, right, precision);
+                    break;
+                case '^': left = bigPow(left, right, precision); break;
+                default:
+                    throw std::runtime_error("Unknown operator!");
+            }
+        }
+    }
+    if (stack.size() != 1)
+        throw std::runtime_error("Invalid expression!");
+    return stack.back();
+}
+
+BigFloat evaluateBig(std::string_view expr, size_t digits) {
+    thread_local std::vector<Token> tokens;
+    thread_local std::vector<Token> postfix;
+    tokens.clear();
+    Lexer lexer(true);
+    lexer.lex(expr, [&](const Token& token) { tokens.push_back(token); });
+    infixToPostfix(tokens, postfix);
+    return evaluateBigPostfix(postfix, expr, digits);
+}
+
+// Reads a stream in large blocks and hands out one line at a time without
+// copying it; a line stays valid until the next call to next().
+class LineReader {
+public:
+    explicit LineReader(FILE* file) : file(file), buffer(1 << 20) {}
+
+    bool next(std::string_view& line) {
+        while (true) {
+            char* start = buffer.data() + begin;
+            char* newline = static_cast<char*>(memchr(start, '\n', end - begin));
+            if (newline) {
+                size_t length = newline - start;
+                begin += length + 1;
+                line = stripCarriageReturn(std::string_view(start, length));
+                return true;
+            }
+            if (atEof) {
+                if (begin == end)
+                    return false;
+                line = stripCarriageReturn(std::string_view(start, end - begin));
+                begin = end;
+                return true;
+            }
+            fill();
+        }
+    }
+
+private:
+    static std::string_view stripCarriageReturn(std::string_view line) {
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        return line;
+    }
+
+    void fill() {
+        CALC_STAT_STAGE(STAGE_IO);
+        if (begin > 0) {
+            memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        if (end == buffer.size())
+            buffer.resize(buffer.size() * 2);
+        size_t got = fread(buffer.data() + end, 1, buffer.size() - end, file);
+        end += got;
+        if (got == 0)
+            atEof = true;
+    }
+
+    FILE* file;
+    std::vector<char> buffer;
+    size_t begin = 0;
+    size_t end = 0;
+    bool atEof = false;
+};
+
+// Same text as std::cout << value with the default six significant digits.
+void appendNumber(std::string& out, double value) {
+    char text[32];
+    auto res = std::to_chars(text, text + sizeof(text), value, std::chars_format::general, 6);
+    out.append(text, res.ptr - text);
+}
+
+// Shortest text that reads back as exactly the same double.
+void appendShortest(std::string& out, double value) {
+    char text[32];
+    auto res = std::to_chars(text, text + sizeof(text), value);
+    out.append(text, res.ptr - text);
+}
+
+// Collects output in a large block and writes it with a single fwrite,
+// instead of flushing the stream after every result.
+class OutputBuffer {
+public:
+    explicit OutputBuffer(FILE* file, size_t capacity = 1 << 16) : file(file), capacity(capacity) {
+        buffer.reserve(capacity + 64);
+    }
+    ~OutputBuffer() { flush(); }
+
+    void write(std::string_view text) {
+        buffer.append(text.data(), text.size());
+        if (buffer.size() >= capacity)
+            flush();
+    }
+
+    void put(char ch) {
+        buffer.push_back(ch);
+        if (buffer.size() >= capacity)
+            flush();
+    }
+
+    void writeNumber(double value) {
+        appendNumber(buffer, value);
+        if (buffer.size() >= capacity)
+            flush();
+    }
+
+    void writeShortest(double value) {
+        appendShortest(buffer, value);
+        if (buffer.size() >= capacity)
+            flush();
+    }
+
+    void flush() {
+        CALC_STAT_STAGE(STAGE_IO);
+        if (!buffer.empty())
+            fwrite(buffer.data(), 1, buffer.size(), file);
+        buffer.clear();
+    }
+
+private:
+    FILE* file;
+    size_t capacity;
+    std::string buffer;
+};
+
+// Returns the variable name when the line has the form "name = expr".
+std::string_view assignmentTarget(std::string_view line) {
+    size_t eqPos = line.find('=');
+    if (eqPos == std::string_view::npos || line.find(';') != std::string_view::npos)
+        return {};
+    std::string_view target = trimView(line.substr(0, eqPos));
+    if (target.empty() || !std::all_of(target.begin(), target.end(), ::isalpha))
+        return {};
+    return target;
+}
+
+// What recomputing the bindings downstream of a change did.
+struct BindingUpdate {
+    size_t recomputed = 0;
+    std::vector<std::string> errors;  // "name: message" for bindings that failed
+};
+
+std::string_view bindingTarget(std::string_view line);
+double bindVariable(std::string_view name, std::string_view expr, BindingUpdate& update);
+BindingUpdate assignVariable(std::string_view name, double value);
+
+// A value in a matrix line: a matrix, or a number when matrix is null.
+struct MatrixValue {
+    std::shared_ptr<Matrix> matrix;
+    double scalar = 0;
+};
+
+const size_t MATRIX_PRINT_LIMIT = 10000;  // elements; larger results print their size
+
+bool isMatrixLine(std::string_view line);
+std::string_view evaluateMatrixLine(std::string_view line, MatrixValue& value, BindingUpdate& update);
+void appendMatrix(std::string& out, const Matrix& m, void (*appendValue)(std::string&, double));
+
+// Appends what the integrals of a batch line reported to its result: the
+// error estimate when the line is one integral, and a note when one of them
+// missed its tolerance.
+void appendIntegralReport(std::string& out, const IntegralReport& report, bool integralLine) {
+    if (integralLine) {
+        out += " (estimated error ";
+        appendNumber(out, report.error);
+        out += ')';
+    }
+    if (!report.converged)
+        out += " (tolerance not reached)";
+}
+
+// Evaluates one batch line and appends its result (or "Error: ...") followed
+// by a newline. Evaluation errors come back as status codes; only compile
+// errors, which the cache pays once per distinct expression, arrive as
+// exceptions.
+void evaluateBatchLine(std::string_view text, std::string& out) {
+    std::string_view line = trimView(text);
+    if (line.empty()) {
+        out += '\n';
+        return;
+    }
+
+    IntegralReport report;
+    IntegralReportScope reportScope(&report);
+    try {
+        std::string_view diffExpr, diffName;
+        if (parseDiffCall(line, diffExpr, diffName)) {
+            appendNumber(out, evaluateDerivative(diffExpr, diffName));
+            out += '\n';
+            return;
+        }
+
+        std::string_view bound = bindingTarget(line);
+        if (!bound.empty()) {
+            BindingUpdate update;
+            appendNumber(out, bindVariable(bound, line.substr(line.find(":=") + 2), update));
+            appendIntegralReport(out, report, false);
+            out += '\n';
+            return;
+        }
+
+        FunctionDefinition definition;
+        if (parseFunctionDefinition(line, definition)) {
+            std::string signature = defineFunction(definition);
+            out += "Defined ";
+            out += signature;
+            out += '\n';
+            return;
+        }
+
+        if (isMatrixLine(line)) {
+            MatrixValue value;
+            BindingUpdate update;
+            evaluateMatrixLine(line, value, update);
+            if (value.matrix)
+                appendMatrix(out, *value.matrix, appendNumber);
+            else
+                appendNumber(out, value.scalar);
+            out += '\n';
+            return;
+        }
+
+        size_t eqPos = line.find('=');
+        std::string_view target = assignmentTarget(line);
+        if (eqPos != std::string::npos && target.empty()) {
+            out += solveEquation(std::string(line));
+            out += '\n';
+            return;
+        }
+
+        std::string_view exprText = eqPos == std::string::npos ? line : line.substr(eqPos + 1);
+        const CompiledExpression& program = expressionCache.get(exprText);
+        double value = 0;
+        EvalStatus status = runProgram(program, value);
+        if (status != EVAL_OK) {
+            out += "Error: ";
+            out += evalErrorMessage(status);
+            out += '\n';
+            return;
+        }
+        if (!target.empty())
+            assignVariable(target, value);
+        appendNumber(out, value);
+        appendIntegralReport(out, report, target.empty() && isIntegralLine(line));
+        out += '\n';
+    } catch (const std::invalid_argument&) {
+        CALC_STAT_ADD(exceptions, 1);
+        out += "Error: Invalid number format\n";
+    } catch (const std::out_of_range&) {
+        CALC_STAT_ADD(exceptions, 1);
+        out += "Error: Number too large\n";
+    } catch (const std::exception& e) {
+        CALC_STAT_ADD(exceptions, 1);
+        out += "Error: ";
+        out += e.what();
+        out += '\n';
+    }
+}
+
+// Fixed set of worker threads that run index ranges. Workers claim small
+// chunks from a shared counter as they go, so a thread that draws cheap lines
+// simply takes more chunks instead of idling.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threads) {
+        for (unsigned i = 1; i < threads; i++)
+            workers.emplace_back([this] { workerLoop(); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    size_t size() const { return workers.size() + 1; }
+
+    // Calls task(i) for every i in [0, count) and returns when all calls are
+    // done. The calling thread takes part in the work.
+    void parallelFor(size_t count, const std::function<void(size_t)>& fn) {
+        if (workers.empty() || count <= 1) {
+            for (size_t i = 0; i < count; i++)
+                fn(i);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = &fn;
+            taskCount = count;
+            next = 0;
+            active = workers.size();
+            error = nullptr;
+            generation++;
+        }
+        wake.notify_all();
+        runTasks();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return active == 0; });
+        task = nullptr;
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+private:
+    void runTasks() {
+        size_t i;
+        while ((i = next.fetch_add(1)) < taskCount) {
+            try {
+                (*task)(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+        }
+    }
+
+    void workerLoop() {
+        size_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+            }
+            runTasks();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--active == 0)
+                done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(size_t)>* task = nullptr;
+    size_t taskCount = 0;
+    std::atomic<size_t> next{0};
+    size_t active = 0;
+    size_t generation = 0;
+    bool stopping = false;
+    std::exception_ptr error;
+};
+
+// Calls fn(i) for every i in [0, count) on a pool shared by the work that
+// splits one request across cores: binding updates, reductions, integrals
+// and matrix products. The pool
+// runs one job at a time, so a caller that finds it busy, such as a second
+// server session, does its work alone.
+void sharedParallelFor(size_t count, const std::function<void(size_t)>& fn) {
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    static std::mutex poolMutex;
+    std::unique_lock<std::mutex> lock(poolMutex, std::defer_lock);
+    if (count < 2 || pool.size() == 1 || !lock.try_lock()) {
+        for (size_t i = 0; i < count; i++)
+            fn(i);
+        return;
+    }
+    pool.parallelFor(count, fn);
+}
+
+// Spreadsheet-style bindings: "area := w * h" keeps area equal to w * h as w
+// and h change. A binding is compiled once, and the variable slots its
+// program reads are its dependencies. Bindings form a DAG with an edge from
+// each variable to the bindings that read it. A binding's level is one more
+// than the highest level among its dependencies, plain variables being level
+// 0, so two bindings on the same level never read each other.
+//
+// When a variable changes, only the bindings downstream of it are marked
+// dirty. They are recomputed level by level, and a level with many dirty
+// bindings is spread over a thread pool. A binding whose value comes out bit
+// for bit unchanged does not dirty its own dependents.
+class BindingGraph {
+public:
+    explicit BindingGraph(Environment& environment) : environment(environment) {}
+
+    // Makes the variable in slot a binding to expr, compiled as program, and
+    // returns its value. Throws, leaving any previous binding in place, if
+    // expr does not evaluate or if the binding would depend on itself.
+    double bind(int slot, std::string_view expr, CompiledExpression program) {
+        std::vector<int> deps = readSlots(program);
+        grow(environment.size());
+        checkCycle(slot, deps);
+        double value = 0;
+        EvalStatus status = runProgram(program, value);
+        if (status != EVAL_OK)
+            throw std::runtime_error(evalErrorMessage(status));
+
+        unbind(slot);
+        install(slot, std::string(trimView(expr)), std::move(program), std::move(deps));
+        environment.values[slot] = value;
+        return value;
+    }
+
+    // Reinstates a binding from a workspace file, with its value already in
+    // place. The caller restores bindings in the order boundSlots() gave.
+    void restore(int slot, std::string expr, CompiledExpression program) {
+        grow(environment.size());
+        std::vector<int> deps = readSlots(program);
+        install(slot, std::move(expr), std::move(program), std::move(deps));
+    }
+
+    bool isBound(int slot) const { return static_cast<size_t>(slot) < nodes.size() && nodes[slot].bound; }
+
+    // Marks, by slot, the bindings that read one of slots directly or through
+    // other bindings. Empty if there are none.
+    std::vector<char> downstream(const std::vector<int>& slots) const {
+        std::vector<char> marked;
+        std::vector<int> work;
+        for (int slot : slots) {
+            if (slot >= 0 && static_cast<size_t>(slot) < dependents.size())
+                work.push_back(slot);
+        }
+        while (!work.empty()) {
+            int s = work.back();
+            work.pop_back();
+            for (int d : dependents[s]) {
+                if (marked.empty())
+                    marked.resize(nodes.size());
+                if (!marked[d]) {
+                    marked[d] = 1;
+                    work.push_back(d);
+                }
+            }
+        }
+        return marked;
+    }
+
+    // Turns a binding back into a plain variable that keeps its value.
+    void unbind(int slot) {
+        if (static_cast<size_t>(slot) >= nodes.size() || !nodes[slot].bound)
+            return;
+        Node& node = nodes[slot];
+        for (int dep : node.deps) {
+            auto& list = dependents[dep];
+            list.erase(std::find(list.begin(), list.end(), slot));
+        }
+        node.bound = false;
+        node.deps.clear();
+        node.program = CompiledExpression();
+        node.level = 0;
+        environment.functionGeneration++;
+    }
+
+    // Recomputes the bindings downstream of slot, whose value has just changed.
+    BindingUpdate propagate(int slot) {
+        BindingUpdate update;
+        if (static_cast<size_t>(slot) >= dependents.size() || dependents[slot].empty())
+            return update;
+
+        unsigned low = std::numeric_limits<unsigned>::max(), high = 0;
+        auto markDependents = [&](int changed) {
+            for (int d : dependents[changed]) {
+                if (nodes[d].pending)
+                    continue;
+                nodes[d].pending = true;
+                buckets[nodes[d].level].push_back(d);
+                low = std::min(low, nodes[d].level);
+                high = std::max(high, nodes[d].level);
+            }
+        };
+        markDependents(slot);
+        for (unsigned level = low; level <= high; level++) {
+            std::vector<int>& bucket = buckets[level];
+            if (bucket.empty())
+                continue;
+            recompute(bucket);
+            update.recomputed += bucket.size();
+            for (int s : bucket) {
+                Node& node = nodes[s];
+                node.pending = false;
+                if (node.status != EVAL_OK && update.errors.size() < MAX_REPORTED_ERRORS)
+                    update.errors.push_back(environment.names[s] + ": " + evalErrorMessage(node.status));
+                if (node.changed)
+                    markDependents(s);
+            }
+            bucket.clear();
+        }
+        return update;
+    }
+
+    // The bound slots, each one after every binding it reads.
+    std::vector<int> boundSlots() const {
+        std::vector<int> slots;
+        for (size_t slot = 0; slot < nodes.size(); slot++) {
+            if (nodes[slot].bound)
+                slots.push_back(static_cast<int>(slot));
+        }
+        std::stable_sort(slots.begin(), slots.end(), [&](int a, int b) { return nodes[a].level < nodes[b].level; });
+        return slots;
+    }
+
+    const std::string& expression(int slot) const { return nodes[slot].text; }
+    const CompiledExpression& program(int slot) const { return nodes[slot].program; }
+
+    // Each binding as "name := expr", in the order the variables were created.
+    std::vector<std::string> list() const {
+        std::vector<std::string> out;
+        for (size_t slot = 0; slot < nodes.size(); slot++) {
+            if (nodes[slot].bound)
+                out.push_back(environment.names[slot] + " := " + nodes[slot].text);
+        }
+        return out;
+    }
+
+private:
+    static const size_t MAX_REPORTED_ERRORS = 5;
+    static const size_t PARALLEL_MIN = 512;
+    static const size_t PARALLEL_CHUNK = 128;
+
+    struct Node {
+        bool bound = false;
+        bool pending = false;
+        unsigned char changed = 0;
+        EvalStatus status = EVAL_OK;
+        unsigned level = 0;
+        std::string text;
+        CompiledExpression program;
+        std::vector<int> deps;
+    };
+
+    void grow(size_t size) {
+        if (nodes.size() < size) {
+            nodes.resize(size);
+            dependents.resize(size);
+        }
+    }
+
+    static std::vector<int> readSlots(const CompiledExpression& program) {
+        std::vector<int> slots;
+        for (const auto& ins : program.code) {
+            if (ins.op == OP_VAR && std::find(slots.begin(), slots.end(), ins.index) == slots.end())
+                slots.push_back(ins.index);
+        }
+        return slots;
+    }
+
+    void install(int slot, std::string expr, CompiledExpression program, std::vector<int> deps) {
+        Node& node = nodes[slot];
+        node.bound = true;
+        node.text = std::move(expr);
+        node.program = std::move(program);
+        node.deps = std::move(deps);
+        for (int dep : node.deps) {
+            dependents[dep].push_back(slot);
+            node.level = std::max(node.level, nodes[dep].level + 1);
+        }
+        raiseLevels(slot);
+        environment.functionGeneration++;
+    }
+
+    // Throws if one of deps is slot itself or one of the bindings downstream
+    // of it, naming the loop, e.g. "a -> b -> a" for a := b + 1 when b := a.
+    void checkCycle(int slot, const std::vector<int>& deps) {
+        std::unordered_map<int, int> parent{{slot, -1}};
+        std::vector<int> work{slot};
+        int closing = std::find(deps.begin(), deps.end(), slot) != deps.end() ? slot : -1;
+        while (closing < 0 && !work.empty()) {
+            int s = work.back();
+            work.pop_back();
+            for (int d : dependents[s]) {
+                if (!parent.emplace(d, s).second)
+                    continue;
+                if (std::find(deps.begin(), deps.end(), d) != deps.end()) {
+                    closing = d;
+                    break;
+                }
+                work.push_back(d);
+            }
+        }
+        if (closing < 0)
+            return;
+        std::string path = environment.names[slot];
+        for (int s = closing; s >= 0; s = parent[s])
+            path += " -> " + environment.names[s];
+        throw std::runtime_error("Circular dependency: " + path);
+    }
+
+    // Restores level(d) > level(s) below a binding whose level went up.
+    void raiseLevels(int slot) {
+        std::vector<int> work{slot};
+        while (!work.empty()) {
+            int s = work.back();
+            work.pop_back();
+            if (buckets.size() <= nodes[s].level)
+                buckets.resize(nodes[s].level + 1);
+            for (int d : dependents[s]) {
+                if (nodes[d].level <= nodes[s].level) {
+                    nodes[d].level = nodes[s].level + 1;
+                    work.push_back(d);
+                }
+            }
+        }
+    }
+
+    // Evaluates one level's dirty bindings, which are independent of each other.
+    void recompute(const std::vector<int>& bucket) {
+        auto evaluate = [&](size_t first, size_t last) {
+            ActiveVariablesScope scope(environment);
+            for (size_t i = first; i < last; i++) {
+                int slot = bucket[i];
+                Node& node = nodes[slot];
+                double value = 0;
+                node.status = runProgram(node.program, value);
+                if (node.status != EVAL_OK)
+                    value = NAN;
+                double& stored = environment.values[slot];
+                node.changed = memcmp(&stored, &value, sizeof(value)) != 0;
+                stored = value;
+            }
+        };
+
+        if (bucket.size() < PARALLEL_MIN) {
+            evaluate(0, bucket.size());
+            return;
+        }
+        size_t chunks = (bucket.size() + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+        sharedParallelFor(chunks, [&](size_t c) {
+            evaluate(c * PARALLEL_CHUNK, std::min(bucket.size(), (c + 1) * PARALLEL_CHUNK));
+        });
+    }
+
+    Environment& environment;
+    std::vector<Node> nodes;                   // by variable slot
+    std::vector<std::vector<int>> dependents;  // by variable slot: the bindings that read it
+    std::vector<std::vector<int>> buckets;     // by level: dirty bindings, during propagate()
+};
+
+BindingGraph& bindingGraph() {
+    if (!activeVariables->bindings)
+        activeVariables->bindings = std::make_shared<BindingGraph>(*activeVariables);
+    return *activeVariables->bindings;
+}
+
+// Replaces each name in expr for which replacement() returns text with that
+// text in parentheses. Numbers and function calls are left alone.
+template <typename Replacement>
+std::string substituteNames(std::string_view expr, Replacement replacement) {
+    std::string out;
+    size_t i = 0;
+    while (i < expr.size()) {
+        size_t j = i + 1;
+        if (isdigit(static_cast<unsigned char>(expr[i])) || expr[i] == '.') {
+            j = scanNumber(expr, i);
+        } else if (isalpha(static_cast<unsigned char>(expr[i]))) {
+            j = i;
+            while (j < expr.size() && isalpha(static_cast<unsigned char>(expr[j])))
+                j++;
+            size_t next = j;
+            while (next < expr.size() && isspace(static_cast<unsigned char>(expr[next])))
+                next++;
+            const std::string* text = next < expr.size() && expr[next] == '(' ? nullptr : replacement(expr.substr(i, j - i));
+            if (text) {
+                out += '(';
+                out += *text;
+                out += ')';
+                i = j;
+                continue;
+            }
+        }
+        out.append(expr, i, j - i);
+        i = j;
+    }
+    return out;
+}
+
+std::string expandBindings(std::string_view expr, const std::vector<int>& slots) {
+    const size_t MAX_EXPANSION = 1 << 20;
+    BindingGraph* graph = activeVariables->bindings.get();
+    std::vector<char> marked = graph ? graph->downstream(slots) : std::vector<char>();
+    if (marked.empty())
+        return std::string(expr);
+
+    // Bindings come after the bindings they read, so each one's own text can
+    // be expanded in one pass over the ones already done.
+    std::unordered_map<int, std::string> expanded;
+    auto replacement = [&](std::string_view name) -> const std::string* {
+        auto it = expanded.find(activeVariables->find(name));
+        return it == expanded.end() ? nullptr : &it->second;
+    };
+    for (int slot : graph->boundSlots()) {
+        if (!marked[slot])
+            continue;
+        std::string text = substituteNames(graph->expression(slot), replacement);
+        if (text.size() > MAX_EXPANSION)
+            throw std::runtime_error("Binding " + activeVariables->names[slot] + " is too long to expand!");
+        expanded.emplace(slot, std::move(text));
+    }
+    return substituteNames(expr, replacement);
+}
+
+// Returns the variable name when the line has the form "name := expr".
+std::string_view bindingTarget(std::string_view line) {
+    size_t pos = line.find(":=");
+    if (pos == std::string_view::npos)
+        return {};
+    std::string_view target = trimView(line.substr(0, pos));
+    if (target.empty() || !std::all_of(target.begin(), target.end(), ::isalpha))
+        return {};
+    return target;
+}
+
+// Binds name to expr, then brings what depends on name up to date.
+double bindVariable(std::string_view name, std::string_view expr, BindingUpdate& update) {
+    if (activeVariables->matrices.count(std::string(name)))
+        throw std::runtime_error(std::string(name) + " holds a matrix, so it cannot hold a number!");
+    CompiledExpression program;
+    compileExpression(expr, program);
+    int slot = activeVariables->find(name);
+    if (slot < 0) {
+        // A new name cannot appear in expr, so it is created only once expr
+        // is known to evaluate.
+        double value = 0;
+        EvalStatus status = runProgram(program, value);
+        if (status != EVAL_OK)
+            throw std::runtime_error(evalErrorMessage(status));
+        slot = activeVariables->set(name, value);
+    }
+    double value = bindingGraph().bind(slot, expr, std::move(program));
+    update = bindingGraph().propagate(slot);
+    return value;
+}
+
+// Assigns a plain value, which replaces a binding of the same name, then
+// brings what depends on name up to date.
+BindingUpdate assignVariable(std::string_view name, double value) {
+    int slot = activeVariables->set(name, value);
+    if (!activeVariables->bindings)
+        return {};
+    activeVariables->bindings->unbind(slot);
+    return activeVariables->bindings->propagate(slot);
+}
+
+// Lines between two assignments only read variables, so each such segment is
+// evaluated in parallel against an unchanging environment. Assignments and
+// function definitions are the only writers and run on the calling thread
+// between segments, which keeps results identical to evaluating the file top
+// to bottom.
+void evaluateBatchWindow(const std::vector<std::string>& lines, ThreadPool& pool, OutputBuffer& out) {
+    const size_t CHUNK = 256;
+    std::vector<std::string> chunkOutput;
+    FunctionDefinition definition;
+    size_t i = 0;
+
+    while (i < lines.size()) {
+        size_t j = i;
+        while (j < lines.size() && assignmentTarget(lines[j]).empty() && bindingTarget(lines[j]).empty() &&
+               !parseFunctionDefinition(lines[j], definition))
+            j++;
+
+        size_t chunks = (j - i + CHUNK - 1) / CHUNK;
+        chunkOutput.resize(std::max(chunkOutput.size(), chunks));
+        pool.parallelFor(chunks, [&](size_t c) {
+            std::string& text = chunkOutput[c];
+            text.clear();
+            size_t last = std::min(j, i + (c + 1) * CHUNK);
+            for (size_t k = i + c * CHUNK; k < last; k++)
+                evaluateBatchLine(lines[k], text);
+        });
+        for (size_t c = 0; c < chunks; c++)
+            out.write(chunkOutput[c]);
+
+        if (j < lines.size()) {
+            std::string text;
+            evaluateBatchLine(lines[j], text);
+            out.write(text);
+        }
+        i = j + 1;
+    }
+}
+
+#ifdef CALC_HAVE_MMAP
+// A read-only file mapping, unmapped when it goes out of scope.
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+
+    MappedFile(int fd, size_t size) : size(size) {
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED)
+            data = static_cast<const char*>(mapping);
+    }
+    ~MappedFile() {
+        if (data)
+            munmap(const_cast<char*>(data), size);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+};
+#endif
+
+// Workspace files hold the variables, function definitions, bindings and
+// matrices of an environment, with every program already compiled: "save FILE" writes
+// one and "load FILE" (or --workspace FILE) brings it back without lexing,
+// parsing or optimizing anything. The file is a header followed by records
+// of fixed-size fields, counted strings and raw Instruction and Token arrays,
+// each padded to 8 bytes, in native byte order. Loading maps the file
+// read-only, so processes that open the same snapshot share its pages.
+//
+// Programs refer to variables and functions by slot, so a file describes a
+// whole environment: loading replaces the current one rather than merging.
+const char WORKSPACE_MAGIC[8] = {'C', 'A', 'L', 'C', 'W', 'S', 'P', '\n'};
+
+// Bump whenever OpCode, Token or the builtin function tables change meaning.
+const uint32_t WORKSPACE_VERSION = 3;
+
+struct WorkspaceHeader {
+    char magic[8];
+    uint32_t version;
+    uint16_t instructionSize;
+    uint16_t tokenSize;
+    uint32_t variableCount;
+    uint32_t functionCount;
+    uint32_t bindingCount;
+    uint32_t matrixCount;
+    uint64_t size;  // of the whole file
+};
+
+struct WorkspaceSummary {
+    size_t variables = 0;
+    size_t functions = 0;
+    size_t bindings = 0;
+    size_t matrices = 0;
+};
+
+class WorkspaceWriter {
+public:
+    template <typename T>
+    void put(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "raw fields only");
+        bytes.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    void putArray(const std::vector<T>& values) {
+        put(static_cast<uint64_t>(values.size()));
+        if (!values.empty())
+            bytes.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+        pad();
+    }
+
+    void putMatrix(const Matrix& m) {
+        put(static_cast<uint64_t>(m.rows));
+        put(static_cast<uint64_t>(m.cols));
+        bytes.append(reinterpret_cast<const char*>(m.data()), m.size() * sizeof(double));
+    }
+
+    void putString(std::string_view text) {
+        put(static_cast<uint64_t>(text.size()));
+        bytes.append(text.data(), text.size());
+        pad();
+    }
+
+    void putProgram(const CompiledExpression& program) {
+        put(static_cast<uint64_t>(program.maxDepth));
+        put(static_cast<uint64_t>(program.tempCount));
+        putArray(program.code);
+        put(static_cast<uint64_t>(program.reductions.size()));
+        for (const auto& reduction : program.reductions) {
+            put(static_cast<uint64_t>(reduction->kind));
+            putString(reduction->name);
+            put(static_cast<uint64_t>(reduction->captured.size()));
+            for (const auto& name : reduction->captured)
+                putString(name);
+            putProgram(reduction->body);
+        }
+    }
+
+    std::string bytes;
+
+private:
+    void pad() { bytes.append((8 - bytes.size() % 8) % 8, '\0'); }
+};
+
+// Reads a workspace file's records, throwing on anything out of bounds.
+class WorkspaceReader {
+public:
+    explicit WorkspaceReader(std::string_view bytes) : bytes(bytes) {}
+
+    template <typename T>
+    T get() {
+        T value;
+        memcpy(&value, take(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    std::vector<T> getArray() {
+        uint64_t count = get<uint64_t>();
+        if (count > (bytes.size() - pos) / sizeof(T))
+            corrupt();
+        std::vector<T> values(count);
+        if (count)
+            memcpy(values.data(), take(count * sizeof(T)), count * sizeof(T));
+        skipPadding();
+        return values;
+    }
+
+    std::string_view getString() {
+        uint64_t length = get<uint64_t>();
+        if (length > bytes.size() - pos)
+            corrupt();
+        std::string_view text(take(length), length);
+        skipPadding();
+        return text;
+    }
+
+    CompiledExpression getProgram(int nesting = 0) {
+        const int MAX_NESTING = 64;
+        CompiledExpression program;
+        program.maxDepth = get<uint64_t>();
+        program.tempCount = get<uint64_t>();
+        program.code = getArray<Instruction>();
+        uint64_t count = get<uint64_t>();
+        if (count > program.code.size() || (count && nesting == MAX_NESTING))
+            corrupt();
+        for (uint64_t i = 0; i < count; i++) {
+            auto reduction = std::make_shared<Reduction>();
+            uint64_t kind = get<uint64_t>();
+            if (kind >= REDUCTION_COUNT)
+                corrupt();
+            reduction->kind = static_cast<ReductionKind>(kind);
+            reduction->name = std::string(getString());
+            uint64_t captured = get<uint64_t>();
+            if (captured > (bytes.size() - pos) / sizeof(uint64_t))
+                corrupt();
+            for (uint64_t c = 0; c < captured; c++)
+                reduction->captured.emplace_back(getString());
+            reduction->body = getProgram(nesting + 1);
+            program.reductions.push_back(std::move(reduction));
+        }
+        return program;
+    }
+
+    std::shared_ptr<Matrix> getMatrix() {
+        uint64_t rows = get<uint64_t>();
+        uint64_t cols = get<uint64_t>();
+        if (rows == 0 || cols == 0 || cols > (bytes.size() - pos) / sizeof(double) / rows)
+            corrupt();
+        auto m = std::make_shared<Matrix>(rows, cols, false);
+        memcpy(m->data(), take(m->size() * sizeof(double)), m->size() * sizeof(double));
+        return m;
+    }
+
+    [[noreturn]] static void corrupt() { throw std::runtime_error("Corrupt workspace file!"); }
+
+private:
+    const char* take(size_t n) {
+        if (n > bytes.size() - pos)
+            corrupt();
+        pos += n;
+        return bytes.data() + pos - n;
+    }
+
+    void skipPadding() { take((8 - pos % 8) % 8); }
+
+    std::string_view bytes;
+    size_t pos = 0;
+};
+
+// Checks that a loaded program only touches what exists: arguments below
+// `arguments`, variables below `variables`, functions defined before it, and
+// a stack no deeper than it claims. Loaded code then runs as safely as code
+// compiled here. A reduction's body reads its variable and captured names as
+// variables of its own.
+void checkWorkspaceProgram(const CompiledExpression& program, size_t variables, size_t arguments,
+                           const std::vector<std::shared_ptr<const UserFunction>>& functions) {
+    const size_t MAX_DEPTH = 1 << 20;
+    if (program.code.empty() || program.maxDepth > MAX_DEPTH || program.tempCount > MAX_DEPTH)
+        WorkspaceReader::corrupt();
+    for (const auto& reduction : program.reductions)
+        checkWorkspaceProgram(reduction->body, 1 + reduction->captured.size(), 0, functions);
+    size_t depth = 0;
+    for (const auto& ins : program.code) {
+        // The file may hold any bits where an OpCode goes.
+        std::underlying_type<OpCode>::type op;
+        memcpy(&op, &ins.op, sizeof(op));
+        if (op < OP_CONST || op > OP_REDUCE)
+            WorkspaceReader::corrupt();
+        size_t pops = 0;
+        size_t index = static_cast<size_t>(static_cast<unsigned>(ins.index));
+        switch (ins.op) {
+            case OP_CONST:
+                break;
+            case OP_VAR:
+                pops = index < variables ? 0 : SIZE_MAX;
+                break;
+            case OP_ARG:
+                pops = index < arguments ? 0 : SIZE_MAX;
+                break;
+            case OP_LOAD:
+                pops = index < program.tempCount ? 0 : SIZE_MAX;
+                break;
+            case OP_STORE:
+                pops = index < program.tempCount ? 1 : SIZE_MAX;
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_POW:
+                pops = 2;
+                break;
+            case OP_FUNC:
+                pops = index < static_cast<size_t>(BUILTIN_FUNCTION_COUNT) ? 1 : SIZE_MAX;
+                break;
+            case OP_FUNC2:
+                pops = index < static_cast<size_t>(BINARY_FUNCTION_COUNT) ? 2 : SIZE_MAX;
+                break;
+            case OP_CALL:
+                pops = index < functions.size() ? functions[index]->argumentCount() : SIZE_MAX;
+                break;
+            case OP_REDUCE:
+                pops = index < program.reductions.size() ? program.reductions[index]->argumentCount() : SIZE_MAX;
+                break;
+            default:
+                pops = SIZE_MAX;
+        }
+        if (pops == SIZE_MAX || pops > depth)
+            WorkspaceReader::corrupt();
+        depth = depth - pops + 1;
+        if (depth > program.maxDepth)
+            WorkspaceReader::corrupt();
+    }
+    if (depth != 1)
+        WorkspaceReader::corrupt();
+}
+
+// The same for a function body's postfix form, which arbitrary precision and
+// the equation solver evaluate instead of the program.
+void checkWorkspacePostfix(const std::vector<Token>& postfix, std::string_view source,
+                           const std::vector<std::shared_ptr<const UserFunction>>& functions) {
+    size_t depth = 0;
+    for (const auto& token : postfix) {
+        size_t pops = SIZE_MAX;
+        switch (token.type) {
+            case NUMBER:
+            case VARIABLE:
+                pops = token.pos <= source.size() && token.id <= source.size() - token.pos ? 0 : SIZE_MAX;
+                break;
+            case OPERATOR:
+                if (token.op == '-' && token.id == UNARY_MINUS)
+                    pops = 1;
+                else if (token.op && strchr("+-*/^", token.op))
+                    pops = 2;
+                break;
+            case FUNCTION:
+                if (token.op == FUNCTION_BUILTIN && token.id < BUILTIN_FUNCTION_COUNT)
+                    pops = 1;
+                else if (token.op == FUNCTION_BINARY && token.id < BINARY_FUNCTION_COUNT)
+                    pops = 2;
+                else if (token.op == FUNCTION_USER && token.id < functions.size())
+                    pops = functions[token.id]->params.size();
+                else if (token.op == FUNCTION_REDUCE && token.id < REDUCTION_COUNT && token.pos < source.size())
+                    pops = reductionOperands(token.id);
+                break;
+            default:
+                break;
+        }
+        if (pops == SIZE_MAX || pops > depth)
+            WorkspaceReader::corrupt();
+        depth = depth - pops + 1;
+    }
+    if (depth != 1)
+        WorkspaceReader::corrupt();
+}
+
+std::string workspaceSummaryText(const WorkspaceSummary& summary) {
+    std::string text = std::to_string(summary.variables) + (summary.variables == 1 ? " variable, " : " variables, ") +
+                       std::to_string(summary.functions) + (summary.functions == 1 ? " function" : " functions") +
+                       (summary.matrices ? ", " : " and ") +
+                       std::to_string(summary.bindings) + (summary.bindings == 1 ? " binding" : " bindings");
+    if (summary.matrices)
+        text += " and " + std::to_string(summary.matrices) + (summary.matrices == 1 ? " matrix" : " matrices");
+    return text;
+}
+
+// Writes the active environment to path. The file is written under a
+// temporary name and renamed into place, so a process that has the old
+// snapshot mapped keeps reading it intact.
+WorkspaceSummary saveWorkspace(const std::string& path) {
+    const Environment& environment = *activeVariables;
+    WorkspaceSummary summary;
+    summary.variables = environment.size();
+    summary.functions = environment.functions.size();
+    std::vector<int> bound;
+    if (environment.bindings)
+        bound = environment.bindings->boundSlots();
+    summary.bindings = bound.size();
+    // Sorted, so saving the same environment twice gives the same file.
+    std::vector<const std::pair<const std::string, std::shared_ptr<Matrix>>*> matrices;
+    for (const auto& entry : environment.matrices)
+        matrices.push_back(&entry);
+    std::sort(matrices.begin(), matrices.end(), [](auto a, auto b) { return a->first < b->first; });
+    summary.matrices = matrices.size();
+
+    WorkspaceWriter writer;
+    WorkspaceHeader header{};
+    memcpy(header.magic, WORKSPACE_MAGIC, sizeof(header.magic));
+    header.version = WORKSPACE_VERSION;
+    header.instructionSize = sizeof(Instruction);
+    header.tokenSize = sizeof(Token);
+    header.variableCount = static_cast<uint32_t>(summary.variables);
+    header.functionCount = static_cast<uint32_t>(summary.functions);
+    header.bindingCount = static_cast<uint32_t>(summary.bindings);
+    header.matrixCount = static_cast<uint32_t>(summary.matrices);
+    writer.put(header);
+
+    for (size_t slot = 0; slot < environment.size(); slot++) {
+        writer.putString(environment.names[slot]);
+        writer.put(environment.values[slot]);
+    }
+    for (const auto& function : environment.functions) {
+        writer.putString(function->name);
+        writer.put(static_cast<uint32_t>(function->params.size()));
+        writer.put(static_cast<uint32_t>(function->captured.size()));
+        writer.put(static_cast<uint32_t>(function->inlined));
+        writer.put(static_cast<uint32_t>(function->memoized));
+        for (const auto& param : function->params)
+            writer.putString(param);
+        for (const auto& name : function->captured)
+            writer.putString(name);
+        writer.putString(function->source);
+        writer.putArray(function->postfix);
+        writer.putProgram(function->body);
+    }
+    for (int slot : bound) {
+        writer.put(static_cast<uint64_t>(slot));
+        writer.putString(environment.bindings->expression(slot));
+        writer.putProgram(environment.bindings->program(slot));
+    }
+    for (const auto* entry : matrices) {
+        writer.putString(entry->first);
+        writer.putMatrix(*entry->second);
+    }
+    uint64_t size = writer.bytes.size();
+    memcpy(&writer.bytes[offsetof(WorkspaceHeader, size)], &size, sizeof(size));
+
+    std::string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (!file)
+        throw std::runtime_error("Cannot write " + path);
+    bool written = fwrite(writer.bytes.data(), 1, writer.bytes.size(), file) == writer.bytes.size();
+    if (fclose(file) != 0 || !written || std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        throw std::runtime_error("Cannot write " + path);
+    }
+    return summary;
+}
+
+// A workspace file's bytes, mapped where the platform allows and read into
+// memory otherwise.
+class WorkspaceImage {
+public:
+    explicit WorkspaceImage(const std::string& path) {
+        FILE* file = fopen(path.c_str(), "rb");
+        if (!file)
+            throw std::runtime_error("Cannot open " + path);
+#ifdef CALC_HAVE_MMAP
+        struct stat info;
+        if (fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            mapped = std::make_unique<MappedFile>(fileno(file), static_cast<size_t>(info.st_size));
+            if (!mapped->data)
+                mapped.reset();
+        }
+#endif
+        if (!mapped) {
+            char chunk[1 << 16];
+            size_t got;
+            while ((got = fread(chunk, 1, sizeof(chunk), file)) > 0)
+                buffer.append(chunk, got);
+        }
+        fclose(file);
+    }
+
+    std::string_view bytes() const {
+#ifdef CALC_HAVE_MMAP
+        if (mapped)
+            return std::string_view(mapped->data, mapped->size);
+#endif
+        return buffer;
+    }
+
+private:
+#ifdef CALC_HAVE_MMAP
+    std::unique_ptr<MappedFile> mapped;
+#endif
+    std::string buffer;
+};
+
+// Replaces environment with the workspace in bytes. Everything is read and
+// checked before the environment is touched, so a bad file leaves it as it
+// was.
+WorkspaceSummary loadWorkspace(std::string_view bytes, Environment& environment) {
+    WorkspaceReader reader(bytes);
+    WorkspaceHeader header = reader.get<WorkspaceHeader>();
+    if (memcmp(header.magic, WORKSPACE_MAGIC, sizeof(header.magic)) != 0)
+        throw std::runtime_error("Not a workspace file!");
+    if (header.version != WORKSPACE_VERSION || header.instructionSize != sizeof(Instruction) ||
+        header.tokenSize != sizeof(Token))
+        throw std::runtime_error("Workspace file was written by an incompatible version!");
+    if (header.size != bytes.size())
+        WorkspaceReader::corrupt();
+
+    // Every record takes at least 8 bytes, which bounds the counts.
+    if (header.variableCount > bytes.size() / 8 || header.functionCount > 0xFFFF ||
+        header.bindingCount > header.variableCount || header.matrixCount > bytes.size() / 8)
+        WorkspaceReader::corrupt();
+
+    std::vector<std::string_view> names(header.variableCount);
+    std::vector<double> values(header.variableCount);
+    std::unordered_map<std::string_view, int> slots;
+    for (size_t slot = 0; slot < names.size(); slot++) {
+        names[slot] = reader.getString();
+        values[slot] = reader.get<double>();
+        if (names[slot].empty() || !slots.emplace(names[slot], static_cast<int>(slot)).second)
+            WorkspaceReader::corrupt();
+    }
+
+    std::vector<std::shared_ptr<const UserFunction>> functions;
+    functions.reserve(header.functionCount);
+    for (size_t i = 0; i < header.functionCount; i++) {
+        auto function = std::make_shared<UserFunction>();
+        function->name = std::string(reader.getString());
+        uint32_t paramCount = reader.get<uint32_t>();
+        uint32_t capturedCount = reader.get<uint32_t>();
+        function->inlined = reader.get<uint32_t>() != 0;
+        function->memoized = reader.get<uint32_t>() != 0;
+        if (paramCount > 0xFFFF || capturedCount > 0xFFFF)
+            WorkspaceReader::corrupt();
+        for (uint32_t p = 0; p < paramCount; p++)
+            function->params.emplace_back(reader.getString());
+        for (uint32_t c = 0; c < capturedCount; c++)
+            function->captured.emplace_back(reader.getString());
+        function->source = std::string(reader.getString());
+        function->postfix = reader.getArray<Token>();
+        function->body = reader.getProgram();
+        function->serial = nextFunctionSerial();
+        checkWorkspacePostfix(function->postfix, function->source, functions);
+        checkWorkspaceProgram(function->body, 0, function->argumentCount(), functions);
+#ifdef CALC_STATS
+        countFunctionCalls(function->body);
+#endif
+        functions.push_back(std::move(function));
+    }
+
+    // Bindings come in dependency order, so each one may only read bindings
+    // that came before it.
+    struct LoadedBinding {
+        int slot;
+        std::string_view expr;
+        CompiledExpression program;
+    };
+    std::vector<LoadedBinding> bindings(header.bindingCount);
+    std::vector<char> bound(names.size());
+    for (auto& binding : bindings) {
+        uint64_t slot = reader.get<uint64_t>();
+        binding.expr = reader.getString();
+        binding.program = reader.getProgram();
+        if (slot >= names.size() || bound[slot])
+            WorkspaceReader::corrupt();
+        binding.slot = static_cast<int>(slot);
+        checkWorkspaceProgram(binding.program, names.size(), 0, functions);
+#ifdef CALC_STATS
+        countFunctionCalls(binding.program);
+#endif
+        bound[slot] = 1;
+    }
+    std::vector<char> restored(names.size());
+    for (const auto& binding : bindings) {
+        for (const auto& ins : binding.program.code) {
+            if (ins.op == OP_VAR && (ins.index == binding.slot || (bound[ins.index] && !restored[ins.index])))
+                WorkspaceReader::corrupt();
+        }
+        restored[binding.slot] = 1;
+    }
+
+    // A name holds either a number or a matrix, never both.
+    std::vector<std::pair<std::string_view, std::shared_ptr<Matrix>>> matrices(header.matrixCount);
+    for (auto& entry : matrices) {
+        entry.first = reader.getString();
+        entry.second = reader.getMatrix();
+        if (entry.first.empty() || !slots.emplace(entry.first, -1).second)
+            WorkspaceReader::corrupt();
+    }
+
+    // Compiling a body consults the functions it calls in the active
+    // environment, which must be this one.
+    ActiveVariablesScope scope(environment);
+    environment.slots.clear();
+    environment.names.clear();
+    environment.values.clear();
+    environment.functions.clear();
+    environment.functionSlots.clear();
+    environment.functionNames.clear();
+    environment.bindings.reset();
+    environment.matrices.clear();
+    for (size_t slot = 0; slot < names.size(); slot++)
+        environment.set(names[slot], values[slot]);
+    for (auto& entry : matrices)
+        environment.matrices.emplace(entry.first, std::move(entry.second));
+    for (auto& function : functions) {
+#ifdef CALC_HAVE_JIT
+        if (!function->inlined)
+            function->body.jit = jitCompile(function->body);
+#endif
+        std::string_view name = function->name;
+        environment.addFunction(name, std::move(function));
+    }
+    if (!bindings.empty()) {
+        environment.bindings = std::make_shared<BindingGraph>(environment);
+        for (auto& binding : bindings)
+            environment.bindings->restore(binding.slot, std::string(binding.expr), std::move(binding.program));
+    }
+    // Compiled-expression caches hold slots of the old environment.
+    environment.functionGeneration++;
+
+    WorkspaceSummary summary;
+    summary.variables = names.size();
+    summary.functions = functions.size();
+    summary.bindings = bindings.size();
+    summary.matrices = matrices.size();
+    return summary;
+}
+
+WorkspaceSummary loadWorkspaceFile(const std::string& path, Environment& environment) {
+    WorkspaceImage image(path);
+    return loadWorkspace(image.bytes(), environment);
+}
+
+// Non-interactive mode: one expression per input line, one result per output
+// line, in input order. Usage: --batch [file] [--jobs N] [--workspace FILE]
+int runBatch(int argc, char* argv[]) {
+    const char* path = nullptr;
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if ((arg == "--jobs" || arg == "-j") && i + 1 < argc) {
+            jobs = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--workspace" && i + 1 < argc) {
+            try {
+                loadWorkspaceFile(argv[++i], variables);
+            } catch (const std::exception& e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+                return 1;
+            }
+        } else {
+            path = argv[i];
+        }
+    }
+
+    FILE* input = stdin;
+    if (path && std::string(path) != "-") {
+        input = fopen(path, "rb");
+        if (!input) {
+            std::cerr << "Error: cannot open " << path << std::endl;
+            return 1;
+        }
+    }
+
+    // Lines are processed in windows so memory stays bounded on huge inputs.
+    const size_t WINDOW = 1 << 16;
+    ThreadPool pool(jobs);
+    LineReader reader(input);
+    OutputBuffer out(stdout, 1 << 20);
+    std::vector<std::string> lines;
+    std::string_view line;
+    bool more = true;
+    while (more) {
+        lines.clear();
+        while (lines.size() < WINDOW && (more = reader.next(line)))
+            lines.emplace_back(line);
+        evaluateBatchWindow(lines, pool, out);
+    }
+    out.flush();
+
+    if (input != stdin)
+        fclose(input);
+#ifdef CALC_STATS
+    std::cerr << statsReport();
+#endif
+    return 0;
+}
+
+// Evaluates a file that holds one expression of any size. A regular file is
+// mapped, and pages are released as the evaluator moves past them, so
+// resident memory stays at about one piece plus the evaluator's stacks. Pipes
+// are read one piece at a time.
+double evaluateFile(FILE* file) {
+    const size_t PIECE = 4 << 20;
+    StreamingEvaluator evaluator;
+
+#ifdef CALC_HAVE_MMAP
+    struct stat info;
+    int fd = fileno(file);
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        MappedFile mapped(fd, static_cast<size_t>(info.st_size));
+        if (mapped.data) {
+            madvise(const_cast<char*>(mapped.data), mapped.size, MADV_SEQUENTIAL);
+            const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            size_t pos = 0, released = 0;
+            while (pos < mapped.size) {
+                std::string_view rest(mapped.data + pos, std::min(PIECE, mapped.size - pos));
+                size_t cut = pos + rest.size() == mapped.size ? rest.size() : tokenBoundary(rest);
+                if (cut == 0)
+                    throw std::runtime_error("Token too long!");
+                evaluator.feed(rest.substr(0, cut));
+                pos += cut;
+                size_t done = pos / page * page;
+                if (done > released) {
+                    madvise(const_cast<char*>(mapped.data) + released, done - released, MADV_DONTNEED);
+                    released = done;
+                }
+            }
+            return evaluator.finish();
+        }
+    }
+#endif
+
+    std::vector<char> buffer(PIECE);
+    size_t filled = 0;
+    bool atEnd = false;
+    while (!atEnd) {
+        size_t got = fread(buffer.data() + filled, 1, buffer.size() - filled, file);
+        filled += got;
+        atEnd = got == 0;
+        std::string_view text(buffer.data(), filled);
+        size_t cut = atEnd ? filled : tokenBoundary(text);
+        if (cut == 0) {
+            if (filled == buffer.size())
+                throw std::runtime_error("Token too long!");
+            continue;
+        }
+        evaluator.feed(text.substr(0, cut));
+        memmove(buffer.data(), buffer.data() + cut, filled - cut);
+        filled -= cut;
+    }
+    return evaluator.finish();
+}
+
+// Evaluates one expression stored in a file (or stdin for "-") and prints
+// the result. Usage: --eval-file FILE
+int runEvalFile(int argc, char* argv[]) {
+    if (argc != 3) {
+        std::cerr << "Usage: calculator --eval-file FILE" << std::endl;
+        return 1;
+    }
+
+    FILE* input = stdin;
+    if (std::string(argv[2]) != "-") {
+        input = fopen(argv[2], "rb");
+        if (!input) {
+            std::cerr << "Error: cannot open " << argv[2] << std::endl;
+            return 1;
+        }
+    }
+
+    int status = 0;
+    try {
+        std::string out;
+        appendNumber(out, evaluateFile(input));
+        out += '\n';
+        fwrite(out.data(), 1, out.size(), stdout);
+    } catch (const std::exception& e) {
+        CALC_STAT_ADD(exceptions, 1);
+        std::cerr << "Error: " << e.what() << std::endl;
+        status = 1;
+    }
+    if (input != stdin)
+        fclose(input);
+    return status;
+}
+
+// Evaluation server. Each request is one line: either a JSON object
+// {"id": ..., "expr": "..."} or a bare expression, and each response is one
+// JSON line: {"id": ..., "result": 3.5}, {"id": ..., "solution": "x = 2"} or
+// {"id": ..., "error": "..."}. The id, any JSON value, is echoed unchanged so
+// that clients can pipeline requests. Each connection is a session with its
+// own variables and compiled-expression cache.
+
+void appendJsonString(std::string& out, std::string_view text) {
+    out += '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+void skipJsonSpace(std::string_view text, size_t& i) {
+    while (i < text.size() && isspace(static_cast<unsigned char>(text[i])))
+        i++;
+}
+
+// Reads the string literal starting at text[i]. Escapes other than \uXXXX
+// for ASCII are taken literally, which is all an expression needs.
+bool readJsonString(std::string_view text, size_t& i, std::string& out) {
+    if (i >= text.size() || text[i] != '"')
+        return false;
+    out.clear();
+    for (i++; i < text.size(); i++) {
+        char c = text[i];
+        if (c == '"') {
+            i++;
+            return true;
+        }
+        if (c != '\\') {
+            out += c;
+            continue;
+        }
+        if (++i >= text.size())
+            return false;
+        switch (text[i]) {
+            case 'n': out += '\n'; break;
+            case 't': out += '\t'; break;
+            case 'r': out += '\r'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'u': {
+                unsigned code = 0;
+                if (i + 4 >= text.size() ||
+                    std::from_chars(text.data() + i + 1, text.data() + i + 5, code, 16).ptr != text.data() + i + 5)
+                    return false;
+                out += code < 0x80 ? static_cast<char>(code) : '?';
+                i += 4;
+                break;
+            }
+            default: out += text[i]; break;
+        }
+    }
+    return false;
+}
+
+// Skips one JSON value of any kind.
+bool skipJsonValue(std::string_view text, size_t& i) {
+    skipJsonSpace(text, i);
+    if (i >= text.size())
+        return false;
+    if (text[i] == '"') {
+        std::string ignored;
+        return readJsonString(text, i, ignored);
+    }
+    if (text[i] == '{' || text[i] == '[') {
+        int depth = 0;
+        while (i < text.size()) {
+            char c = text[i];
+            if (c == '"') {
+                std::string ignored;
+                if (!readJsonString(text, i, ignored))
+                    return false;
+                continue;
+            }
+            if (c == '{' || c == '[')
+                depth++;
+            else if ((c == '}' || c == ']') && --depth == 0) {
+                i++;
+                return true;
+            }
+            i++;
+        }
+        return false;
+    }
+    size_t start = i;
+    while (i < text.size() && text[i] != ',' && text[i] != '}' && !isspace(static_cast<unsigned char>(text[i])))
+        i++;
+    return i > start;
+}
+
+// Parses a request object. The id keeps its raw JSON text; other fields are
+// ignored.
+bool parseServerRequest(std::string_view line, std::string& expr, std::string_view& id) {
+    size_t i = 0;
+    skipJsonSpace(line, i);
+    if (i >= line.size() || line[i++] != '{')
+        return false;
+    bool haveExpr = false;
+    std::string key;
+    while (true) {
+        skipJsonSpace(line, i);
+        if (i < line.size() && line[i] == '}')
+            return haveExpr;
+        if (!readJsonString(line, i, key))
+            return false;
+        skipJsonSpace(line, i);
+        if (i >= line.size() || line[i++] != ':')
+            return false;
+        skipJsonSpace(line, i);
+        if (key == "expr") {
+            if (!readJsonString(line, i, expr))
+                return false;
+            haveExpr = true;
+        } else {
+            size_t start = i;
+            if (!skipJsonValue(line, i))
+                return false;
+            if (key == "id")
+                id = line.substr(start, i - start);
+        }
+        skipJsonSpace(line, i);
+        if (i < line.size() && line[i] == ',')
+            i++;
+        else if (i >= line.size() || line[i] != '}')
+            return false;
+    }
+}
+
+// The workspace every server session starts from, given with --workspace.
+std::unique_ptr<WorkspaceImage> serverWorkspace;
+
+// What one client owns: its variables, and the compiled expressions whose
+// slots refer to them.
+struct ServerSession {
+    Environment variables;
+    ExpressionCache cache{256};
+    bool started = false;  // has loaded serverWorkspace, if there is one
+};
+
+// Evaluates one request line against the session and appends the response
+// line. Blank lines get no response.
+void evaluateServerLine(ServerSession& session, std::string_view text, std::string& out) {
+    std::string_view line = trimView(text);
+    if (line.empty())
+        return;
+    if (!session.started) {
+        // runServe() already loaded the workspace once, so this cannot fail.
+        session.started = true;
+        if (serverWorkspace)
+            loadWorkspace(serverWorkspace->bytes(), session.variables);
+    }
+
+    thread_local std::string expr;
+    std::string_view id;
+    bool valid = true;
+    if (line[0] == '{')
+        valid = parseServerRequest(line, expr, id);
+    else
+        expr.assign(line);
+
+    out += '{';
+    if (!id.empty()) {
+        out += "\"id\": ";
+        out += id;
+        out += ", ";
+    }
+    auto fail = [&](std::string_view message) {
+        out += "\"error\": ";
+        appendJsonString(out, message);
+        out += "}\n";
+    };
+    if (!valid) {
+        fail("Invalid request");
+        return;
+    }
+
+    ActiveVariablesScope scope(session.variables);
+    try {
+        std::string_view exprView = trimView(expr);
+        std::string_view diffExpr, diffName;
+        FunctionDefinition definition;
+        double value = 0;
+        size_t eqPos = exprView.find('=');
+        std::string_view target = assignmentTarget(exprView);
+        std::string_view bound = bindingTarget(exprView);
+        IntegralReport report;
+        IntegralReportScope reportScope(&report);
+        if (parseDiffCall(exprView, diffExpr, diffName)) {
+            value = evaluateDerivative(diffExpr, diffName);
+        } else if (!bound.empty()) {
+            BindingUpdate update;
+            value = bindVariable(bound, exprView.substr(exprView.find(":=") + 2), update);
+        } else if (parseFunctionDefinition(exprView, definition)) {
+            std::string signature = defineFunction(definition);
+            out += "\"defined\": ";
+            appendJsonString(out, signature);
+            out += "}\n";
+            return;
+        } else if (isMatrixLine(exprView)) {
+            MatrixValue matrixValue;
+            BindingUpdate update;
+            evaluateMatrixLine(exprView, matrixValue, update);
+            value = matrixValue.scalar;
+            if (const Matrix* m = matrixValue.matrix.get()) {
+                if (m->size() > MATRIX_PRINT_LIMIT) {
+                    out += "\"shape\": [" + std::to_string(m->rows) + ", " + std::to_string(m->cols) + "]}\n";
+                } else if (!std::all_of(m->data(), m->data() + m->size(), [](double x) { return std::isfinite(x); })) {
+                    fail("Result is not a real number!");
+                } else {
+                    out += "\"result\": ";
+                    appendMatrix(out, *m, appendShortest);
+                    out += "}\n";
+                }
+                return;
+            }
+        } else if (eqPos != std::string_view::npos && target.empty()) {
+            out += "\"solution\": ";
+            appendJsonString(out, solveEquation(std::string(exprView)));
+            out += "}\n";
+            return;
+        } else {
+            std::string_view body = eqPos == std::string_view::npos ? exprView : exprView.substr(eqPos + 1);
+            EvalStatus status = runProgram(session.cache.get(body), value);
+            if (status != EVAL_OK) {
+                fail(evalErrorMessage(status));
+                return;
+            }
+            if (!target.empty())
+                assignVariable(target, value);
+        }
+        if (std::isnan(value)) {
+            fail("Result is not a real number!");
+        } else if (std::isinf(value)) {
+            fail("Result is infinite!");
+        } else {
+            out += "\"result\": ";
+            appendShortest(out, value);
+            if (isIntegralLine(exprView)) {
+                out += ", \"error_estimate\": ";
+                appendShortest(out, report.error);
+            }
+            if (!report.converged)
+                out += ", \"converged\": false";
+            out += "}\n";
+        }
+    } catch (const std::invalid_argument&) {
+        CALC_STAT_ADD(exceptions, 1);
+        fail("Invalid number format");
+    } catch (const std::out_of_range&) {
+        CALC_STAT_ADD(exceptions, 1);
+        fail("Number too large");
+    } catch (const std::exception& e) {
+        CALC_STAT_ADD(exceptions, 1);
+        fail(e.what());
+    }
+}
+
+// Evaluates every complete line of input and appends the responses. Returns
+// how many bytes were consumed; a trailing partial line is left for later.
+size_t evaluateServerLines(ServerSession& session, std::string_view input, std::string& out) {
+    size_t consumed = 0;
+    for (size_t end; (end = input.find('\n', consumed)) != std::string_view::npos; consumed = end + 1)
+        evaluateServerLine(session, input.substr(consumed, end - consumed), out);
+    return consumed;
+}
+
+// One session over stdin and stdout. Responses are flushed whenever no more
+// input is buffered, so a client that waits for each answer is not stalled.
+int serveStdio() {
+    std::ios::sync_with_stdio(false);
+    ServerSession session;
+    std::string line, out;
+    while (true) {
+        {
+            CALC_STAT_STAGE(STAGE_IO);
+            if (!std::getline(std::cin, line))
+                break;
+        }
+        evaluateServerLine(session, line, out);
+        if (std::cin.rdbuf()->in_avail() <= 0 || out.size() > (1 << 16)) {
+            CALC_STAT_STAGE(STAGE_IO);
+            std::cout << out << std::flush;
+            out.clear();
+        }
+    }
+    std::cout << out << std::flush;
+    return 0;
+}
+
+#ifdef CALC_HAVE_EPOLL
+volatile sig_atomic_t serverStopping = 0;
+
+// A client socket. Bytes are appended by the event loop; a worker takes
+// every complete line at once, evaluates them in order and writes the
+// responses, so pipelined requests are answered in order and a session is
+// only ever touched by one thread at a time. The socket is closed when the
+// last owner lets go, so a worker can finish answering after the client
+// stops sending.
+struct ServerConnection {
+    explicit ServerConnection(int fd) : fd(fd) {}
+    ~ServerConnection() { close(fd); }
+
+    int fd;
+    std::mutex mutex;
+    std::string input;        // received but not yet taken by a worker
+    bool scheduled = false;   // queued, or being served by a worker
+    ServerSession session;
+};
+
+// Unix domain socket server: one thread runs an epoll loop that accepts
+// clients and reads their requests, and a fixed set of workers evaluates
+// them. A connection with requests waiting is queued once; its worker
+// re-queues it after each batch, so busy clients take turns.
+class EvaluationServer {
+public:
+    explicit EvaluationServer(unsigned jobs) {
+        for (unsigned i = 0; i < jobs; i++)
+            workers.emplace_back([this] { workerLoop(); });
+    }
+
+    ~EvaluationServer() {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    int run(const char* path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(address.sun_path)) {
+            std::cerr << "Error: socket path too long: " << path << std::endl;
+            return 1;
+        }
+        strcpy(address.sun_path, path);
+
+        // Replace a socket left behind by an earlier run, but nothing else.
+        struct stat info;
+        if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+            unlink(path);
+
+        int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(listener, SOMAXCONN) != 0) {
+            std::cerr << "Error: cannot listen on " << path << ": " << strerror(errno) << std::endl;
+            if (listener >= 0)
+                close(listener);
+            return 1;
+        }
+        int poller = epoll_create1(EPOLL_CLOEXEC);
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = listener;
+        epoll_ctl(poller, EPOLL_CTL_ADD, listener, &event);
+
+        struct sigaction action{};
+        action.sa_handler = [](int) { serverStopping = 1; };
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+
+        std::unordered_map<int, std::shared_ptr<ServerConnection>> connections;
+        std::vector<epoll_event> events(256);
+        std::vector<char> buffer(1 << 16);
+        while (!serverStopping) {
+            int ready = epoll_wait(poller, events.data(), static_cast<int>(events.size()), -1);
+            if (ready < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            for (int e = 0; e < ready; e++) {
+                int fd = events[e].data.fd;
+                if (fd == listener) {
+                    int client;
+                    while ((client = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                        event.events = EPOLLIN | EPOLLRDHUP;
+                        event.data.fd = client;
+                        epoll_ctl(poller, EPOLL_CTL_ADD, client, &event);
+                        connections.emplace(client, std::make_shared<ServerConnection>(client));
+                    }
+                    continue;
+                }
+
+                auto it = connections.find(fd);
+                if (it == connections.end())
+                    continue;
+                std::shared_ptr<ServerConnection> connection = it->second;
+                bool closed = false;
+                {
+                    CALC_STAT_STAGE(STAGE_IO);
+                    while (true) {
+                        ssize_t n = read(fd, buffer.data(), buffer.size());
+                        if (n > 0) {
+                            std::lock_guard<std::mutex> lock(connection->mutex);
+                            connection->input.append(buffer.data(), static_cast<size_t>(n));
+                            continue;
+                        }
+                        if (n < 0 && errno == EINTR)
+                            continue;
+                        closed = n == 0 || errno != EAGAIN;
+                        break;
+                    }
+                }
+
+                bool queue = false;
+                {
+                    std::lock_guard<std::mutex> lock(connection->mutex);
+                    // A last request without a newline still gets its answer.
+                    if (closed && !connection->input.empty() && connection->input.back() != '\n')
+                        connection->input += '\n';
+                    if (!connection->scheduled && connection->input.find('\n') != std::string::npos)
+                        queue = connection->scheduled = true;
+                }
+                if (queue)
+                    schedule(connection);
+                if (closed) {
+                    epoll_ctl(poller, EPOLL_CTL_DEL, fd, nullptr);
+                    connections.erase(it);
+                }
+            }
+        }
+
+        close(poller);
+        close(listener);
+        unlink(path);
+        return 0;
+    }
+
+private:
+    void schedule(std::shared_ptr<ServerConnection> connection) {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            queue.push_back(std::move(connection));
+        }
+        wake.notify_one();
+    }
+
+    void workerLoop() {
+        std::string input, out;
+        while (true) {
+            std::shared_ptr<ServerConnection> connection;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                wake.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (stopping)
+                    return;
+                connection = std::move(queue.front());
+                queue.pop_front();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(connection->mutex);
+                size_t end = connection->input.rfind('\n') + 1;
+                input.assign(connection->input, 0, end);
+                connection->input.erase(0, end);
+            }
+            out.clear();
+            evaluateServerLines(connection->session, input, out);
+            sendAll(connection->fd, out);
+
+            bool again;
+            {
+                std::lock_guard<std::mutex> lock(connection->mutex);
+                again = connection->scheduled = connection->input.find('\n') != std::string::npos;
+            }
+            if (again)
+                schedule(std::move(connection));
+        }
+    }
+
+    // Writes everything, waiting while the client's socket buffer is full. A
+    // client that stops reading for a minute is given up on.
+    static void sendAll(int fd, const std::string& data) {
+        CALC_STAT_STAGE(STAGE_IO);
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                sent += static_cast<size_t>(n);
+            } else if (n < 0 && errno == EAGAIN) {
+                pollfd waiting{fd, POLLOUT, 0};
+                if (poll(&waiting, 1, 60000) <= 0)
+                    return;
+            } else if (!(n < 0 && errno == EINTR)) {
+                return;
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex queueMutex;
+    std::condition_variable wake;
+    std::deque<std::shared_ptr<ServerConnection>> queue;
+    bool stopping = false;
+};
+#endif
+
+// Usage: --serve PATH [--jobs N] listens on a Unix domain socket;
+// --serve - answers requests from stdin on stdout.
+int runServe(int argc, char* argv[]) {
+    const char* path = nullptr;
+    const char* workspace = nullptr;
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if ((arg == "--jobs" || arg == "-j") && i + 1 < argc)
+            jobs = std::max(1, atoi(argv[++i]));
+        else if (arg == "--workspace" && i + 1 < argc)
+            workspace = argv[++i];
+        else
+            path = argv[i];
+    }
+    if (!path) {
+        std::cerr << "Usage: calculator --serve PATH|- [--jobs N] [--workspace FILE]" << std::endl;
+        return 1;
+    }
+    if (workspace) {
+        try {
+            serverWorkspace = std::make_unique<WorkspaceImage>(workspace);
+            Environment check;
+            loadWorkspace(serverWorkspace->bytes(), check);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    if (std::string(path) == "-")
+        return serveStdio();
+#ifdef CALC_HAVE_EPOLL
+    EvaluationServer server(jobs);
+    int status = server.run(path);
+#ifdef CALC_STATS
+    std::cerr << statsReport();
+#endif
+    return status;
+#else
+    std::cerr << "Error: socket serving needs Linux; use --serve - for stdin and stdout" << std::endl;
+    return 1;
+#endif
+}
+
+// Column kernels: each one applies an operation to a whole block of rows.
+// On x86-64 the AVX2 versions are picked at runtime when the CPU has them.
+#ifdef CALC_HAVE_AVX2_KERNELS
+__attribute__((target("avx2")))
+void binaryColumnsAvx2(char op, double* a, const double* b, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        __m256d y = _mm256_loadu_pd(b + i);
+        switch (op) {
+            case '+': x = _mm256_add_pd(x, y); break;
+            case '-': x = _mm256_sub_pd(x, y); break;
+            case '*': x = _mm256_mul_pd(x, y); break;
+            case '/': x = _mm256_div_pd(x, y); break;
+        }
+        _mm256_storeu_pd(a + i, x);
+    }
+    for (; i < n; i++) {
+        switch (op) {
+            case '+': a[i] = a[i] + b[i]; break;
+            case '-': a[i] = a[i] - b[i]; break;
+            case '*': a[i] = a[i] * b[i]; break;
+            case '/': a[i] = a[i] / b[i]; break;
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+void sqrtColumnAvx2(double* a, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(a + i, _mm256_sqrt_pd(_mm256_loadu_pd(a + i)));
+    for (; i < n; i++)
+        a[i] = sqrt(a[i]);
+}
+
+__attribute__((target("avx2")))
+void absColumnAvx2(double* a, size_t n) {
+    const __m256d signBit = _mm256_set1_pd(-0.0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(a + i, _mm256_andnot_pd(signBit, _mm256_loadu_pd(a + i)));
+    for (; i < n; i++)
+        a[i] = std::abs(a[i]);
+}
+
+bool cpuHasAvx2() {
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+}
+
+bool cpuHasFma() {
+    static const bool has = __builtin_cpu_supports("fma");
+    return has;
+}
+#endif
+
+void binaryColumns(char op, double* a, const double* b, size_t n) {
+#ifdef CALC_HAVE_AVX2_KERNELS
+    if (cpuHasAvx2() && op != '^') {
+        binaryColumnsAvx2(op, a, b, n);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; i++) {
+        switch (op) {
+            case '+': a[i] = a[i] + b[i]; break;
+            case '-': a[i] = a[i] - b[i]; break;
+            case '*': a[i] = a[i] * b[i]; break;
+            case '/': a[i] = a[i] / b[i]; break;
+            case '^': a[i] = std::pow(a[i], b[i]); break;
+        }
+    }
+}
+
+void functionColumn(int function, double* a, size_t n) {
+#ifdef CALC_HAVE_AVX2_KERNELS
+    const char* name = builtinFunctions[function].name;
+    if (cpuHasAvx2() && strcmp(name, "sqrt") == 0) {
+        sqrtColumnAvx2(a, n);
+        return;
+    }
+    if (cpuHasAvx2() && strcmp(name, "abs") == 0) {
+        absColumnAvx2(a, n);
+        return;
+    }
+#endif
+    double (*fn)(double) = builtinFunctions[function].fn;
+    for (size_t i = 0; i < n; i++)
+        a[i] = fn(a[i]);
+}
+
+// Input for column evaluation, one per variable slot: a column of values, or a
+// scalar for variables that are not columns.
+struct ColumnBinding {
+    const double* column = nullptr;
+    double scalar = 0;
+};
+
+const size_t COLUMN_BLOCK = 256;
+
+// Runs a compiled program over rows [0, rows) of its variable columns. The
+// program's stack slots become registers holding COLUMN_BLOCK rows each, so
+// every instruction is dispatched once per block instead of once per row.
+// Rows that fail get the EvalStatus runProgram would report in errors[row].
+void evaluateColumns(const CompiledExpression& program, const std::vector<ColumnBinding>& bindings,
+                     size_t rows, double* out, unsigned char* errors) {
+    CALC_STAT_STAGE(STAGE_EVALUATE);
+    CALC_STAT_EVALUATIONS(program, rows);
+    std::vector<double> registers(std::max<size_t>(program.maxDepth, 1) * COLUMN_BLOCK);
+    std::vector<double> temps(program.tempCount * COLUMN_BLOCK);
+    std::vector<double> args;
+
+    for (size_t first = 0; first < rows; first += COLUMN_BLOCK) {
+        size_t n = std::min(COLUMN_BLOCK, rows - first);
+        std::fill(errors + first, errors + first + n, 0);
+        double* top = registers.data() - COLUMN_BLOCK;
+
+        for (const auto& ins : program.code) {
+            switch (ins.op) {
+                case OP_CONST:
+                    top += COLUMN_BLOCK;
+                    std::fill(top, top + n, ins.value);
+                    break;
+                case OP_VAR: {
+                    top += COLUMN_BLOCK;
+                    const ColumnBinding& binding = bindings[ins.index];
+                    if (binding.column)
+                        std::copy(binding.column + first, binding.column + first + n, top);
+                    else
+                        std::fill(top, top + n, binding.scalar);
+                    break;
+                }
+                case OP_ADD:
+                case OP_SUB:
+                case OP_MUL:
+                case OP_DIV:
+                case OP_POW: {
+                    static const char ops[] = {'+', '-', '*', '/', '^'};
+                    char op = ops[ins.op - OP_ADD];
+                    if (op == '/') {
+                        for (size_t i = 0; i < n; i++) {
+                            if (top[i] == 0)
+                                errors[first + i] = EVAL_DIVIDE_BY_ZERO;
+                        }
+                    }
+                    binaryColumns(op, top - COLUMN_BLOCK, top, n);
+                    top -= COLUMN_BLOCK;
+                    break;
+                }
+                case OP_FUNC:
+                    functionColumn(ins.index, top, n);
+                    break;
+                case OP_FUNC2: {
+                    double (*fn)(double, double) = binaryFunctions[ins.index].fn;
+                    double* left = top - COLUMN_BLOCK;
+                    for (size_t i = 0; i < n; i++)
+                        left[i] = fn(left[i], top[i]);
+                    top = left;
+                    break;
+                }
+                case OP_CALL: {
+                    // Calls go row by row; the arguments of a row are gathered
+                    // from the registers and the result replaces the first one.
+                    const UserFunction& function = userFunction(ins.index);
+                    size_t count = function.argumentCount();
+                    top -= (count - 1) * COLUMN_BLOCK;
+                    args.resize(count);
+                    for (size_t i = 0; i < n; i++) {
+                        for (size_t k = 0; k < count; k++)
+                            args[k] = top[k * COLUMN_BLOCK + i];
+                        EvalStatus status = callUserFunction(function, args.data(), top[i]);
+                        if (status != EVAL_OK) {
+                            errors[first + i] = static_cast<unsigned char>(status);
+                            top[i] = NAN;
+                        }
+                    }
+                    break;
+                }
+                case OP_REDUCE: {
+                    const Reduction& reduction = *program.reductions[ins.index];
+                    size_t count = reduction.argumentCount();
+                    top -= (count - 1) * COLUMN_BLOCK;
+                    args.resize(count);
+                    for (size_t i = 0; i < n; i++) {
+                        for (size_t k = 0; k < count; k++)
+                            args[k] = top[k * COLUMN_BLOCK + i];
+                        EvalStatus status = runReduction(reduction, args.data(), top[i]);
+                        if (status != EVAL_OK) {
+                            errors[first + i] = static_cast<unsigned char>(status);
+                            top[i] = NAN;
+                        }
+                    }
+                    break;
+                }
+                case OP_ARG:
+                case OP_LIST:
+                    break;
+                case OP_STORE:
+                    std::copy(top, top + n, temps.data() + ins.index * COLUMN_BLOCK);
+                    break;
+                case OP_LOAD:
+                    top += COLUMN_BLOCK;
+                    std::copy(temps.data() + ins.index * COLUMN_BLOCK, temps.data() + (ins.index + 1) * COLUMN_BLOCK, top);
+                    break;
+            }
+        }
+        std::copy(top, top + n, out + first);
+    }
+}
+
+// Adds x to sum, carrying the rounding error in compensation (Neumaier).
+inline void addCompensated(double& sum, double& compensation, double x) {
+    double t = sum + x;
+    compensation += std::abs(sum) >= std::abs(x) ? (sum - t) + x : (x - t) + sum;
+    sum = t;
+}
+
+// The running value of a reduction over some rows. Sums keep four
+// compensated lanes, so that consecutive additions do not wait on each
+// other. Products keep a separate binary exponent, so a long product does
+// not overflow or underflow on the way to a representable result.
+struct ReductionState {
+    ReductionKind kind = REDUCE_SUM;
+    double lanes[4] = {0, 0, 0, 0};
+    double carries[4] = {0, 0, 0, 0};
+    double mantissa = 1;
+    int64_t exponent = 0;
+    double extreme = NAN;          // fmin and fmax skip NaN, so this starts out empty
+    EvalStatus status = EVAL_OK;   // that of the first row that failed
+
+    void add(const double* values, size_t n) {
+        switch (kind) {
+            case REDUCE_SUM:
+                for (size_t i = 0; i < n; i++)
+                    addCompensated(lanes[i % 4], carries[i % 4], values[i]);
+                break;
+            case REDUCE_PROD:
+                for (size_t i = 0; i < n; i++) {
+                    mantissa *= values[i];
+                    if (!(std::abs(mantissa) >= 0x1p-256 && std::abs(mantissa) <= 0x1p256))
+                        normalize();
+                }
+                break;
+            case REDUCE_MIN:
+                for (size_t i = 0; i < n; i++)
+                    extreme = std::fmin(extreme, values[i]);
+                break;
+            case REDUCE_MAX:
+                for (size_t i = 0; i < n; i++)
+                    extreme = std::fmax(extreme, values[i]);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void merge(const ReductionState& other) {
+        if (status == EVAL_OK)
+            status = other.status;
+        for (int l = 0; l < 4; l++) {
+            addCompensated(lanes[l], carries[l], other.lanes[l]);
+            carries[l] += other.carries[l];
+        }
+        mantissa *= other.mantissa;
+        exponent += other.exponent;
+        normalize();
+        extreme = kind == REDUCE_MIN ? std::fmin(extreme, other.extreme) : std::fmax(extreme, other.extreme);
+    }
+
+    double result() const {
+        if (kind == REDUCE_SUM) {
+            double sum = 0, compensation = 0;
+            for (int l = 0; l < 4; l++) {
+                addCompensated(sum, compensation, lanes[l]);
+                compensation += carries[l];
+            }
+            // An infinite sum leaves NaN in the compensation.
+            return std::isfinite(sum) ? sum + compensation : sum;
+        }
+        if (kind == REDUCE_PROD)
+            return std::ldexp(mantissa, static_cast<int>(std::max<int64_t>(-100000, std::min<int64_t>(exponent, 100000))));
+        return extreme;
+    }
+
+private:
+    void normalize() {
+        if (!std::isfinite(mantissa) || mantissa == 0)
+            return;
+        int e;
+        mantissa = std::frexp(mantissa, &e);
+        exponent += e;
+    }
+};
+
+// Evaluates program on rows [0, rows) of its column bindings and reduces
+// the results. With indexSlot set, that variable instead takes the values
+// from, from + 1, ... by row. Rows are reduced in fixed chunks, each one in
+// order, and the chunks are merged in order, so the result is the same
+// whatever the number of threads that shared the work.
+EvalStatus reduceRows(const CompiledExpression& program, const std::vector<ColumnBinding>& bindings, uint64_t rows,
+                      ReductionKind kind, double& result, int indexSlot = -1, double from = 0) {
+    const size_t BLOCK = 16 * COLUMN_BLOCK;
+    const uint64_t CHUNK = 16 * BLOCK;
+    uint64_t chunks = (rows + CHUNK - 1) / CHUNK;
+    if (chunks > SIZE_MAX / sizeof(ReductionState))
+        return EVAL_RANGE_TOO_LARGE;
+    std::vector<ReductionState> states(static_cast<size_t>(chunks));
+    Environment* environment = activeVariables;
+    IntegralReport* report = integralReport;
+
+    sharedParallelFor(states.size(), [&](size_t c) {
+        // Called functions are looked up in the caller's environment.
+        ActiveVariablesScope scope(*environment);
+        IntegralReportScope reportScope(report);
+        // A reduction in the program comes back here on the same thread, so
+        // every level of nesting gets buffers of its own.
+        struct Buffers {
+            std::vector<double> results, index;
+            std::vector<unsigned char> errors;
+        };
+        thread_local std::deque<Buffers> levels;
+        thread_local size_t level = 0;
+        if (levels.size() <= level)
+            levels.emplace_back();
+        struct Nesting {
+            Nesting() { level++; }
+            ~Nesting() { level--; }
+        } nesting;
+        Buffers& buffers = levels[level - 1];
+        std::vector<double>& results = buffers.results;
+        std::vector<double>& index = buffers.index;
+        std::vector<unsigned char>& errors = buffers.errors;
+        results.resize(BLOCK);
+        errors.resize(BLOCK);
+        index.resize(BLOCK);
+        std::vector<ColumnBinding> block = bindings;
+        ReductionState& state = states[c];
+        state.kind = kind;
+        uint64_t end = std::min(rows, (c + 1) * CHUNK);
+        for (uint64_t first = c * CHUNK; first < end; first += BLOCK) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(BLOCK, end - first));
+            for (size_t slot = 0; slot < block.size(); slot++) {
+                if (bindings[slot].column)
+                    block[slot].column = bindings[slot].column + first;
+            }
+            if (indexSlot >= 0) {
+                for (size_t i = 0; i < n; i++)
+                    index[i] = from + static_cast<double>(first + i);
+                block[indexSlot].column = index.data();
+            }
+            evaluateColumns(program, block, n, results.data(), errors.data());
+            for (size_t i = 0; i < n && state.status == EVAL_OK; i++)
+                state.status = static_cast<EvalStatus>(errors[i]);
+            state.add(results.data(), n);
+        }
+    });
+
+    ReductionState total;
+    total.kind = kind;
+    for (const auto& state : states)
+        total.merge(state);
+    if (total.status == EVAL_OK)
+        result = total.result();
+    return total.status;
+}
+
+EvalStatus runIntegral(const Reduction& reduction, const double* args, double& value);
+
+// Evaluates a reduction node. args holds the range, then the values of the
+// names its body captured.
+EvalStatus runReduction(const Reduction& reduction, const double* args, double& result) {
+    if (isIntegral(reduction.kind))
+        return runIntegral(reduction, args, result);
+    uint64_t count = 0;
+    EvalStatus status = reductionCount(reduction.kind, args[0], args[1], count);
+    if (status != EVAL_OK)
+        return status;
+    if (count == 0) {
+        result = reduction.kind == REDUCE_SUM ? 0 : 1;
+        return EVAL_OK;
+    }
+    std::vector<ColumnBinding> bindings(reduction.argumentCount() - 1);
+    for (size_t i = 0; i < reduction.captured.size(); i++)
+        bindings[1 + i].scalar = args[reduction.operandCount() + i];
+    return reduceRows(reduction.body, bindings, count, reduction.kind, result, 0, args[0]);
+}
+
+// The 15-point Gauss-Kronrod rule and its embedded 7-point Gauss rule, with
+// QUADPACK's constants. Nodes on (0, 1] run from the outside in; the odd
+// ones are the Gauss nodes. The last entry is the center.
+const double kronrodNodes[8] = {0.991455371120812639206854697526329, 0.949107912342758524526189684047851,
+                                0.864864423359769072789712788640926, 0.741531185599394439863864773280788,
+                                0.586087235467691130294144845693013, 0.405845151377397166906606412076961,
+                                0.207784955007898467600689403773245, 0.0};
+const double kronrodWeights[8] = {0.022935322010529224963732008058970, 0.063092092629978553290700663189204,
+                                  0.104790010322250183839876322541518, 0.140653259715525918745189590510238,
+                                  0.169004726639267902826583426598550, 0.190350578064785409913256402421014,
+                                  0.204432940075298892414161999234649, 0.209482141084727828012999174891714};
+const double gaussWeights[4] = {0.129484966168869693270611432679082, 0.279705391489276667901467771423780,
+                                0.381830050505118944950369775488975, 0.417959183673469387755102040816327};
+const size_t KRONROD_POINTS = 15;
+
+struct QuadratureInterval {
+    double from, to;
+    double value = 0;
+    double error = 0;
+    double slope = 0;      // the integral of the integrand's derivative, when one is tracked
+    bool settled = false;  // the error is at the rounding floor; halving cannot help
+};
+
+struct IntegralResult {
+    double value = 0;
+    double error = 0;       // estimated absolute error
+    double derivative = 0;  // see integrateAdaptive()
+    size_t intervals = 0;   // subintervals in the final partition
+    bool converged = false;
+};
+
+// Where the rule samples interval i: the left half of the nodes, the center,
+// then the right half.
+double kronrodPoint(const QuadratureInterval& interval, size_t i) {
+    double center = 0.5 * interval.from + 0.5 * interval.to, half = 0.5 * interval.to - 0.5 * interval.from;
+    if (i < 7)
+        return center - half * kronrodNodes[i];
+    if (i == 7)
+        return center;
+    return center + half * kronrodNodes[14 - i];
+}
+
+// Applies the rule to values f at the interval's points, estimating the
+// error from the Gauss-Kronrod difference as QUADPACK's qk15 does.
+void applyKronrod(QuadratureInterval& interval, const double* f) {
+    double half = 0.5 * interval.to - 0.5 * interval.from;
+    double center = f[7];
+    double gauss = center * gaussWeights[3], kronrod = center * kronrodWeights[7];
+    double absolute = std::abs(kronrod);
+    for (size_t j = 0; j < 7; j++) {
+        double pair = f[j] + f[14 - j];
+        kronrod += kronrodWeights[j] * pair;
+        absolute += kronrodWeights[j] * (std::abs(f[j]) + std::abs(f[14 - j]));
+        if (j % 2)
+            gauss += gaussWeights[j / 2] * pair;
+    }
+    double mean = 0.5 * kronrod;
+    double spread = kronrodWeights[7] * std::abs(center - mean);
+    for (size_t j = 0; j < 7; j++)
+        spread += kronrodWeights[j] * (std::abs(f[j] - mean) + std::abs(f[14 - j] - mean));
+
+    const double EPSILON = std::numeric_limits<double>::epsilon();
+    interval.value = kronrod * half;
+    absolute *= std::abs(half);
+    spread *= std::abs(half);
+    double error = std::abs((kronrod - gauss) * half);
+    if (spread != 0 && error != 0)
+        error = spread * std::min(1.0, std::pow(200 * error / spread, 1.5));
+    double floor = 50 * EPSILON * absolute;
+    interval.settled = error <= floor;
+    interval.error = std::max(error, floor);
+}
+
+// Evaluates program at every point of xs, with the variable in slot taking
+// the point's value, and stores the results in ys. The points are shared
+// out over the pool in blocks.
+EvalStatus evaluateAtPoints(const CompiledExpression& program, const std::vector<ColumnBinding>& bindings, int slot,
+                            const std::vector<double>& xs, std::vector<double>& ys) {
+    const size_t BLOCK = 16 * COLUMN_BLOCK;
+    ys.resize(xs.size());
+    std::vector<unsigned char> errors(xs.size());
+    Environment* environment = activeVariables;
+    IntegralReport* report = integralReport;
+    sharedParallelFor((xs.size() + BLOCK - 1) / BLOCK, [&](size_t b) {
+        ActiveVariablesScope scope(*environment);
+        IntegralReportScope reportScope(report);
+        std::vector<ColumnBinding> block = bindings;
+        size_t first = b * BLOCK, n = std::min(BLOCK, xs.size() - first);
+        block[slot].column = xs.data() + first;
+        evaluateColumns(program, block, n, ys.data() + first, errors.data() + first);
+    });
+    for (unsigned char error : errors) {
+        if (error)
+            return static_cast<EvalStatus>(error);
+    }
+    return EVAL_OK;
+}
+
+const double DEFAULT_TOLERANCE = 1e-10;
+
+// Integrates from `from` to `to` by adaptive 15-point Gauss-Kronrod
+// quadrature. Each round halves the intervals whose error is above their
+// share of the target and applies the rule to all the halves in one batch
+// of points. evaluate(xs, ys, slopes) fills ys with the integrand at xs, and
+// slopes with its derivative when it tracks one; the integral of slopes
+// over the final partition becomes result.derivative. The totals are summed
+// in interval order, so the result does not depend on the number of threads.
+template <typename Evaluate>
+EvalStatus integrateAdaptive(double from, double to, double tolerance, Evaluate&& evaluate, IntegralResult& result) {
+    const size_t MAX_INTERVALS = 1 << 17;
+    const size_t MAX_SPLITS = 1024;  // intervals halved in one round
+    if (!std::isfinite(from) || !std::isfinite(to))
+        return EVAL_INFINITE_RANGE;
+    if (!std::isfinite(to - from))
+        return EVAL_RANGE_TOO_LARGE;
+    if (!(tolerance > 0))
+        return EVAL_BAD_TOLERANCE;
+
+    result = IntegralResult();
+    if (from == to) {
+        result.converged = true;
+        return EVAL_OK;
+    }
+    double sign = 1;
+    if (to < from) {
+        std::swap(from, to);
+        sign = -1;
+    }
+
+    std::vector<QuadratureInterval> intervals{{from, to}};
+    std::vector<size_t> pending{0}, split;
+    std::vector<double> xs, ys, slopes;
+    for (;;) {
+        xs.resize(pending.size() * KRONROD_POINTS);
+        for (size_t p = 0; p < pending.size(); p++) {
+            for (size_t i = 0; i < KRONROD_POINTS; i++)
+                xs[p * KRONROD_POINTS + i] = kronrodPoint(intervals[pending[p]], i);
+        }
+        EvalStatus status = evaluate(xs, ys, slopes);
+        if (status != EVAL_OK)
+            return status;
+        for (double y : ys) {
+            if (!std::isfinite(y))
+                return EVAL_INTEGRAND_NOT_FINITE;
+        }
+        for (size_t p = 0; p < pending.size(); p++) {
+            QuadratureInterval& interval = intervals[pending[p]];
+            applyKronrod(interval, ys.data() + p * KRONROD_POINTS);
+            if (!slopes.empty()) {
+                QuadratureInterval derivative = interval;
+                applyKronrod(derivative, slopes.data() + p * KRONROD_POINTS);
+                interval.slope = derivative.value;
+            }
+        }
+
+        double value = 0, valueCompensation = 0, error = 0, errorCompensation = 0;
+        double slope = 0, slopeCompensation = 0;
+        for (const auto& interval : intervals) {
+            addCompensated(value, valueCompensation, interval.value);
+            addCompensated(error, errorCompensation, interval.error);
+            addCompensated(slope, slopeCompensation, interval.slope);
+        }
+        result.value = sign * (value + valueCompensation);
+        result.error = error + errorCompensation;
+        result.derivative = sign * (slope + slopeCompensation);
+        result.intervals = intervals.size();
+        if (!std::isfinite(result.value) || !std::isfinite(result.error))
+            return EVAL_INFINITE_RESULT;
+        double target = tolerance * std::max(1.0, std::abs(result.value));
+        if (result.error <= target) {
+            result.converged = true;
+            break;
+        }
+        if (intervals.size() >= MAX_INTERVALS)
+            break;
+
+        // Halve the intervals above an even share of the target, worst first
+        // and up to the round's limit, or the worst one if none is above.
+        double share = target / intervals.size();
+        size_t worst = SIZE_MAX;
+        split.clear();
+        for (size_t i = 0; i < intervals.size(); i++) {
+            const QuadratureInterval& interval = intervals[i];
+            double middle = 0.5 * interval.from + 0.5 * interval.to;
+            if (interval.settled || !(middle > interval.from && middle < interval.to))
+                continue;
+            if (interval.error > share)
+                split.push_back(i);
+            if (worst == SIZE_MAX || interval.error > intervals[worst].error)
+                worst = i;
+        }
+        if (worst == SIZE_MAX)
+            break;
+        if (split.empty())
+            split.push_back(worst);
+        size_t limit = std::min(MAX_SPLITS, MAX_INTERVALS - intervals.size());
+        if (split.size() > limit) {
+            auto worse = [&](size_t l, size_t r) {
+                return intervals[l].error > intervals[r].error || (intervals[l].error == intervals[r].error && l < r);
+            };
+            std::nth_element(split.begin(), split.begin() + limit, split.end(), worse);
+            split.resize(limit);
+            std::sort(split.begin(), split.end());
+        }
+        pending.clear();
+        for (size_t i : split) {
+            double middle = 0.5 * intervals[i].from + 0.5 * intervals[i].to;
+            intervals.push_back({middle, intervals[i].to});
+            intervals[i].to = middle;
+            pending.push_back(i);
+            pending.push_back(intervals.size() - 1);
+        }
+    }
+    return EVAL_OK;
+}
+
+// Records an integral in the report of the line being evaluated.
+void reportIntegral(const IntegralResult& result) {
+    if (!integralReport)
+        return;
+    integralReport->error = result.error;
+    if (!result.converged)
+        integralReport->converged = false;
+}
+
+// Evaluates an integral node; args holds the range, the tolerance if there
+// is one, then the values of the names its body captured.
+EvalStatus runIntegral(const Reduction& reduction, const double* args, double& value) {
+    double tolerance = reduction.kind == REDUCE_INTEGRAL_TOLERANCE ? args[2] : DEFAULT_TOLERANCE;
+    std::vector<ColumnBinding> bindings(1 + reduction.captured.size());
+    for (size_t i = 0; i < reduction.captured.size(); i++)
+        bindings[1 + i].scalar = args[reduction.operandCount() + i];
+    auto evaluate = [&](const std::vector<double>& xs, std::vector<double>& ys, std::vector<double>&) {
+        return evaluateAtPoints(reduction.body, bindings, 0, xs, ys);
+    };
+    IntegralResult result;
+    EvalStatus status = integrateAdaptive(args[0], args[1], tolerance, evaluate, result);
+    if (status != EVAL_OK)
+        return status;
+    reportIntegral(result);
+    value = result.value;
+    return EVAL_OK;
+}
+
+// The integral of f(x, p) from a(p) to b(p) has the derivative
+// integral(df/dp) + f(b) b' - f(a) a' (Leibniz's rule). The integrand and its
+// derivative are evaluated together, point by point, and df/dp is integrated
+// over the partition that the values chose.
+EvalStatus integrateAs(const Reduction& reduction, const Dual* args, Dual& value) {
+    double tolerance = reduction.kind == REDUCE_INTEGRAL_TOLERANCE ? args[2].value : DEFAULT_TOLERANCE;
+    std::vector<Dual> vars(args + reduction.operandCount() - 1, args + reduction.argumentCount());
+    auto at = [&](double x, Dual& f) {
+        vars[0] = Dual(x);
+        return interpretProgramAs(reduction.body, vars.data(), static_cast<const Dual*>(nullptr), f);
+    };
+    auto evaluate = [&](const std::vector<double>& xs, std::vector<double>& ys, std::vector<double>& slopes) {
+        ys.resize(xs.size());
+        slopes.resize(xs.size());
+        for (size_t i = 0; i < xs.size(); i++) {
+            Dual f;
+            EvalStatus status = at(xs[i], f);
+            if (status != EVAL_OK)
+                return status;
+            ys[i] = f.value;
+            slopes[i] = f.derivative;
+        }
+        return EVAL_OK;
+    };
+    IntegralResult result;
+    EvalStatus status = integrateAdaptive(args[0].value, args[1].value, tolerance, evaluate, result);
+    if (status != EVAL_OK)
+        return status;
+    double derivative = result.derivative;
+    for (int end = 0; end < 2; end++) {
+        if (args[end].derivative == 0)
+            continue;
+        Dual f;
+        status = at(args[end].value, f);
+        if (status != EVAL_OK)
+            return status;
+        derivative += (end ? 1 : -1) * f.value * args[end].derivative;
+    }
+    reportIntegral(result);
+    value = Dual(result.value, derivative);
+    return EVAL_OK;
+}
+
+
+// Matrix products follow the blocking of BLIS-style GEMM. B is packed in
+// panels of GEMM_NR columns, GEMM_KC rows deep, that stay in L3; A in
+// blocks of GEMM_MC rows that stay in L2. A register-blocked kernel then
+// computes GEMM_MR x GEMM_NR tiles of C from one panel of each, streaming
+// through memory in order. Blocks of rows and groups of panels are spread
+// over the shared pool.
+const size_t GEMM_MR = 6, GEMM_NR = 8;
+const size_t GEMM_KC = 256, GEMM_MC = 120, GEMM_NC = 2048;
+const size_t GEMM_PANELS = 32;  // panels of B per unit of parallel work
+
+// C += A * B for one tile: kc columns of a packed panel of A, GEMM_MR values
+// each, times kc rows of a packed panel of B, GEMM_NR values each. Only the
+// first mr x nr of the tile lie inside C.
+void gemmTile(size_t kc, const double* a, const double* b, double* c, size_t ldc, size_t mr, size_t nr) {
+    double tile[GEMM_MR][GEMM_NR] = {};
+    for (size_t p = 0; p < kc; p++, a += GEMM_MR, b += GEMM_NR) {
+        for (size_t i = 0; i < GEMM_MR; i++) {
+            for (size_t j = 0; j < GEMM_NR; j++)
+                tile[i][j] += a[i] * b[j];
+        }
+    }
+    for (size_t i = 0; i < mr; i++) {
+        for (size_t j = 0; j < nr; j++)
+            c[i * ldc + j] += tile[i][j];
+    }
+}
+
+#ifdef CALC_HAVE_AVX2_KERNELS
+// The same tile in twelve AVX registers, with one fused multiply-add per
+// register per step.
+__attribute__((target("avx2,fma")))
+void gemmTileAvx2(size_t kc, const double* a, const double* b, double* c, size_t ldc, size_t mr, size_t nr) {
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd(), c10 = _mm256_setzero_pd();
+    __m256d c11 = _mm256_setzero_pd(), c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd(), c40 = _mm256_setzero_pd();
+    __m256d c41 = _mm256_setzero_pd(), c50 = _mm256_setzero_pd(), c51 = _mm256_setzero_pd();
+    for (size_t p = 0; p < kc; p++, a += GEMM_MR, b += GEMM_NR) {
+        __m256d b0 = _mm256_load_pd(b), b1 = _mm256_load_pd(b + 4);
+        __m256d x = _mm256_broadcast_sd(a);
+        c00 = _mm256_fmadd_pd(x, b0, c00);
+        c01 = _mm256_fmadd_pd(x, b1, c01);
+        x = _mm256_broadcast_sd(a + 1);
+        c10 = _mm256_fmadd_pd(x, b0, c10);
+        c11 = _mm256_fmadd_pd(x, b1, c11);
+        x = _mm256_broadcast_sd(a + 2);
+        c20 = _mm256_fmadd_pd(x, b0, c20);
+        c21 = _mm256_fmadd_pd(x, b1, c21);
+        x = _mm256_broadcast_sd(a + 3);
+        c30 = _mm256_fmadd_pd(x, b0, c30);
+        c31 = _mm256_fmadd_pd(x, b1, c31);
+        x = _mm256_broadcast_sd(a + 4);
+        c40 = _mm256_fmadd_pd(x, b0, c40);
+        c41 = _mm256_fmadd_pd(x, b1, c41);
+        x = _mm256_broadcast_sd(a + 5);
+        c50 = _mm256_fmadd_pd(x, b0, c50);
+        c51 = _mm256_fmadd_pd(x, b1, c51);
+    }
+    alignas(32) double tile[GEMM_MR][GEMM_NR];
+    __m256d rows[GEMM_MR][2] = {{c00, c01}, {c10, c11}, {c20, c21}, {c30, c31}, {c40, c41}, {c50, c51}};
+    if (mr == GEMM_MR && nr == GEMM_NR) {
+        for (size_t i = 0; i < GEMM_MR; i++) {
+            double* row = c + i * ldc;
+            _mm256_storeu_pd(row, _mm256_add_pd(_mm256_loadu_pd(row), rows[i][0]));
+            _mm256_storeu_pd(row + 4, _mm256_add_pd(_mm256_loadu_pd(row + 4), rows[i][1]));
+        }
+        return;
+    }
+    for (size_t i = 0; i < GEMM_MR; i++) {
+        _mm256_store_pd(tile[i], rows[i][0]);
+        _mm256_store_pd(tile[i] + 4, rows[i][1]);
+    }
+    for (size_t i = 0; i < mr; i++) {
+        for (size_t j = 0; j < nr; j++)
+            c[i * ldc + j] += tile[i][j];
+    }
+}
+#endif
+
+// Packs mc x kc of a, times alpha, as panels of GEMM_MR rows stored column
+// by column. Rows past mc are zero, so every tile is full.
+void packGemmA(size_t mc, size_t kc, double alpha, const double* a, size_t lda, double* packed) {
+    for (size_t i0 = 0; i0 < mc; i0 += GEMM_MR) {
+        size_t mr = std::min(GEMM_MR, mc - i0);
+        for (size_t p = 0; p < kc; p++) {
+            for (size_t i = 0; i < mr; i++)
+                *packed++ = alpha * a[(i0 + i) * lda + p];
+            for (size_t i = mr; i < GEMM_MR; i++)
+                *packed++ = 0;
+        }
+    }
+}
+
+// Packs kc x nc of b as panels of GEMM_NR columns stored row by row, with
+// columns past nc zero.
+void packGemmB(size_t kc, size_t nc, const double* b, size_t ldb, double* packed) {
+    for (size_t j0 = 0; j0 < nc; j0 += GEMM_NR) {
+        size_t nr = std::min(GEMM_NR, nc - j0);
+        for (size_t p = 0; p < kc; p++) {
+            const double* row = b + p * ldb + j0;
+            std::copy(row, row + nr, packed);
+            std::fill(packed + nr, packed + GEMM_NR, 0.0);
+            packed += GEMM_NR;
+        }
+    }
+}
+
+// C += alpha * A * B, where A is m x k, B is k x n and C is m x n, all stored
+// by rows with row strides lda, ldb and ldc. alpha is applied while packing.
+void gemm(size_t m, size_t n, size_t k, double alpha, const double* a, size_t lda, const double* b, size_t ldb,
+          double* c, size_t ldc) {
+    if (m == 0 || n == 0 || k == 0)
+        return;
+    void (*tile)(size_t, const double*, const double*, double*, size_t, size_t, size_t) = gemmTile;
+#ifdef CALC_HAVE_AVX2_KERNELS
+    if (cpuHasAvx2() && cpuHasFma())
+        tile = gemmTileAvx2;
+#endif
+    size_t widest = (std::min(n, GEMM_NC) + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+    Matrix packedB(std::min(k, GEMM_KC), widest, false);
+    Environment* environment = activeVariables;
+
+    for (size_t jc = 0; jc < n; jc += GEMM_NC) {
+        size_t nc = std::min(GEMM_NC, n - jc);
+        size_t panels = (nc + GEMM_NR - 1) / GEMM_NR;
+        size_t groups = (panels + GEMM_PANELS - 1) / GEMM_PANELS;
+        for (size_t pc = 0; pc < k; pc += GEMM_KC) {
+            size_t kc = std::min(GEMM_KC, k - pc);
+            packGemmB(kc, nc, b + pc * ldb + jc, ldb, packedB.data());
+            size_t blocks = (m + GEMM_MC - 1) / GEMM_MC;
+            sharedParallelFor(blocks * groups, [&](size_t work) {
+                ActiveVariablesScope scope(*environment);
+                thread_local Matrix packedA;
+                if (packedA.size() < GEMM_MC * GEMM_KC)
+                    packedA = Matrix(GEMM_MC, GEMM_KC, false);
+                size_t ic = work / groups * GEMM_MC, mc = std::min(GEMM_MC, m - ic);
+                size_t firstPanel = work % groups * GEMM_PANELS;
+                size_t lastPanel = std::min(panels, firstPanel + GEMM_PANELS);
+                packGemmA(mc, kc, alpha, a + ic * lda + pc, lda, packedA.data());
+                for (size_t panel = firstPanel; panel < lastPanel; panel++) {
+                    size_t jr = panel * GEMM_NR;
+                    for (size_t ir = 0; ir < mc; ir += GEMM_MR) {
+                        tile(kc, packedA.data() + ir * kc, packedB.data() + jr * kc, c + (ic + ir) * ldc + jc + jr,
+                             ldc, std::min(GEMM_MR, mc - ir), std::min(GEMM_NR, nc - jr));
+                    }
+                }
+            });
+        }
+    }
+}
+
+std::string matrixShape(const Matrix& m) {
+    return std::to_string(m.rows) + "x" + std::to_string(m.cols);
+}
+
+std::shared_ptr<Matrix> copyMatrix(const Matrix& m) {
+    auto copy = std::make_shared<Matrix>(m.rows, m.cols, false);
+    std::copy(m.data(), m.data() + m.size(), copy->data());
+    return copy;
+}
+
+// Returns a matrix the caller may overwrite: m itself when nothing else
+// holds it, as with the result of the previous operator, or else a copy.
+std::shared_ptr<Matrix> writable(std::shared_ptr<Matrix> m) {
+    return m.use_count() == 1 ? m : copyMatrix(*m);
+}
+
+std::shared_ptr<Matrix> identityMatrix(size_t n) {
+    auto identity = std::make_shared<Matrix>(n, n);
+    for (size_t i = 0; i < n; i++)
+        (*identity)[i][i] = 1;
+    return identity;
+}
+
+std::shared_ptr<Matrix> multiplyMatrices(const Matrix& a, const Matrix& b) {
+    if (a.cols != b.rows)
+        throw std::runtime_error("Cannot multiply a " + matrixShape(a) + " matrix by a " + matrixShape(b) + " matrix!");
+    auto product = std::make_shared<Matrix>(a.rows, b.cols);
+    gemm(a.rows, b.cols, a.cols, 1, a.data(), a.cols, b.data(), b.cols, product->data(), product->cols);
+    return product;
+}
+
+// Transposes by square tiles, so that both the rows read and the columns
+// written stay in cache.
+std::shared_ptr<Matrix> transposeMatrix(const Matrix& m) {
+    const size_t TILE = 32;
+    auto result = std::make_shared<Matrix>(m.cols, m.rows, false);
+    for (size_t i0 = 0; i0 < m.rows; i0 += TILE) {
+        for (size_t j0 = 0; j0 < m.cols; j0 += TILE) {
+            for (size_t i = i0; i < std::min(m.rows, i0 + TILE); i++) {
+                for (size_t j = j0; j < std::min(m.cols, j0 + TILE); j++)
+                    (*result)[j][i] = m[i][j];
+            }
+        }
+    }
+    return result;
+}
+
+const size_t LU_BLOCK = 64;
+
+// Factors a square matrix in place into L and U with partial pivoting: row k
+// was swapped with row pivots[k] before step k, and L, which is unit lower
+// triangular, shares the storage with U. Panels of LU_BLOCK columns are
+// factored a column at a time; the rest of the matrix then takes one
+// product per panel, which is nearly all of the work. Returns false if a
+// pivot is zero.
+bool factorLU(Matrix& a, std::vector<size_t>& pivots) {
+    size_t n = a.rows;
+    pivots.resize(n);
+    for (size_t k0 = 0; k0 < n; k0 += LU_BLOCK) {
+        size_t k1 = std::min(n, k0 + LU_BLOCK);
+        for (size_t k = k0; k < k1; k++) {
+            size_t pivot = k;
+            for (size_t i = k + 1; i < n; i++) {
+                if (std::abs(a[i][k]) > std::abs(a[pivot][k]))
+                    pivot = i;
+            }
+            pivots[k] = pivot;
+            if (a[pivot][k] == 0)
+                return false;
+            if (pivot != k)
+                std::swap_ranges(a[k], a[k] + n, a[pivot]);
+            for (size_t i = k + 1; i < n; i++) {
+                double l = a[i][k] /= a[k][k];
+                for (size_t j = k + 1; j < k1; j++)
+                    a[i][j] -= l * a[k][j];
+            }
+        }
+        for (size_t i = k0 + 1; i < k1; i++) {
+            for (size_t k = k0; k < i; k++) {
+                double l = a[i][k];
+                for (size_t j = k1; j < n; j++)
+                    a[i][j] -= l * a[k][j];
+            }
+        }
+        gemm(n - k1, n - k1, k1 - k0, -1, a[k1] + k0, n, a[k0] + k1, n, a[k1] + k1, n);
+    }
+    return true;
+}
+
+// Solves A X = B in place of B, given A's factors from factorLU. Both
+// triangular solves go LU_BLOCK rows at a time: a block is solved directly,
+// and then removed from the rows still to come with one product.
+void solveLU(const Matrix& lu, const std::vector<size_t>& pivots, Matrix& x) {
+    size_t n = lu.rows, m = x.cols;
+    for (size_t k = 0; k < n; k++) {
+        if (pivots[k] != k)
+            std::swap_ranges(x[k], x[k] + m, x[pivots[k]]);
+    }
+    for (size_t i0 = 0; i0 < n; i0 += LU_BLOCK) {
+        size_t i1 = std::min(n, i0 + LU_BLOCK);
+        for (size_t i = i0 + 1; i < i1; i++) {
+            for (size_t k = i0; k < i; k++) {
+                double l = lu[i][k];
+                for (size_t j = 0; j < m; j++)
+                    x[i][j] -= l * x[k][j];
+            }
+        }
+        gemm(n - i1, m, i1 - i0, -1, lu[i1] + i0, n, x[i0], m, x[i1], m);
+    }
+    for (size_t i1 = n; i1 > 0;) {
+        size_t i0 = i1 > LU_BLOCK ? i1 - LU_BLOCK : 0;
+        for (size_t i = i1; i-- > i0;) {
+            for (size_t k = i + 1; k < i1; k++) {
+                double u = lu[i][k];
+                for (size_t j = 0; j < m; j++)
+                    x[i][j] -= u * x[k][j];
+            }
+            double diagonal = lu[i][i];
+            for (size_t j = 0; j < m; j++)
+                x[i][j] /= diagonal;
+        }
+        gemm(i0, m, i1 - i0, -1, lu[0] + i0, n, x[i0], m, x[0], m);
+        i1 = i0;
+    }
+}
+
+void requireSquare(const Matrix& m, const char* name) {
+    if (m.rows != m.cols)
+        throw std::runtime_error(std::string(name) + " needs a square matrix, not " + matrixShape(m) + "!");
+}
+
+// The product of the pivots, with the sign of the row swaps. The product is
+// kept as a mantissa and a binary exponent, as for prod(), so that a large
+// matrix does not overflow on the way to a representable determinant.
+double determinant(const Matrix& m) {
+    requireSquare(m, "det");
+    std::shared_ptr<Matrix> lu = copyMatrix(m);
+    std::vector<size_t> pivots;
+    if (!factorLU(*lu, pivots))
+        return 0;
+    std::vector<double> diagonal(m.rows);
+    size_t swaps = 0;
+    for (size_t k = 0; k < m.rows; k++) {
+        diagonal[k] = (*lu)[k][k];
+        swaps += pivots[k] != k;
+    }
+    ReductionState product;
+    product.kind = REDUCE_PROD;
+    product.add(diagonal.data(), diagonal.size());
+    return swaps % 2 ? -product.result() : product.result();
+}
+
+std::shared_ptr<Matrix> solveMatrix(const Matrix& a, const Matrix& b, const char* name) {
+    requireSquare(a, name);
+    if (b.rows != a.rows)
+        throw std::runtime_error("Cannot solve a " + matrixShape(a) + " system for a " + matrixShape(b) + " right-hand side!");
+    std::shared_ptr<Matrix> lu = copyMatrix(a);
+    std::vector<size_t> pivots;
+    if (!factorLU(*lu, pivots))
+        throw std::runtime_error("Matrix is singular!");
+    std::shared_ptr<Matrix> x = copyMatrix(b);
+    solveLU(*lu, pivots, *x);
+    return x;
+}
+
+std::shared_ptr<Matrix> inverseMatrix(const Matrix& m) {
+    requireSquare(m, "inv");
+    return solveMatrix(m, *identityMatrix(m.rows), "inv");
+}
+
+// A^n by repeated squaring; a negative n inverts A first.
+std::shared_ptr<Matrix> matrixPower(std::shared_ptr<Matrix> base, double exponent) {
+    requireSquare(*base, "^");
+    if (exponent != std::floor(exponent) || std::abs(exponent) > 0x1p31)
+        throw std::runtime_error("Matrix powers need a whole number exponent!");
+    if (exponent < 0)
+        base = inverseMatrix(*base);
+    auto n = static_cast<uint64_t>(std::abs(exponent));
+    std::shared_ptr<Matrix> result = identityMatrix(base->rows);
+    for (; n; n >>= 1) {
+        if (n & 1)
+            result = multiplyMatrices(*result, *base);
+        if (n > 1)
+            base = multiplyMatrices(*base, *base);
+    }
+    return result;
+}
+
+// Applies fn to each pair of elements. Either side may be a number, which
+// pairs with every element of the other. The result overwrites an operand
+// that nothing else holds, such as the result of the previous operator,
+// rather than allocating another matrix.
+template <typename Fn>
+MatrixValue mapElements(MatrixValue left, MatrixValue right, Fn fn) {
+    if (!left.matrix && !right.matrix)
+        return {nullptr, fn(left.scalar, right.scalar)};
+    const Matrix& shape = left.matrix ? *left.matrix : *right.matrix;
+    if (left.matrix && right.matrix && (left.matrix->rows != right.matrix->rows || left.matrix->cols != right.matrix->cols))
+        throw std::runtime_error("Matrix sizes do not match: " + matrixShape(*left.matrix) + " and " +
+                                 matrixShape(*right.matrix) + "!");
+    std::shared_ptr<Matrix> result;
+    if (left.matrix && left.matrix.use_count() == 1)
+        result = left.matrix;
+    else if (right.matrix && right.matrix.use_count() == 1)
+        result = right.matrix;
+    else
+        result = std::make_shared<Matrix>(shape.rows, shape.cols, false);
+
+    double* out = result->data();
+    const double* x = left.matrix ? left.matrix->data() : nullptr;
+    const double* y = right.matrix ? right.matrix->data() : nullptr;
+    size_t n = result->size();
+    if (x && y) {
+        for (size_t i = 0; i < n; i++)
+            out[i] = fn(x[i], y[i]);
+    } else if (x) {
+        double scalar = right.scalar;
+        for (size_t i = 0; i < n; i++)
+            out[i] = fn(x[i], scalar);
+    } else {
+        double scalar = left.scalar;
+        for (size_t i = 0; i < n; i++)
+            out[i] = fn(scalar, y[i]);
+    }
+    return {std::move(result)};
+}
+
+// An arithmetic operator taken element by element, as +, - and the dotted
+// operators are. Two matrices of which the left one is a temporary go
+// through the column kernels in place.
+MatrixValue elementwise(char op, MatrixValue left, MatrixValue right) {
+    if (op == '/') {
+        bool zero = right.matrix ? std::find(right.matrix->data(), right.matrix->data() + right.matrix->size(), 0.0) !=
+                                       right.matrix->data() + right.matrix->size()
+                                 : right.scalar == 0;
+        if (zero)
+            throw std::runtime_error("Cannot divide by 0!");
+    }
+    if (left.matrix && right.matrix && left.matrix.use_count() == 1 && left.matrix->rows == right.matrix->rows &&
+        left.matrix->cols == right.matrix->cols) {
+        binaryColumns(op, left.matrix->data(), right.matrix->data(), left.matrix->size());
+        return left;
+    }
+    switch (op) {
+        case '+': return mapElements(std::move(left), std::move(right), [](double x, double y) { return x + y; });
+        case '-': return mapElements(std::move(left), std::move(right), [](double x, double y) { return x - y; });
+        case '*': return mapElements(std::move(left), std::move(right), [](double x, double y) { return x * y; });
+        case '/': return mapElements(std::move(left), std::move(right), [](double x, double y) { return x / y; });
+        case '^': return mapElements(std::move(left), std::move(right), [](double x, double y) { return std::pow(x, y); });
+    }
+    throw std::runtime_error("Unknown operator!");
+}
+
+const Matrix& matrixArgument(const MatrixValue& value, const char* name) {
+    if (!value.matrix)
+        throw std::runtime_error(std::string(name) + " needs a matrix!");
+    return *value.matrix;
+}
+
+size_t sizeArgument(const MatrixValue& value) {
+    if (value.matrix || !(value.scalar >= 1 && value.scalar <= (1 << 28)) || value.scalar != std::floor(value.scalar))
+        throw std::runtime_error("Matrix sizes must be positive whole numbers!");
+    return static_cast<size_t>(value.scalar);
+}
+
+MatrixValue applyMatrixFunction(int function, MatrixValue* args) {
+    const char* name = matrixFunctions[function].name;
+    switch (function) {
+        case MATRIX_DET:
+            return {nullptr, determinant(matrixArgument(args[0], name))};
+        case MATRIX_INV:
+            return {inverseMatrix(matrixArgument(args[0], name))};
+        case MATRIX_SOLVE:
+            return {solveMatrix(matrixArgument(args[0], name), matrixArgument(args[1], name), name)};
+        case MATRIX_TRANSPOSE:
+            return {transposeMatrix(matrixArgument(args[0], name))};
+        case MATRIX_EYE:
+            return {identityMatrix(sizeArgument(args[0]))};
+        case MATRIX_ZEROS:
+        case MATRIX_ONES: {
+            auto m = std::make_shared<Matrix>(sizeArgument(args[0]), sizeArgument(args[1]));
+            if (function == MATRIX_ONES)
+                std::fill(m->data(), m->data() + m->size(), 1.0);
+            return {m};
+        }
+        case MATRIX_RAND: {
+            thread_local std::mt19937_64 generator;
+            std::uniform_real_distribution<double> uniform(0, 1);
+            auto m = std::make_shared<Matrix>(sizeArgument(args[0]), sizeArgument(args[1]), false);
+            for (size_t i = 0; i < m->size(); i++)
+                m->data()[i] = uniform(generator);
+            return {m};
+        }
+    }
+    throw std::runtime_error("Unknown function!");
+}
+
+// Builds a literal from the count items on top of the stack. Numbers make a
+// column vector; column vectors of one length make the rows of a matrix, so
+// [[1, 2], [3, 4]] is 2x2 and [v, w] stacks two vectors.
+MatrixValue buildMatrix(std::vector<MatrixValue>& stack, size_t count) {
+    if (stack.size() < count)
+        throw std::runtime_error("Invalid expression!");
+    MatrixValue* items = stack.data() + stack.size() - count;
+    std::shared_ptr<Matrix> result;
+    if (std::none_of(items, items + count, [](const MatrixValue& item) { return item.matrix != nullptr; })) {
+        result = std::make_shared<Matrix>(count, 1, false);
+        for (size_t i = 0; i < count; i++)
+            result->data()[i] = items[i].scalar;
+    } else {
+        size_t length = items[0].matrix ? items[0].matrix->rows : 0;
+        for (size_t i = 0; i < count; i++) {
+            if (!items[i].matrix || items[i].matrix->cols != 1 || items[i].matrix->rows != length)
+                throw std::runtime_error("The rows of a matrix must be lists of numbers of one length!");
+        }
+        result = std::make_shared<Matrix>(count, length, false);
+        for (size_t i = 0; i < count; i++)
+            std::copy(items[i].matrix->data(), items[i].matrix->data() + length, (*result)[i]);
+    }
+    stack.resize(stack.size() - count);
+    return {std::move(result)};
+}
+
+// Evaluates a postfix expression whose values may be matrices. Values are
+// held by shared pointer, so reading a variable does not copy it, and
+// operators reuse a temporary operand's storage for their result.
+MatrixValue evaluateMatrixPostfix(const std::vector<Token>& postfix, std::string_view source) {
+    CALC_STAT_STAGE(STAGE_EVALUATE);
+    CALC_STAT_ADD(expressions, 1);
+    std::vector<MatrixValue> stack;
+    std::vector<double> scalars;
 
-    SetConsoleCursorPosition(hStdOut, homeCoords);
+    for (const auto& token : postfix) {
+        if (token.type == NUMBER) {
+            stack.push_back({nullptr, token.value});
+        } else if (token.type == VARIABLE) {
+            auto it = activeVariables->matrices.find(std::string(tokenText(source, token)));
+            if (it != activeVariables->matrices.end())
+                stack.push_back({it->second});
+            else
+                stack.push_back({nullptr, activeVariables->at(tokenText(source, token))});
+        } else if (token.type == PARENTHESIS) {
+            MatrixValue value = buildMatrix(stack, token.id + 1u);
+            stack.push_back(std::move(value));
+        } else if (token.type == FUNCTION) {
+            size_t arity = functionArity(token);
+            if (stack.size() < arity)
+                throw std::runtime_error("Missing argument for function!");
+            MatrixValue* args = stack.data() + stack.size() - arity;
+            MatrixValue result;
+            bool matrices = std::any_of(args, args + arity, [](const MatrixValue& arg) { return arg.matrix != nullptr; });
+            if (token.op == FUNCTION_MATRIX) {
+                result = applyMatrixFunction(token.id, args);
+            } else if (!matrices) {
+                scalars.clear();
+                for (size_t i = 0; i < arity; i++)
+                    scalars.push_back(args[i].scalar);
+                applyFunctionToken(scalars, token, source);
+                result.scalar = scalars.back();
+            } else if (token.op == FUNCTION_BUILTIN) {
+                result.matrix = writable(std::move(args[0].matrix));
+                functionColumn(token.id, result.matrix->data(), result.matrix->size());
+                CALC_STAT_FUNCTION(token.id, result.matrix->size());
+            } else if (token.op == FUNCTION_BINARY) {
+                result = mapElements(std::move(args[0]), std::move(args[1]), binaryFunctions[token.id].fn);
+            } else {
+                throw std::runtime_error(functionName(token) + " takes numbers, not matrices!");
+            }
+            stack.resize(stack.size() - arity);
+            stack.push_back(std::move(result));
+        } else if (token.type == OPERATOR) {
+            if (stack.size() < 2)
+                throw std::runtime_error("Invalid expression!");
+            MatrixValue right = std::move(stack.back());
+            stack.pop_back();
+            MatrixValue left = std::move(stack.back());
+            stack.pop_back();
+            MatrixValue result;
+            if (token.id == ELEMENTWISE || token.op == '+' || token.op == '-' || !(left.matrix || right.matrix)) {
+                result = elementwise(token.op, std::move(left), std::move(right));
+            } else if (token.op == '*') {
+                if (left.matrix && right.matrix)
+                    result.matrix = multiplyMatrices(*left.matrix, *right.matrix);
+                else
+                    result = elementwise('*', std::move(left), std::move(right));
+            } else if (right.matrix) {
+                throw std::runtime_error(token.op == '/' ? "Cannot divide by a matrix; use inv or solve!"
+                                                         : "Exponents must be numbers!");
+            } else if (token.op == '/') {
+                result = elementwise('/', std::move(left), std::move(right));
+            } else {
+                result.matrix = matrixPower(std::move(left.matrix), right.scalar);
+            }
+            stack.push_back(std::move(result));
+        }
+    }
+    if (stack.size() != 1)
+        throw std::runtime_error("Invalid expression!");
+    return std::move(stack.back());
 }
-#else
-void clearScreen() {
-    std::cout << "\033[2J\033[1;1H";
+
+// Whether a line needs evaluating with matrices: it has a bracket, calls a
+// matrix function, or names a matrix variable. The interval of an equation's
+// "in [lo, hi]" does not count.
+bool isMatrixLine(std::string_view line) {
+    line = line.substr(0, intervalSuffix(line));
+    if (line.find('[') != std::string_view::npos)
+        return true;
+    const auto& matrices = activeVariables->matrices;
+    for (size_t i = 0; i < line.size();) {
+        if (!isalpha(static_cast<unsigned char>(line[i]))) {
+            i++;
+            continue;
+        }
+        size_t j = i;
+        while (j < line.size() && isalpha(static_cast<unsigned char>(line[j])))
+            j++;
+        std::string_view name = line.substr(i, j - i);
+        size_t next = j;
+        while (next < line.size() && line[next] == ' ')
+            next++;
+        if (next < line.size() && line[next] == '(' && findMatrixFunction(name) >= 0)
+            return true;
+        if (!matrices.empty() && matrices.count(std::string(name)))
+            return true;
+        i = j;
+    }
+    return false;
 }
-#endif
 
-enum CalcTokenType { NUMBER, OPERATOR, PARENTHESIS, FUNCTION, VARIABLE };
+// Evaluates "expr" or "name = expr" with matrices. A matrix result is stored
+// in the environment's matrices, a number as a plain variable. Returns the
+// name assigned, if any.
+std::string_view evaluateMatrixLine(std::string_view line, MatrixValue& value, BindingUpdate& update) {
+    line = trimView(line);
+    std::string_view target = assignmentTarget(line);
+    if (target.empty() && line.find('=') != std::string_view::npos)
+        throw std::runtime_error("Equations of matrices are not supported; use solve(A, b)!");
+    std::string_view expr = target.empty() ? line : line.substr(line.find('=') + 1);
 
-struct Token {
-    CalcTokenType type;
-    double value;
-    char op;
-    std::string funcName;
-    std::string varName;
-};
+    thread_local std::vector<Token> tokens;
+    thread_local std::vector<Token> postfix;
+    tokens.clear();
+    Lexer lexer(false, true);
+    lexer.lex(expr, [&](const Token& token) { tokens.push_back(token); });
+    infixToPostfix(tokens, postfix);
+    value = evaluateMatrixPostfix(postfix, expr);
+    if (target.empty())
+        return target;
 
-int precedence(char op) {
-    if (op == '+' || op == '-')
-        return 1;
-    if (op == '*' || op == '/')
-        return 2;
-    if (op == '^')
-        return 3;
-    return 0;
+    // A name keeps the kind of its first value: code compiled against a
+    // number variable reads its slot, which a matrix cannot fill.
+    std::string name(target);
+    if (isReservedName(name))
+        throw std::runtime_error("Invalid variable name!");
+    bool isMatrix = activeVariables->matrices.count(name) > 0;
+    if (value.matrix) {
+        if (activeVariables->count(name))
+            throw std::runtime_error(name + " holds a number, so it cannot hold a matrix!");
+        activeVariables->matrices[name] = value.matrix;
+    } else {
+        if (isMatrix)
+            throw std::runtime_error(name + " holds a matrix, so it cannot hold a number!");
+        update = assignVariable(name, value.scalar);
+    }
+    return target;
 }
 
-bool isRightAssociative(char op) {
-    return op == '^';
+// Appends a matrix as nested lists, "[[1, 2], [3, 4]]", or a column vector
+// as a single list, "[1, 2]". Matrices too large to read are shown by size.
+void appendMatrix(std::string& out, const Matrix& m, void (*appendValue)(std::string&, double)) {
+    if (m.size() > MATRIX_PRINT_LIMIT) {
+        out += matrixShape(m);
+        out += " matrix";
+        return;
+    }
+    out += '[';
+    for (size_t i = 0; i < m.rows; i++) {
+        if (i)
+            out += ", ";
+        if (m.cols > 1)
+            out += '[';
+        for (size_t j = 0; j < m.cols; j++) {
+            if (j)
+                out += ", ";
+            appendValue(out, m[i][j]);
+        }
+        if (m.cols > 1)
+            out += ']';
+    }
+    out += ']';
 }
 
-std::map<std::string, double> variables;
+// Named columns of doubles, all with the same number of rows. CSV columns are
+// parsed into memory; binary columns are mapped straight from their files.
+struct ColumnSet {
+    std::vector<std::string> names;
+    std::vector<const double*> values;
+    std::vector<size_t> lengths;
+    std::vector<std::vector<double>> parsed;
+#ifdef CALC_HAVE_MMAP
+    std::vector<std::unique_ptr<MappedFile>> mapped;
+#endif
+    size_t rows = 0;
 
-std::vector<Token> tokenize(const std::string& expr) {
-    std::vector<Token> tokens;
-    size_t i = 0;
-    std::map<std::string, Token> functions = {
-        {"sin", Token{FUNCTION, 0, 0, "sin", ""}},
-        {"cos", Token{FUNCTION, 0, 0, "cos", ""}},
-        {"tan", Token{FUNCTION, 0, 0, "tan", ""}},
-        {"log", Token{FUNCTION, 0, 0, "log", ""}},
-        {"ln",  Token{FUNCTION, 0, 0, "ln", ""}},
-        {"sqrt",Token{FUNCTION, 0, 0, "sqrt", ""}},
-        {"abs", Token{FUNCTION, 0, 0, "abs", ""}},
-        {"exp", Token{FUNCTION, 0, 0, "exp", ""}},
-    };
+    void add(std::string name, std::vector<double> column) {
+        names.push_back(std::move(name));
+        values.push_back(column.data());
+        lengths.push_back(column.size());
+        parsed.push_back(std::move(column));
+    }
+};
 
-    Token* lastToken = nullptr;
+// Reads a CSV file whose first line names the columns.
+void loadCsvColumns(const char* path, ColumnSet& columns) {
+    CALC_STAT_STAGE(STAGE_IO);
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        throw std::runtime_error(std::string("cannot open ") + path);
 
-    while (i < expr.size()) {
-        if (isspace(expr[i])) {
-            i++;
+    LineReader reader(file);
+    std::string_view line;
+    size_t lineNumber = 1;
+    if (!reader.next(line)) {
+        fclose(file);
+        throw std::runtime_error(std::string("empty CSV file ") + path);
+    }
+
+    std::vector<std::string> names;
+    std::stringstream header{std::string(line)};
+    std::string name;
+    while (std::getline(header, name, ',')) {
+        trim(name);
+        names.push_back(name);
+    }
+
+    size_t count = names.size();
+    std::vector<std::vector<double>> data(count);
+    while (reader.next(line)) {
+        lineNumber++;
+        if (line.empty())
             continue;
+        const char* p = line.data();
+        const char* end = line.data() + line.size();
+        for (size_t c = 0; c < count; c++) {
+            while (p < end && (*p == ' ' || *p == '\t'))
+                p++;
+            double value = 0;
+            auto res = std::from_chars(p, end, value);
+            if (res.ec != std::errc()) {
+                fclose(file);
+                throw std::runtime_error("Invalid number in " + std::string(path) + " at line " + std::to_string(lineNumber));
+            }
+            data[c].push_back(value);
+            p = res.ptr;
+            while (p < end && (*p == ' ' || *p == '\t'))
+                p++;
+            if (p < end && *p == ',')
+                p++;
         }
+    }
+    fclose(file);
+    for (size_t c = 0; c < count; c++)
+        columns.add(std::move(names[c]), std::move(data[c]));
+}
 
-        Token newToken;
+// Reads a file of raw native-endian doubles as one column. Regular files are
+// mapped rather than read.
+void loadBinaryColumn(const std::string& name, const char* path, ColumnSet& columns) {
+    CALC_STAT_STAGE(STAGE_IO);
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        throw std::runtime_error(std::string("cannot open ") + path);
 
-        if (isdigit(expr[i]) || expr[i] == '.') {
-            size_t j = i;
-            while (j < expr.size() && (isdigit(expr[j]) || expr[j] == '.')) {
-                j++;
-            }
-            std::string numStr = expr.substr(i, j - i);
-            double num = std::stod(numStr);
-            newToken.type = NUMBER;
-            newToken.value = num;
-            newToken.op = 0;
-            newToken.funcName.clear();
-            newToken.varName.clear();
-            i = j;
-        } else if (isalpha(expr[i])) {
-            size_t j = i;
-            while (j < expr.size() && isalpha(expr[j])) {
-                j++;
-            }
-            std::string func = expr.substr(i, j - i);
-            if (functions.count(func)) {
-                Token funcToken = functions[func];
-                newToken = funcToken;
-            } else if (func == "pi") {
-                newToken.type = NUMBER;
-                newToken.value = M_PI;
-                newToken.op = 0;
-                newToken.funcName.clear();
-                newToken.varName.clear();
-            } else if (func == "e") {
-                newToken.type = NUMBER;
-                newToken.value = M_E;
-                newToken.op = 0;
-                newToken.funcName.clear();
-                newToken.varName.clear();
-            } else {
-                newToken.type = VARIABLE;
-                newToken.varName = func;
-                newToken.value = 0;
-                newToken.op = 0;
-                newToken.funcName.clear();
-            }
-            i = j;
-        } else {
-            char op = expr[i];
-            if (op == '+' || op == '-' || op == '*' || op == '/' || op == '^') {
-                bool isUnary = false;
-                if (op == '-') {
-                    if (tokens.empty() || (tokens.back().type == OPERATOR && tokens.back().op != ')')
-                        || (tokens.back().type == PARENTHESIS && tokens.back().op == '(')) {
-                        isUnary = true;
-                    }
-                }
-                if (isUnary) {
-                    newToken.type = NUMBER;
-                    newToken.value = 0;
-                    newToken.op = 0;
-                    newToken.funcName.clear();
-                    newToken.varName.clear();
-                    i++;
-                } else {
-                    newToken.type = OPERATOR;
-                    newToken.value = 0;
-                    newToken.op = op;
-                    newToken.funcName.clear();
-                    newToken.varName.clear();
-                    i++;
-                }
-            } else if (op == '(' || op == ')') {
-                newToken.type = PARENTHESIS;
-                newToken.value = 0;
-                newToken.op = op;
-                newToken.funcName.clear();
-                newToken.varName.clear();
-                i++;
+#ifdef CALC_HAVE_MMAP
+    struct stat info;
+    if (fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode) && info.st_size >= 8) {
+        auto mapped = std::make_unique<MappedFile>(fileno(file), static_cast<size_t>(info.st_size));
+        fclose(file);
+        if (!mapped->data)
+            throw std::runtime_error(std::string("cannot map ") + path);
+        madvise(const_cast<char*>(mapped->data), mapped->size, MADV_SEQUENTIAL);
+        columns.names.push_back(name);
+        columns.values.push_back(reinterpret_cast<const double*>(mapped->data));
+        columns.lengths.push_back(mapped->size / sizeof(double));
+        columns.mapped.push_back(std::move(mapped));
+        return;
+    }
+#endif
+
+    std::vector<double> values;
+    double block[4096];
+    size_t got;
+    while ((got = fread(block, sizeof(double), 4096, file)) > 0)
+        values.insert(values.end(), block, block + got);
+    fclose(file);
+    columns.add(name, std::move(values));
+}
+
+// Evaluates one expression over every row of the given columns and prints one
+// result per row, or with --reduce the sum, product, minimum or maximum of
+// all of them. Usage: --columns EXPR FILE.csv | --columns EXPR name=file.bin
+// ... [--reduce sum|prod|min|max]
+int runColumns(int argc, char* argv[]) {
+    if (argc < 4) {
+        std::cerr << "Usage: calculator --columns EXPR FILE.csv | --columns EXPR name=file.bin ... "
+                  << "[--reduce sum|prod|min|max]" << std::endl;
+        return 1;
+    }
+
+    try {
+        ColumnSet columns;
+        int reduction = -1;
+        for (int i = 3; i < argc; i++) {
+            std::string arg = argv[i];
+            size_t eqPos = arg.find('=');
+            if (arg == "--reduce" && i + 1 < argc) {
+                reduction = findReduction(argv[++i]);
+                if (reduction < 0 || isIntegral(reduction))
+                    throw std::runtime_error(std::string("Unknown reduction: ") + argv[i]);
+            } else if (eqPos == std::string::npos) {
+                loadCsvColumns(argv[i], columns);
             } else {
-                throw std::runtime_error(std::string("Invalid Character in expression!") + op);
+                loadBinaryColumn(arg.substr(0, eqPos), argv[i] + eqPos + 1, columns);
             }
         }
+        columns.rows = columns.lengths.empty() ? 0 : columns.lengths[0];
+        for (size_t c = 0; c < columns.lengths.size(); c++) {
+            if (columns.lengths[c] != columns.rows)
+                throw std::runtime_error("Column " + columns.names[c] + " has a different number of rows");
+        }
 
-        // Special handling for unary minus directly followed by '-' operator in input, e.g., "0-..."
-        if (newToken.type == NUMBER && newToken.value == 0 && i < expr.size() && expr[i] == '-') {
-            if (lastToken != nullptr) {
-                bool lastIsNumberVarOrCloseParen =
-                    (lastToken->type == NUMBER) ||
-                    (lastToken->type == VARIABLE) ||
-                    (lastToken->type == PARENTHESIS && lastToken->op == ')');
+        // Columns are bound as variables so the compiler resolves them to slots.
+        for (const auto& name : columns.names)
+            activeVariables->set(name, 0);
+        CompiledExpression program = compileExpression(argv[2]);
+        std::vector<ColumnBinding> bindings(activeVariables->size());
+        for (size_t slot = 0; slot < bindings.size(); slot++)
+            bindings[slot].scalar = activeVariables->values[slot];
+        for (size_t c = 0; c < columns.names.size(); c++)
+            bindings[activeVariables->find(columns.names[c])].column = columns.values[c];
 
-                bool newIsNumber = newToken.type == NUMBER;
+        if (reduction >= 0) {
+            if (columns.rows == 0 && (reduction == REDUCE_MIN || reduction == REDUCE_MAX))
+                throw std::runtime_error("There are no rows to reduce!");
+            double result = 0;
+            EvalStatus status = reduceRows(program, bindings, columns.rows, static_cast<ReductionKind>(reduction), result);
+            if (status != EVAL_OK)
+                throw std::runtime_error(evalErrorMessage(status));
+            OutputBuffer out(stdout, 64);
+            out.writeNumber(result);
+            out.put('\n');
+            out.flush();
+        } else {
+            std::vector<double> results(columns.rows);
+            std::vector<unsigned char> errors(columns.rows);
+            evaluateColumns(program, bindings, columns.rows, results.data(), errors.data());
 
-                if (lastIsNumberVarOrCloseParen && newIsNumber) {
-                    Token mulToken;
-                    mulToken.type = OPERATOR;
-                    mulToken.value = 0;
-                    mulToken.op = '*';
-                    mulToken.funcName.clear();
-                    mulToken.varName.clear();
-                    tokens.push_back(mulToken);
+            OutputBuffer out(stdout, 1 << 20);
+            for (size_t row = 0; row < columns.rows; row++) {
+                if (errors[row]) {
+                    out.write("Error: " + evalErrorMessage(static_cast<EvalStatus>(errors[row])) + "\n");
+                } else {
+                    out.writeNumber(results[row]);
+                    out.put('\n');
                 }
             }
+            out.flush();
+        }
+#ifdef CALC_STATS
+        std::cerr << statsReport();
+#endif
+    } catch (const std::exception& e) {
+        CALC_STAT_ADD(exceptions, 1);
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
 
-            tokens.push_back(newToken);
-            lastToken = &tokens.back();
+// One swept variable of a table: count points start, start + step, ...
+struct TableAxis {
+    std::string name;
+    double start = 0;
+    double step = 1;
+    uint64_t count = 0;
+};
 
-            Token minusToken;
-            minusToken.type = OPERATOR;
-            minusToken.value = 0;
-            minusToken.op = '-';
-            minusToken.funcName.clear();
-            minusToken.varName.clear();
-            tokens.push_back(minusToken);
-            lastToken = &tokens.back();
+enum TableFormat { TABLE_CSV, TABLE_BINARY };
 
-            i++;
+struct TableSpec {
+    std::string expression;
+    std::vector<TableAxis> axes;
+    TableFormat format = TABLE_CSV;
+    std::string path;  // empty for stdout
+};
 
-            continue;
+// Parses "name = a to b [step s]", where a, b and s may be expressions.
+TableAxis parseTableAxis(std::string_view text) {
+    auto evaluate = [](std::string_view expr) { return evaluateProgram(compileExpression(expr)); };
+    auto findWord = [&](std::string_view word, size_t from) {
+        for (size_t pos = text.find(word, from); pos != std::string_view::npos; pos = text.find(word, pos + 1)) {
+            bool before = pos > 0 && isspace(static_cast<unsigned char>(text[pos - 1]));
+            bool after = pos + word.size() < text.size() && isspace(static_cast<unsigned char>(text[pos + word.size()]));
+            if (before && after)
+                return pos;
         }
+        return std::string_view::npos;
+    };
 
-        if (lastToken != nullptr) {
-            bool lastIsNumberVarOrCloseParen =
-                (lastToken->type == NUMBER) ||
-                (lastToken->type == VARIABLE) ||
-                (lastToken->type == PARENTHESIS && lastToken->op == ')');
+    size_t eqPos = text.find('=');
+    size_t toPos = eqPos == std::string_view::npos ? eqPos : findWord("to", eqPos);
+    if (toPos == std::string_view::npos)
+        throw std::runtime_error("Usage: table EXPR for x = a to b step s[, y = ...]");
+    size_t stepPos = findWord("step", toPos);
 
-            bool newIsVarFuncNumberOrOpenParen =
-                (newToken.type == VARIABLE) ||
-                (newToken.type == FUNCTION) ||
-                (newToken.type == NUMBER) ||
-                (newToken.type == PARENTHESIS && newToken.op == '(');
+    TableAxis axis;
+    axis.name = std::string(trimView(text.substr(0, eqPos)));
+    if (axis.name.empty() || !std::all_of(axis.name.begin(), axis.name.end(), ::isalpha))
+        throw std::runtime_error("Invalid variable name!");
+    axis.start = evaluate(text.substr(eqPos + 1, toPos - eqPos - 1));
+    double end = evaluate(text.substr(toPos + 2, stepPos == std::string_view::npos ? stepPos : stepPos - toPos - 2));
+    if (stepPos != std::string_view::npos)
+        axis.step = evaluate(text.substr(stepPos + 4));
 
-            if (lastIsNumberVarOrCloseParen && newIsVarFuncNumberOrOpenParen) {
-                Token mulToken;
-                mulToken.type = OPERATOR;
-                mulToken.value = 0;
-                mulToken.op = '*';
-                mulToken.funcName.clear();
-                mulToken.varName.clear();
-                tokens.push_back(mulToken);
-            }
-        }
+    double steps = (end - axis.start) / axis.step;
+    if (axis.step == 0 || !std::isfinite(steps) || steps < 0)
+        throw std::runtime_error("The step of " + axis.name + " does not reach the end of its range!");
+    // Tolerate rounding in the quotient, so 0 to 1 step 0.1 includes 1.
+    double last = std::floor(steps + 1e-9 * std::max(1.0, steps));
+    if (last >= 0x1p63)
+        throw std::runtime_error("Table is too large!");
+    axis.count = static_cast<uint64_t>(last) + 1;
+    return axis;
+}
 
-        tokens.push_back(newToken);
-        lastToken = &tokens.back();
+// Parses "EXPR for x = a to b step s[, y = ...] [as csv|binary] [> FILE]".
+TableSpec parseTableSpec(std::string_view text) {
+    TableSpec spec;
+    size_t redirect = text.rfind('>');
+    if (redirect != std::string_view::npos) {
+        spec.path = std::string(trimView(text.substr(redirect + 1)));
+        text = text.substr(0, redirect);
+        if (spec.path.empty())
+            throw std::runtime_error("Missing output file after '>'!");
     }
 
-    return tokens;
-}
+    text = trimView(text);
+    size_t asPos = text.rfind(" as ");
+    if (asPos != std::string_view::npos) {
+        std::string_view format = trimView(text.substr(asPos + 4));
+        if (format == "csv")
+            spec.format = TABLE_CSV;
+        else if (format == "binary")
+            spec.format = TABLE_BINARY;
+        else
+            throw std::runtime_error("Unknown table format: " + std::string(format));
+        text = text.substr(0, asPos);
+    }
 
+    size_t forPos = text.find(" for ");
+    if (forPos == std::string_view::npos)
+        throw std::runtime_error("Usage: table EXPR for x = a to b step s[, y = ...]");
+    spec.expression = std::string(trimView(text.substr(0, forPos)));
 
-std::vector<Token> infixToPostfix(const std::vector<Token>& tokens) {
-    std::vector<Token> outputQueue;
-    std::stack<Token> opStack;
+    std::string_view ranges = text.substr(forPos + 5);
+    while (!ranges.empty()) {
+        size_t comma = ranges.find(',');
+        spec.axes.push_back(parseTableAxis(ranges.substr(0, comma)));
+        ranges = comma == std::string_view::npos ? std::string_view() : ranges.substr(comma + 1);
+    }
+    return spec;
+}
 
-    for (const auto& token : tokens) {
-        if (token.type == NUMBER) {
-            outputQueue.push_back(token);
-        } else if (token.type == OPERATOR) {
-            while (!opStack.empty() && opStack.top().type == OPERATOR &&
-                   (precedence(opStack.top().op) > precedence(token.op) ||
-                   (precedence(opStack.top().op) == precedence(token.op) && !isRightAssociative(token.op)))) {
-                outputQueue.push_back(opStack.top());
-                opStack.pop();
-            }
-            opStack.push(token);
-        } else if (token.type == PARENTHESIS) {
-            if (token.op == '(') {
-                opStack.push(token);
-            } else if (token.op == ')') {
-                bool foundLeftParenthesis = false;
-                while (!opStack.empty()) {
-                    if (opStack.top().type == PARENTHESIS && opStack.top().op == '(') {
-                        foundLeftParenthesis = true;
-                        opStack.pop();
-                        break;
-                    } else {
-                        outputQueue.push_back(opStack.top());
-                        opStack.pop();
-                    }
-                }
-                if (!foundLeftParenthesis) {
-                    throw std::runtime_error("Mismatched parenthesis in expression!");
-                }
+// Variables that a sweep defines for as long as it runs. Leaving the scope,
+// even by an exception, puts back what was there before: an old value is
+// assigned again through assignVariable(), and a variable the sweep created
+// is removed. A binding keeps its definition and gets its value back.
+class SweptVariables {
+public:
+    SweptVariables() = default;
+    SweptVariables(const SweptVariables&) = delete;
+    SweptVariables& operator=(const SweptVariables&) = delete;
 
-                if (!opStack.empty() && opStack.top().type == FUNCTION) {
-                    outputQueue.push_back(opStack.top());
-                    opStack.pop();
-                }
+    ~SweptVariables() {
+        for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+            if (!it->existed) {
+                activeVariables->removeLast();
+                continue;
+            }
+            int slot = activeVariables->find(it->name);
+            BindingGraph* graph = activeVariables->bindings.get();
+            if (graph && graph->isBound(slot)) {
+                activeVariables->values[slot] = it->value;
+                graph->propagate(slot);
+            } else {
+                assignVariable(it->name, it->value);
             }
-        } else if (token.type == FUNCTION) {
-            opStack.push(token);
         }
     }
 
-    while (!opStack.empty()) {
-        if (opStack.top().type == PARENTHESIS) {
-            throw std::runtime_error("Mismatched parenthesis in expression!");
-        }
-        outputQueue.push_back(opStack.top());
-        opStack.pop();
+    int set(const std::string& name, double value) {
+        int slot = activeVariables->find(name);
+        saved.push_back({name, slot >= 0, slot >= 0 ? activeVariables->values[slot] : 0});
+        return activeVariables->set(name, value);
     }
 
-    return outputQueue;
-}
+private:
+    struct Saved {
+        std::string name;
+        bool existed;
+        double value;
+    };
+    std::vector<Saved> saved;
+};
 
-double evaluatePostfix(const std::vector<Token>& postfix) {
-    std::stack<double> valStack;
+// Evaluates the expression at every point of the grid spanned by the axes,
+// the last axis varying fastest, and streams one row per point: the axis
+// values followed by the result. CSV numbers use the shortest text that reads
+// back to the same double; binary rows are native-endian doubles. Rows that
+// divide by zero get a NaN result. Points are generated and evaluated block by
+// block, so memory does not grow with the number of rows.
+uint64_t writeTable(const TableSpec& spec, FILE* file) {
+    SweptVariables swept;
+    std::vector<int> slots;
+    for (const auto& axis : spec.axes)
+        slots.push_back(swept.set(axis.name, axis.start));
+    CompiledExpression program = compileExpression(expandBindings(spec.expression, slots));
 
-    for (const auto& token : postfix) {
-        if (token.type == NUMBER) {
-            valStack.push(token.value);
-        } else if (token.type == OPERATOR) {
-            if (valStack.size() < 2)
-                throw std::runtime_error("Invalid expression!");
+    uint64_t rows = 1;
+    for (const auto& axis : spec.axes) {
+        if (axis.count > UINT64_MAX / rows)
+            throw std::runtime_error("Table is too large!");
+        rows *= axis.count;
+    }
 
-            double right = valStack.top();
-            valStack.pop();
-            double left = valStack.top();
-            valStack.pop();
-            double result = 0;
+    const size_t BLOCK = 16 * COLUMN_BLOCK;
+    size_t axisCount = spec.axes.size();
+    std::vector<double> points(axisCount * BLOCK);
+    std::vector<double> results(BLOCK);
+    std::vector<unsigned char> errors(BLOCK);
+    std::vector<ColumnBinding> bindings(activeVariables->size());
+    for (size_t slot = 0; slot < bindings.size(); slot++)
+        bindings[slot].scalar = activeVariables->values[slot];
+    for (size_t a = 0; a < axisCount; a++)
+        bindings[slots[a]].column = points.data() + a * BLOCK;
 
-            switch (token.op) {
-                case '+':
-                    result = left + right;
-                    break;
-                case '-':
-                    result = left - right;
-                    break;
-                case '*':
-                    result = left * right;
-                    break;
-                case '/':
-                    if (right == 0)
-                        throw std::runtime_error("Cannot divide by 0!");
-                    result = left / right;
-                    break;
-                case '^':
-                    result = std::pow(left, right);
+    OutputBuffer out(file, 1 << 20);
+    if (spec.format == TABLE_CSV) {
+        for (const auto& axis : spec.axes) {
+            out.write(axis.name);
+            out.put(',');
+        }
+        out.write("result\n");
+    }
+
+    std::vector<uint64_t> index(axisCount, 0);
+    std::vector<double> row(axisCount + 1);
+    for (uint64_t first = 0; first < rows; first += BLOCK) {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(BLOCK, rows - first));
+        for (size_t r = 0; r < n; r++) {
+            // Each value is start + i * step, so errors do not accumulate along an axis.
+            for (size_t a = 0; a < axisCount; a++)
+                points[a * BLOCK + r] = spec.axes[a].start + static_cast<double>(index[a]) * spec.axes[a].step;
+            for (size_t a = axisCount; a-- > 0;) {
+                if (++index[a] < spec.axes[a].count)
                     break;
-                default:
-                    throw std::runtime_error("Unknown operator!");
+                index[a] = 0;
             }
-            valStack.push(result);
-        } else if (token.type == FUNCTION) {
-            if (valStack.empty()) throw std::runtime_error("Missing argument for function!");
-            double arg = valStack.top(); valStack.pop();
-            double result;
-
-            if (token.funcName == "sin")
-                result = sin(arg);
-            else if (token.funcName == "cos")
-                result = cos(arg);
-            else if (token.funcName == "tan")
-                result = tan(arg);
-            else if (token.funcName == "log")
-                result = log10(arg);
-            else if (token.funcName == "ln")
-                result = log(arg);
-            else if (token.funcName == "sqrt")
-                result = sqrt(arg);
-            else if (token.funcName == "abs")
-                result = std::abs(arg);
-            else if (token.funcName == "exp")
-                result = std::exp(arg);
-            else
-                throw std::runtime_error("Unknown function: " + token.funcName);
+        }
 
-            valStack.push(result);
-        } else if (token.type == VARIABLE) {
-            if (!variables.count(token.varName)) {
-                throw std::runtime_error("Unknown variable: " + token.varName);
+        evaluateColumns(program, bindings, n, results.data(), errors.data());
+
+        for (size_t r = 0; r < n; r++) {
+            double value = errors[r] ? std::numeric_limits<double>::quiet_NaN() : results[r];
+            if (spec.format == TABLE_BINARY) {
+                for (size_t a = 0; a < axisCount; a++)
+                    row[a] = points[a * BLOCK + r];
+                row[axisCount] = value;
+                out.write(std::string_view(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(double)));
+            } else {
+                for (size_t a = 0; a < axisCount; a++) {
+                    out.writeShortest(points[a * BLOCK + r]);
+                    out.put(',');
+                }
+                out.writeShortest(value);
+                out.put('\n');
             }
-            valStack.push(variables[token.varName]);
         }
     }
-    if (valStack.size() != 1)
-        throw std::runtime_error("Invalid expression!");
-
-    return valStack.top();
+    out.flush();
+    return rows;
 }
 
-double evaluateExpressionWithVariable(const std::string& expr, const std::string& varName, double varValue) {
-    std::string replacedExpr = expr;
-    size_t pos = 0;
-    std::string varValueStr = "(" + std::to_string(varValue) + ")";
-    while ((pos = replacedExpr.find(varName, pos)) != std::string::npos) {
-        replacedExpr.replace(pos, varName.length(), varValueStr);
-        pos += varValueStr.length();
+// Writes the table to spec.path, or to stdout when there is none.
+uint64_t runTableSpec(const TableSpec& spec) {
+    if (spec.path.empty()) {
+        fflush(stdout);
+        return writeTable(spec, stdout);
     }
-    auto tokens = tokenize(replacedExpr);
-    auto postfix = infixToPostfix(tokens);
-    return evaluatePostfix(postfix);
+    FILE* file = fopen(spec.path.c_str(), "wb");
+    if (!file)
+        throw std::runtime_error("Cannot open " + spec.path);
+    uint64_t rows = 0;
+    try {
+        rows = writeTable(spec, file);
+    } catch (...) {
+        fclose(file);
+        throw;
+    }
+    if (fclose(file) != 0)
+        throw std::runtime_error("Cannot write " + spec.path);
+    return rows;
 }
 
-void solveLinearEquation(const std::string& equation) {
-    size_t eqPos = equation.find('=');
-    if (eqPos == std::string::npos) {
-        throw std::runtime_error("No '=' found in equation!");
+// Usage: --table "EXPR for x = a to b step s[, ...]" [--format csv|binary] [--output FILE]
+int runTable(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: calculator --table \"EXPR for x = a to b step s[, y = ...]\" "
+                  << "[--format csv|binary] [--output FILE]" << std::endl;
+        return 1;
     }
 
-    std::string lhs = equation.substr(0, eqPos);
-    std::string rhs = equation.substr(eqPos + 1);
-
-    // Find variable name by scanning lhs
-    std::string varName;
-    for (char ch : lhs) {
-        if (isalpha(ch)) {
-            varName += ch;
+    try {
+        TableSpec spec = parseTableSpec(argv[2]);
+        for (int i = 3; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--format" && i + 1 < argc) {
+                std::string format = argv[++i];
+                if (format != "csv" && format != "binary")
+                    throw std::runtime_error("Unknown table format: " + format);
+                spec.format = format == "csv" ? TABLE_CSV : TABLE_BINARY;
+            } else if ((arg == "--output" || arg == "-o") && i + 1 < argc) {
+                spec.path = argv[++i];
+            } else {
+                throw std::runtime_error("Unknown option: " + arg);
+            }
         }
+        runTableSpec(spec);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
     }
-    if (varName.empty()) {
-        std::cerr << "No variable found in equation." << std::endl;
-        return;
-    }
-
-    // Evaluate expression value with variable = 0 => constant term
-    double valAtZero = evaluateExpressionWithVariable(lhs + "-(" + rhs + ")", varName, 0);
-    // Evaluate expression value with variable = 1 => coeff + constant
-    double valAtOne = evaluateExpressionWithVariable(lhs + "-(" + rhs + ")", varName, 1);
-
-    double coeff = valAtOne - valAtZero;
-    double constant = valAtZero;
-
-    const double EPS = 1e-12;
-    if (std::abs(coeff) < EPS) {
-        if (std::abs(constant) < EPS)
-            std::cout << "Infinite solutions (identity equation)." << std::endl;
-        else
-            std::cout << "No solution (contradiction)." << std::endl;
-        return;
-    }
+    return 0;
+}
 
-    double x = -constant / coeff;
-    std::cout << varName << " = " << x << std::endl;
+// Tells the REPL user how many bindings a change recomputed and which failed.
+void reportBindingUpdate(const BindingUpdate& update) {
+    if (update.recomputed > 0)
+        std::cout << "(" << update.recomputed << (update.recomputed == 1 ? " binding" : " bindings")
+                  << " updated)" << std::endl;
+    for (const auto& error : update.errors)
+        std::cerr << "Error in " << error << std::endl;
 }
 
-int main() {
+#ifndef CALCULATOR_NO_MAIN
+int main(int argc, char* argv[]) {
     #ifdef _WIN32
         SetConsoleOutputCP(CP_UTF8);
     #endif
-    auto trim = [](std::string& s) {
-        s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](unsigned char ch){ return !std::isspace(ch); }));
-        s.erase(std::find_if(s.rbegin(), s.rend(), [](unsigned char ch){ return !std::isspace(ch); }).base(), s.end());
-    };
+    if (argc > 1 && std::string(argv[1]) == "--batch")
+        return runBatch(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "--columns")
+        return runColumns(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "--table")
+        return runTable(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "--eval-file")
+        return runEvalFile(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "--serve")
+        return runServe(argc, argv);
 
     std::cout << R"(
 
@@ -445,10 +8378,25 @@ int main() {
 
     )" << std::endl;
 
+    // Significant digits of the arbitrary precision mode; 0 while it is off.
+    size_t precisionDigits = 0;
+
+    if (argc > 2 && std::string(argv[1]) == "--workspace") {
+        try {
+            WorkspaceSummary summary = loadWorkspaceFile(argv[2], variables);
+            std::cout << "Loaded " << workspaceSummaryText(summary) << " from " << argv[2] << std::endl;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+        }
+    }
+
     while (true) {
         std::cout << "Enter expression to calculate (type 'help' for help):\n> ";
         std::string expression;
-        std::getline(std::cin, expression);
+        {
+            CALC_STAT_STAGE(STAGE_IO);
+            std::getline(std::cin, expression);
+        }
 
         if (expression == "exit" || expression == "EXIT" || expression == "Exit") {
             std::cout << "Goodbye! Thanks for using GorgiDev's Calculator.\n";
@@ -469,8 +8417,14 @@ int main() {
     You can assign variables:
         e.g. x = 3 * 5
 
-    You can solve linear equations in one variable:
+    You can bind a variable to a formula, spreadsheet style; it is
+    recomputed whenever a variable it reads changes:
+        e.g. area := w * h
+
+    You can solve linear equations and systems of them; with more
+    than one name, names that already have values are constants:
         e.g. 3x + 2 = 0
+             2x + y = 3; x - y = 0
 
     You can also use mathematical functions:
         sin
@@ -481,11 +8435,81 @@ int main() {
         sqrt
         abs
         exp
+        min(a, b)
+        max(a, b)
+        pow(a, b)
+        atan2(y, x)
+
+    You can define your own functions:
+        e.g. f(x, y) = sqrt(x^2 + y^2)
+             memo g(n) = ...    caches g's results
 
     Commands:
         exit   = quits the app
         help   = shows this message
         clear  = clears the screen
+        cache  = shows expression cache hits and misses
+        bindings = lists the variables bound with :=
+        save FILE = writes variables, functions and bindings
+                    to a workspace file
+        load FILE = replaces them with those in a workspace
+                    file (calculator --workspace FILE starts
+                    with one loaded)
+        stats  = shows time per stage and call counts (builds
+                 with -DCALC_STATS=ON only)
+        precision N   = evaluates with N significant digits of
+                        exact decimal arithmetic (e.g. precision
+                        1000 then pi); precision off goes back to
+                        doubles
+        :explain EXPR = shows the optimized program for EXPR
+        diff(EXPR, x) = derivative of EXPR with respect to x at
+                        the current value of x
+        sum(EXPR, k, a, b)  = EXPR added up over k = a, a + 1, ..., b
+                              (also prod, min and max)
+        integrate(EXPR, x, a, b[, tol])
+                            = integral of EXPR over x from a to b,
+                              to relative tolerance tol (1e-10)
+        table EXPR for x = a to b step s[, y = c to d step t]
+              [as csv|binary] [> FILE]
+                      = evaluates EXPR over a range or grid and
+                        writes one row per point
+
+    Matrices:
+        A = [[1, 2], [3, 4]]        a matrix, given by rows
+        v = [1, 2]                  a column vector
+        A * v, A * A, A^3           matrix products and powers
+        A + A, A .* A, A ./ 2       elementwise operators
+        det(A), inv(A), solve(A, v), transpose(A)
+        eye(n), zeros(r, c), ones(r, c), rand(r, c)
+
+    Nonlinear equations:
+        x^2 = 2                     finds every root in [-100, 100]
+        cos(x) = x in [0, 1]        searches the given interval instead
+
+    Batch mode:
+        calculator --batch [file] [--jobs N] [--workspace FILE]
+                                    evaluates one expression per line from
+                                    the file (or stdin) on N threads and
+                                    prints one result per line, in order
+        calculator --table "EXPR for x = a to b step s"
+                   [--format csv|binary] [--output FILE]
+                                    same as the table command
+        calculator --eval-file FILE
+                                    evaluates one expression of any size
+                                    from the file (or stdin for -) with
+                                    memory bounded by its nesting depth
+        calculator --serve PATH|- [--jobs N] [--workspace FILE]
+                                    answers JSON-lines requests such as
+                                    {"id": 1, "expr": "x^2"} on a Unix
+                                    socket (or stdin/stdout for -), with
+                                    one session per connection
+        calculator --columns EXPR data.csv
+        calculator --columns EXPR x=x.bin y=y.bin
+                                    evaluates EXPR once per row of a CSV
+                                    file with a header line, or of raw
+                                    binary double columns
+        calculator --columns EXPR FILES --reduce sum|prod|min|max
+                                    prints the sum (etc.) over all rows
 
     Note:
         ONLY ALPHABETIC EQUATIONS ALLOWED
@@ -499,23 +8523,189 @@ int main() {
             continue;
         }
 
+        if (expression == "cache" || expression == "CACHE" || expression == "Cache") {
+            std::cout << "Expression cache: " << expressionCache.hits() << " hits, "
+                      << expressionCache.misses() << " misses, "
+                      << expressionCache.size() << " entries" << std::endl;
+            continue;
+        }
+
+        if (expression == "bindings" || expression == "BINDINGS" || expression == "Bindings") {
+            if (activeVariables->bindings) {
+                for (const auto& binding : activeVariables->bindings->list())
+                    std::cout << binding << std::endl;
+            }
+            continue;
+        }
+
+        if (expression == "stats" || expression == "STATS" || expression == "Stats") {
+#ifdef CALC_STATS
+            std::cout << statsReport();
+#else
+            std::cout << "Statistics are not compiled in; rebuild with -DCALC_STATS=ON." << std::endl;
+#endif
+            continue;
+        }
+
         trim(expression);
         if (expression.empty())
             continue;
 
+        if (expression == "precision" || expression.rfind("precision ", 0) == 0) {
+            std::string argument = expression.substr(9);
+            trim(argument);
+            if (argument.empty()) {
+                if (precisionDigits)
+                    std::cout << "Precision: " << precisionDigits << " digits" << std::endl;
+                else
+                    std::cout << "Precision: double" << std::endl;
+            } else if (argument == "off" || argument == "0") {
+                precisionDigits = 0;
+                std::cout << "Precision: double" << std::endl;
+            } else {
+                size_t digits = 0;
+                auto res = std::from_chars(argument.data(), argument.data() + argument.size(), digits);
+                if (res.ec != std::errc() || res.ptr != argument.data() + argument.size() || digits > MAX_PRECISION_DIGITS) {
+                    std::cerr << "Error: precision must be a number of digits up to " << MAX_PRECISION_DIGITS
+                              << ", or off" << std::endl;
+                } else {
+                    precisionDigits = digits;
+                    std::cout << "Precision: " << precisionDigits << " digits" << std::endl;
+                }
+            }
+            continue;
+        }
+
+        if (expression.rfind("table ", 0) == 0) {
+            try {
+                TableSpec spec = parseTableSpec(std::string_view(expression).substr(6));
+                uint64_t rows = runTableSpec(spec);
+                if (!spec.path.empty())
+                    std::cout << "Wrote " << rows << " rows to " << spec.path << std::endl;
+            } catch (const std::exception& e) {
+                CALC_STAT_ADD(exceptions, 1);
+                std::cerr << "Error: " << e.what() << std::endl;
+            }
+            continue;
+        }
+
+        // "save = 3" assigns a variable called save.
+        if ((expression.rfind("save ", 0) == 0 || expression.rfind("load ", 0) == 0) &&
+            expression.find('=') == std::string::npos) {
+            std::string path = expression.substr(5);
+            trim(path);
+            try {
+                if (expression[0] == 's') {
+                    std::cout << "Saved " << workspaceSummaryText(saveWorkspace(path)) << " to " << path << std::endl;
+                } else {
+                    WorkspaceSummary summary = loadWorkspaceFile(path, variables);
+                    bigVariables.clear();
+                    std::cout << "Loaded " << workspaceSummaryText(summary) << " from " << path << std::endl;
+                }
+            } catch (const std::exception& e) {
+                CALC_STAT_ADD(exceptions, 1);
+                std::cerr << "Error: " << e.what() << std::endl;
+            }
+            continue;
+        }
+
+        if (expression.rfind(":explain", 0) == 0) {
+            try {
+                std::cout << explainProgram(expressionCache.get(expression.substr(8))) << std::endl;
+            } catch (const std::exception& e) {
+                CALC_STAT_ADD(exceptions, 1);
+                std::cerr << "Error: " << e.what() << std::endl;
+            }
+            continue;
+        }
+
+        IntegralReport report;
+        IntegralReportScope reportScope(&report);
+        std::string_view diffExpr, diffName;
+        try {
+            if (parseDiffCall(expression, diffExpr, diffName)) {
+                double slope = evaluateDerivative(diffExpr, diffName);
+                std::cout << "Result: " << slope << std::endl;
+                warnUnconverged(report);
+                continue;
+            }
+        } catch (const std::exception& e) {
+            CALC_STAT_ADD(exceptions, 1);
+            std::cerr << "Error: " << e.what() << std::endl;
+            continue;
+        }
+
+        std::string_view bound = bindingTarget(expression);
+        if (!bound.empty()) {
+            try {
+                BindingUpdate update;
+                std::string name(bound);
+                double value = bindVariable(name, expression.substr(expression.find(":=") + 2), update);
+                bigVariables.erase(name);
+                std::cout << name << " := " << value << std::endl;
+                warnUnconverged(report);
+                reportBindingUpdate(update);
+            } catch (const std::exception& e) {
+                CALC_STAT_ADD(exceptions, 1);
+                std::cerr << "Error: " << e.what() << std::endl;
+            }
+            continue;
+        }
+
+        FunctionDefinition definition;
+        if (parseFunctionDefinition(expression, definition)) {
+            try {
+                std::cout << "Defined " << defineFunction(definition) << std::endl;
+            } catch (const std::exception& e) {
+                CALC_STAT_ADD(exceptions, 1);
+                std::cerr << "Error: " << e.what() << std::endl;
+            }
+            continue;
+        }
+
+        if (isMatrixLine(expression)) {
+            try {
+                MatrixValue value;
+                BindingUpdate update;
+                std::string name(evaluateMatrixLine(expression, value, update));
+                std::string text;
+                if (value.matrix)
+                    appendMatrix(text, *value.matrix, appendNumber);
+                else
+                    appendNumber(text, value.scalar);
+                if (name.empty()) {
+                    std::cout << "Result: " << text << std::endl;
+                } else {
+                    bigVariables.erase(name);
+                    std::cout << name << " = " << text << std::endl;
+                    reportBindingUpdate(update);
+                }
+            } catch (const std::exception& e) {
+                CALC_STAT_ADD(exceptions, 1);
+                std::cerr << "Error: " << e.what() << std::endl;
+            }
+            continue;
+        }
+
         size_t eqPos = expression.find('=');
         if (eqPos != std::string::npos) {
             std::string beforeEq = expression.substr(0, eqPos);
             std::string afterEq = expression.substr(eqPos + 1);
 
-            // Check if there is any alphabetic character before '=' to distinguish equation vs assignment
-            bool isEquation = beforeEq.find_first_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ") != std::string::npos;
+            // A lone name before '=' is an assignment; any other alphabetic character makes it an equation
+            std::string target = beforeEq;
+            trim(target);
+            bool isAssignment = !target.empty() && std::all_of(target.begin(), target.end(), ::isalpha) &&
+                expression.find(';') == std::string::npos;
+            bool isEquation = !isAssignment &&
+                beforeEq.find_first_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ") != std::string::npos;
 
             if (isEquation) {
-                // Solve linear equation like "3x + 2 = 0"
+                // Solve an equation like "3x + 2 = 0" or "x^2 = 2"
                 try {
-                    solveLinearEquation(expression);
+                    std::cout << solveEquation(expression) << std::endl;
                 } catch (const std::exception& e) {
+                    CALC_STAT_ADD(exceptions, 1);
                     std::cerr << "Error solving equation: " << e.what() << std::endl;
                 }
             } else {
@@ -529,12 +8719,23 @@ int main() {
                 }
 
                 try {
-                    auto tokens = tokenize(afterEq);
-                    auto postfix = infixToPostfix(tokens);
-                    double val = evaluatePostfix(postfix);
-                    variables[varName] = val;
+                    if (precisionDigits) {
+                        BigFloat big = evaluateBig(afterEq, precisionDigits);
+                        std::string text = bigToString(big, precisionDigits);
+                        BindingUpdate update = assignVariable(varName, bigToDouble(big));
+                        bigVariables[varName] = std::move(big);
+                        std::cout << varName << " = " << text << std::endl;
+                        reportBindingUpdate(update);
+                        continue;
+                    }
+                    double val = evaluateProgram(expressionCache.get(afterEq));
+                    BindingUpdate update = assignVariable(varName, val);
+                    bigVariables.erase(varName);
                     std::cout << varName << " = " << val << std::endl;
+                    warnUnconverged(report);
+                    reportBindingUpdate(update);
                 } catch (const std::exception& e) {
+                    CALC_STAT_ADD(exceptions, 1);
                     std::cerr << "Error: " << e.what() << std::endl;
                 }
             }
@@ -543,17 +8744,28 @@ int main() {
 
         // If no '=', just evaluate expression normally
         try {
-            auto tokens = tokenize(expression);
-            auto postfix = infixToPostfix(tokens);
-            double result = evaluatePostfix(postfix);
-            std::cout << "Result: " << result << std::endl;
+            if (precisionDigits) {
+                std::string text = bigToString(evaluateBig(expression, precisionDigits), precisionDigits);
+                std::cout << "Result: " << text << std::endl;
+                continue;
+            }
+            double result = evaluateProgram(expressionCache.get(expression));
+            std::cout << "Result: " << result;
+            if (isIntegralLine(expression))
+                std::cout << " (estimated error " << report.error << ")";
+            std::cout << std::endl;
+            warnUnconverged(report);
         } catch (const std::invalid_argument&) {
+            CALC_STAT_ADD(exceptions, 1);
             std::cerr << "Error: Invalid number format\n";
         } catch (const std::out_of_range&) {
+            CALC_STAT_ADD(exceptions, 1);
             std::cerr << "Error: Number too large" << std::endl;
         } catch (const std::exception& e) {
+            CALC_STAT_ADD(exceptions, 1);
             std::cerr << "Error: " << e.what() << std::endl;
         }
     }
     return 0;
-}
\ No newline at end of file
+}
+#endif
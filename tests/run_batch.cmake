@@ -0,0 +1,29 @@
+# Runs one batch test: feeds INPUT to "calculator --batch" and fails unless
+# the output matches EXPECTED line for line. When INPUT has a .setup file
+# next to it, that is typed into the REPL first, and the batch run starts
+# from the workspace it saves as "test.workspace".
+get_filename_component(directory ${INPUT} DIRECTORY)
+get_filename_component(name ${INPUT} NAME_WE)
+set(setup ${directory}/${name}.setup)
+set(arguments)
+if(EXISTS ${setup})
+    execute_process(COMMAND ${CALCULATOR}
+                    INPUT_FILE ${setup}
+                    OUTPUT_QUIET
+                    RESULT_VARIABLE status)
+    if(NOT status EQUAL 0)
+        message(FATAL_ERROR "calculator exited with ${status} on ${setup}")
+    endif()
+    set(arguments --workspace test.workspace)
+endif()
+
+execute_process(COMMAND ${CALCULATOR} --batch ${INPUT} ${arguments}
+                OUTPUT_VARIABLE actual
+                RESULT_VARIABLE status)
+file(READ ${EXPECTED} expected)
+if(NOT status EQUAL 0)
+    message(FATAL_ERROR "calculator exited with ${status}")
+endif()
+if(NOT actual STREQUAL expected)
+    message(FATAL_ERROR "Output differs from ${EXPECTED}:\n${actual}")
+endif()
@@ -0,0 +1,14 @@
+# Runs one table test: each line of INPUT is passed to "calculator --table",
+# and the output and errors of all of them, in order, must match EXPECTED.
+file(STRINGS ${INPUT} specs)
+set(actual "")
+foreach(spec IN LISTS specs)
+    execute_process(COMMAND ${CALCULATOR} --table ${spec}
+                    OUTPUT_VARIABLE output
+                    ERROR_VARIABLE error)
+    string(APPEND actual "${output}${error}")
+endforeach()
+file(READ ${EXPECTED} expected)
+if(NOT actual STREQUAL expected)
+    message(FATAL_ERROR "Output differs from ${EXPECTED}:\n${actual}")
+endif()